@@ -10,6 +10,49 @@ CSPB 1300 Image Processing Application
 #include <fstream>
 #include <cmath>
 #include <iomanip>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <deque>
+#include <list>
+#include <cstring>
+#include <cstddef>
+#include <cstdint>
+#include <climits>
+#include <cerrno>
+#include <cstdlib>
+#include <string>
+#include <chrono>
+#include <new>
+#include <cstdio>
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <glob.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && __has_include(<sys/syscall.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define IMAGE_APP_IO_URING 1
+#endif
+#endif
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMAGE_APP_X86_SIMD 1
+#include <immintrin.h>
+#endif
 using namespace std;
 
 //***************************************************************************************************//
@@ -223,619 +266,9667 @@ bool write_image(string filename, const vector<vector<Pixel>>& image)
 //***************************************************************************************************//
 
 
-//************************************
-//     PROCESS 1
-//************************************
+//*****************************************
+//     INSTRUMENTATION
+//*****************************************
 
-// Function to apply a radial darkening effect to an image based on distance from the center
+// Heap bytes requested through operator new while the benchmark is counting
+atomic<bool> counting_allocations(false);
+atomic<unsigned long long> allocated_bytes(0);
 
-vector<vector<Pixel>> process_1(const vector<vector<Pixel>>& image)
+// Set while a trace is being recorded; every probe checks it before doing anything else
+atomic<bool> tracing_enabled(false);
+
+// Running totals for one thread, sampled by TraceScope when a scope opens and closes
+struct TraceCounters
 {
-    // Get the number of rows (height) of the image
-    int num_rows = image.size();
-    
-    
-    // Get the number of columns (width) of the image
-    int num_columns = image[0].size();
-    
-    
-    // Create a new 2D vector of Pixels with the same dimensions as the input image
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
-    
-    
-    // Loop through each row of the image
-    for (int row = 0; row < num_rows; row++)
+    unsigned long long allocations;       // operator new calls
+    unsigned long long allocated_bytes;   // Bytes they asked for
+    unsigned long long bytes_read;        // File bytes read or mapped for reading
+    unsigned long long bytes_written;     // File bytes written or mapped for writing
+};
+
+// Zero-initialized and trivially destructible, so operator new can use them on any thread
+thread_local TraceCounters trace_counters;
+thread_local int trace_depth;
+
+// Every allocation in the program goes through these, so the benchmark and
+// the tracer can report how much memory an operation asked for. With both
+// off the cost is two relaxed loads per allocation.
+void* operator new(size_t size)
+{
+    if (counting_allocations.load(memory_order_relaxed))
     {
-        // Loop through each column of the image
-        for (int col = 0; col < num_columns; col++)
-        {
-            
-            // Extract the red, green, and blue values of the current pixel
-            int blue_color = image[row][col].blue;
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green;
-            
-            
-            // Calculate the distance from the current pixel to the center of the image
-            double distance = sqrt(pow(col - num_columns/2.0,2) + pow(row - num_rows/2.0,2));
-            
-            // Calculate a scaling factor based on the distance (closer to center = brighter)
-            double scaling_factor = (num_rows - distance)/num_rows;
-            
-            // Scale the original color values using the scaling factor
-            int newred = red_color*scaling_factor;
-            int newgreen = green_color*scaling_factor;
-            int newblue = blue_color*scaling_factor;
-            
-            // Assign the adjusted color values to the corresponding pixel in the new image
-            new_image[row][col].blue = newblue;
-            new_image[row][col].red = newred;
-            new_image[row][col].green = newgreen;
-        }
+        allocated_bytes.fetch_add(size, memory_order_relaxed);
+    }
+    if (tracing_enabled.load(memory_order_relaxed))
+    {
+        trace_counters.allocations++;
+        trace_counters.allocated_bytes += size;
     }
+    void* result = malloc(size == 0 ? 1 : size);
+    if (!result)
+    {
+        throw bad_alloc();
+    }
+    return result;
+}
 
-    // Return the newly processed image with the radial darkening effect applied
-    return new_image;
+void* operator new[](size_t size)
+{
+    return operator new(size);
 }
 
+// Kept out of line: GCC flags free() inlined into callers as not matching operator new
+#ifdef __GNUC__
+__attribute__((noinline))
+#endif
+void operator delete(void* pointer) noexcept
+{
+    free(pointer);
+}
 
+void operator delete[](void* pointer) noexcept
+{
+    operator delete(pointer);
+}
 
-//************************************
-//     PROCESS 2
-//************************************
+// The sized forms C++14 compilers call when they know the size; without them
+// the library's versions would free memory this operator new handed out
+void operator delete(void* pointer, size_t) noexcept
+{
+    operator delete(pointer);
+}
 
-// Function to adjust pixel brightness based on lightness using a scaling factor
-vector<vector<Pixel>> process_2(const vector<vector<Pixel>>& image, double scaling_factor)
+void operator delete[](void* pointer, size_t) noexcept
 {
-    
-    // Get the number of rows (i.e. height) in the input image
-    int num_rows = image.size();
-    
-    // Get the number of columns (i.e. width) in the input image
-    int num_columns = image[0].size();
-    
-    //double scaling_factor = 0.3;
-    
-    // Create a new 2D vector with the same dimensions as the input image to store the modified pixels
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
-    
-    
-    
-    // Loop through each row in the input image
-    for (int row = 0; row < num_rows; row++)
+    operator delete(pointer);
+}
+
+// Adds file bytes read by this thread to the open scopes
+inline void trace_bytes_read(unsigned long long bytes)
+{
+    if (tracing_enabled.load(memory_order_relaxed))
+    {
+        trace_counters.bytes_read += bytes;
+    }
+}
+
+// Adds file bytes written by this thread to the open scopes
+inline void trace_bytes_written(unsigned long long bytes)
+{
+    if (tracing_enabled.load(memory_order_relaxed))
+    {
+        trace_counters.bytes_written += bytes;
+    }
+}
+
+// One closed scope
+struct TraceEvent
+{
+    const char* name;          // A string literal, so recording never copies it
+    const char* category;
+    int depth;                 // Scopes still open around it on the same thread
+    long long start;           // Nanoseconds since the trace started
+    long long duration;        // Nanoseconds
+    unsigned long long pixels; // Pixels the scope processed, if it says
+    TraceCounters counters;    // Counted while it was open, nested scopes included
+};
+
+/**
+ * Collects the events of every thread. Each thread appends to a buffer of
+ * its own, so recording takes no lock after a thread's first event; the
+ * buffers are only read once the traced work has finished.
+ */
+class Tracer
+{
+public:
+    /**
+     * Discards any earlier events and starts recording
+     * @return nothing
+     */
+    void start()
     {
-        // Loop through each column in the input image
-        for (int col = 0; col < num_columns; col++)
+        lock_guard<mutex> lock(buffers_mutex);
+        for (list<ThreadBuffer>::iterator buffer = buffers.begin(); buffer != buffers.end(); ++buffer)
         {
-            // Extract the red, green, and blue components of the current pixel
-            int blue_color = image[row][col].blue;
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green;
-            
-            // Compute the average brightness of the pixel
-            double average_value = (blue_color + red_color + green_color) / 3.0;
-            
-            // Declare variables to store the modified color values
-            int newred;
-            int newgreen;
-            int newblue;
-            
-            // If the pixel is bright, increase brightness further using inverse scaling
-            if (average_value >= 170)
-            { 
-                newred = 255 - (255 - red_color) * scaling_factor;
-                newgreen = 255 - (255 - green_color) * scaling_factor;
-                newblue = 255 - (255 - blue_color) * scaling_factor;
+            buffer->events.clear();
+        }
+        origin = chrono::steady_clock::now();
+        tracing_enabled = true;
+    }
+
+    /**
+     * Stops recording; scopes still open are recorded when they close
+     * @return nothing
+     */
+    void stop()
+    {
+        tracing_enabled = false;
+    }
+
+    // Nanoseconds since start()
+    long long now() const
+    {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - origin).count();
+    }
+
+    /**
+     * Appends an event to the calling thread's buffer. The buffer's own
+     * allocations are left out of the counters of the scopes around it.
+     * @param event the event
+     * @return nothing
+     */
+    void record(const TraceEvent& event)
+    {
+        thread_local ThreadBuffer* buffer = nullptr;
+        TraceCounters saved = trace_counters;
+        if (!buffer)
+        {
+            lock_guard<mutex> lock(buffers_mutex);
+            buffers.push_back(ThreadBuffer());
+            buffer = &buffers.back();
+            buffer->thread = buffers.size() - 1;
+            buffer->events.reserve(1024);
+        }
+        buffer->events.push_back(event);
+        trace_counters = saved;
+    }
+
+    /**
+     * Writes the events in the Chrome trace-event format, for chrome://tracing
+     * or Perfetto: one complete ("X") event per scope with its counters as
+     * arguments, and a name for each thread.
+     * @param stream the stream to write to
+     * @return nothing
+     */
+    void write_json(ostream& stream) const
+    {
+        lock_guard<mutex> lock(buffers_mutex);
+        stream << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        bool first = true;
+        for (list<ThreadBuffer>::const_iterator buffer = buffers.begin(); buffer != buffers.end(); ++buffer)
+        {
+            if (buffer->events.empty())
+            {
+                continue;
             }
-            
-            // If the pixel is dark, darken it further using direct scaling
-            else if (average_value < 90)
+            stream << (first ? "" : ",\n") << "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "
+                   << buffer->thread << ", \"args\": {\"name\": \"thread " << buffer->thread << "\"}}";
+            first = false;
+            for (size_t i = 0; i < buffer->events.size(); i++)
             {
-                newred = red_color * scaling_factor;
-                newgreen = green_color * scaling_factor;
-                newblue = blue_color * scaling_factor;                
+                const TraceEvent& event = buffer->events[i];
+                stream << ",\n  {\"name\": \"" << event.name << "\", \"cat\": \"" << event.category
+                       << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer->thread << fixed << setprecision(3)
+                       << ", \"ts\": " << event.start / 1e3 << ", \"dur\": " << event.duration / 1e3
+                       << ", \"args\": {\"pixels\": " << event.pixels
+                       << ", \"bytes_read\": " << event.counters.bytes_read
+                       << ", \"bytes_written\": " << event.counters.bytes_written
+                       << ", \"allocations\": " << event.counters.allocations
+                       << ", \"allocated_bytes\": " << event.counters.allocated_bytes << "}}";
+                stream.unsetf(ios::fixed);
+            }
+        }
+        stream << "\n]}\n";
+    }
+
+    /**
+     * Writes a table with one line per scope name, slowest total first, and
+     * then how long each thread spent inside outermost scopes
+     * @param stream the stream to write to
+     * @return nothing
+     */
+    void write_summary(ostream& stream) const
+    {
+        struct Stage
+        {
+            const char* name;
+            int calls;
+            long long total;
+            long long longest;
+            unsigned long long pixels;
+            TraceCounters counters;
+        };
+
+        lock_guard<mutex> lock(buffers_mutex);
+        map<string, Stage> stages;
+        vector<pair<int, long long> > busy;
+        for (list<ThreadBuffer>::const_iterator buffer = buffers.begin(); buffer != buffers.end(); ++buffer)
+        {
+            long long outermost = 0;
+            for (size_t i = 0; i < buffer->events.size(); i++)
+            {
+                const TraceEvent& event = buffer->events[i];
+                map<string, Stage>::iterator found = stages.find(event.name);
+                if (found == stages.end())
+                {
+                    Stage stage = { event.name, 0, 0, 0, 0, { 0, 0, 0, 0 } };
+                    found = stages.insert(make_pair(string(event.name), stage)).first;
+                }
+                Stage& stage = found->second;
+                stage.calls++;
+                stage.total += event.duration;
+                stage.longest = max(stage.longest, event.duration);
+                stage.pixels += event.pixels;
+                stage.counters.allocations += event.counters.allocations;
+                stage.counters.allocated_bytes += event.counters.allocated_bytes;
+                stage.counters.bytes_read += event.counters.bytes_read;
+                stage.counters.bytes_written += event.counters.bytes_written;
+                if (event.depth == 0)
+                {
+                    outermost += event.duration;
+                }
+            }
+            if (!buffer->events.empty())
+            {
+                busy.push_back(make_pair(buffer->thread, outermost));
+            }
+        }
+
+        vector<Stage> sorted;
+        for (map<string, Stage>::const_iterator stage = stages.begin(); stage != stages.end(); ++stage)
+        {
+            sorted.push_back(stage->second);
+        }
+        sort(sorted.begin(), sorted.end(), [](const Stage& a, const Stage& b) { return a.total > b.total; });
+
+        stream << left << setw(18) << "stage" << right << setw(8) << "calls" << setw(12) << "total ms"
+               << setw(10) << "mean ms" << setw(10) << "max ms" << setw(10) << "MP/s" << setw(10) << "MB read"
+               << setw(10) << "MB write" << setw(10) << "allocs" << setw(10) << "MB alloc" << endl;
+        for (size_t i = 0; i < sorted.size(); i++)
+        {
+            const Stage& stage = sorted[i];
+            stream << left << setw(18) << stage.name << right << fixed << setprecision(2)
+                   << setw(8) << stage.calls
+                   << setw(12) << stage.total / 1e6
+                   << setw(10) << stage.total / 1e6 / stage.calls
+                   << setw(10) << stage.longest / 1e6;
+            if (stage.pixels > 0 && stage.total > 0)
+            {
+                stream << setw(10) << stage.pixels * 1e3 / stage.total;
             }
-            
-            // If the pixel is neither too dark nor too bright, keep it unchanged
             else
             {
-                newred = red_color;
-                newgreen = green_color;
-                newblue = blue_color;
+                stream << setw(10) << "-";
             }
-            
-            // Assign the new color values to the corresponding pixel in the new image
-            new_image[row][col].blue = newblue;
-            new_image[row][col].red = newred;
-            new_image[row][col].green = newgreen;
+            stream << setw(10) << stage.counters.bytes_read / 1048576.0
+                   << setw(10) << stage.counters.bytes_written / 1048576.0
+                   << setw(10) << stage.counters.allocations
+                   << setw(10) << stage.counters.allocated_bytes / 1048576.0 << endl;
+            stream.unsetf(ios::fixed);
+        }
+
+        stream << endl << left << setw(18) << "thread" << right << setw(12) << "busy ms" << endl;
+        for (size_t i = 0; i < busy.size(); i++)
+        {
+            stream << left << setw(18) << busy[i].first << right << fixed << setprecision(2)
+                   << setw(12) << busy[i].second / 1e6 << endl;
+            stream.unsetf(ios::fixed);
         }
     }
 
-    // Return the modified image with adjusted brightness
-    return new_image;
+private:
+    struct ThreadBuffer
+    {
+        int thread;                   // Numbered in order of first event
+        vector<TraceEvent> events;
+    };
+
+    list<ThreadBuffer> buffers;       // A list, so buffers never move once handed out
+    mutable mutex buffers_mutex;
+    chrono::steady_clock::time_point origin;
+};
+
+/**
+ * Gets the tracer shared by every thread
+ * @return the tracer
+ */
+Tracer& tracer()
+{
+    static Tracer instance;
+    return instance;
+}
+
+/**
+ * Times the enclosing block and counts what its thread read, wrote and
+ * allocated meanwhile. While tracing is off constructing one costs a
+ * relaxed load and a branch.
+ */
+class TraceScope
+{
+public:
+    /**
+     * Opens a scope
+     * @param name     the stage name; must be a string literal or otherwise outlive the trace
+     * @param category the trace category, such as "decode", "filter" or "encode"
+     * @param pixels   the number of pixels the stage processes, for throughput
+     */
+    TraceScope(const char* name, const char* category, unsigned long long pixels = 0)
+        : active(tracing_enabled.load(memory_order_relaxed))
+    {
+        if (active)
+        {
+            event.name = name;
+            event.category = category;
+            event.depth = trace_depth++;
+            event.pixels = pixels;
+            event.counters = trace_counters;
+            event.start = tracer().now();
+        }
+    }
+
+    ~TraceScope()
+    {
+        if (active)
+        {
+            event.duration = tracer().now() - event.start;
+            event.counters.allocations = trace_counters.allocations - event.counters.allocations;
+            event.counters.allocated_bytes = trace_counters.allocated_bytes - event.counters.allocated_bytes;
+            event.counters.bytes_read = trace_counters.bytes_read - event.counters.bytes_read;
+            event.counters.bytes_written = trace_counters.bytes_written - event.counters.bytes_written;
+            trace_depth--;
+            tracer().record(event);
+        }
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+    // Sets the pixel count once it is known, such as after decoding
+    void set_pixels(unsigned long long pixels)
+    {
+        event.pixels = pixels;
+    }
+
+private:
+    bool active;
+    TraceEvent event;
+};
+
+/**
+ * Writes the trace as Chrome trace-event JSON to a file and its summary
+ * table to stderr
+ * @param filename the JSON file
+ * @return true if the file was written
+ */
+bool write_trace(const string& filename)
+{
+    tracer().write_summary(cerr);
+    fstream stream;
+    stream.open(filename, ios::out);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+    tracer().write_json(stream);
+    stream.close();
+    return !stream.fail();
 }
 
 
 //*****************************************
-//     PROCESS 3
+//     IMAGE BUFFER
 //*****************************************
 
-// Function to convert a color image to grayscale by averaging RGB values
-vector<vector<Pixel>> process_3(const vector<vector<Pixel>>& image)
+// Number of bytes in one packed pixel (blue, green, red)
+const int BYTES_PER_PIXEL = 3;
+
+/**
+ * Writable view of a packed 8-bit image.
+ * Pixels are stored blue, green, red (the BMP byte order) with no gaps inside
+ * a row. Consecutive rows are stride bytes apart; the stride may be negative so
+ * that a view can walk a bottom-up buffer starting from its top row.
+ */
+struct ImageView
 {
-    // Get the number of rows (height) in the image
-    int num_rows = image.size();
-    
-    // Get the number of columns (width) in the image
-    int num_columns = image[0].size();
-    
-    // Create a new 2D vector to store the grayscale image, with the same dimensions as the input
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
-    
-    // Loop through each row of the image
-    for (int row = 0; row < num_rows; row++)
+    unsigned char* data;   // First byte of the top row
+    int width;             // Width in pixels
+    int height;            // Height in pixels
+    ptrdiff_t stride;      // Bytes from the start of one row to the start of the next
+
+    unsigned char* row(int y) const
+    {
+        return data + y * stride;
+    }
+};
+
+/**
+ * Read-only view of a packed 8-bit image, laid out like ImageView
+ */
+struct ConstImageView
+{
+    const unsigned char* data;
+    int width;
+    int height;
+    ptrdiff_t stride;
+
+    ConstImageView() : data(nullptr), width(0), height(0), stride(0) {}
+
+    ConstImageView(const unsigned char* data, int width, int height, ptrdiff_t stride)
+        : data(data), width(width), height(height), stride(stride) {}
+
+    ConstImageView(const ImageView& view)
+        : data(view.data), width(view.width), height(view.height), stride(view.stride) {}
+
+    const unsigned char* row(int y) const
+    {
+        return data + y * stride;
+    }
+};
+
+/**
+ * Calculates the row stride used for packed images.
+ * Rows are padded to a multiple of four bytes, the same as a BMP scan line,
+ * so a row can be copied straight into a file.
+ * @param width the width in pixels
+ * @return the number of bytes between the starts of two rows
+ */
+ptrdiff_t packed_stride(int width)
+{
+    return ((ptrdiff_t)width * BYTES_PER_PIXEL + 3) / 4 * 4;
+}
+
+/**
+ * Image stored in one contiguous buffer of 8-bit blue, green, red pixels.
+ * Replaces vector<vector<Pixel>>, which costs one allocation per row and
+ * twelve bytes per pixel.
+ */
+struct Image
+{
+    int width;
+    int height;
+    ptrdiff_t stride;
+    vector<unsigned char> pixels;
+
+    Image() : width(0), height(0), stride(0) {}
+
+    Image(int width, int height)
+        : width(width), height(height), stride(packed_stride(width)),
+          pixels((size_t)packed_stride(width) * height)
     {
-        // Loop through each column of the image
-        for (int col = 0; col < num_columns; col++)
+    }
+
+    bool empty() const
+    {
+        return width == 0 || height == 0;
+    }
+
+    unsigned char* row(int y)
+    {
+        return &pixels[0] + y * stride;
+    }
+
+    const unsigned char* row(int y) const
+    {
+        return &pixels[0] + y * stride;
+    }
+
+    ImageView view()
+    {
+        ImageView result = { pixels.empty() ? nullptr : &pixels[0], width, height, stride };
+        return result;
+    }
+
+    ConstImageView view() const
+    {
+        return ConstImageView(pixels.empty() ? nullptr : &pixels[0], width, height, stride);
+    }
+};
+
+/**
+ * Narrows a computed channel value to 8 bits.
+ * write_image() stores each int channel into an unsigned char, so values outside
+ * 0-255 wrap around; doing the same here keeps saved files identical.
+ * @param value the channel value
+ * @return the stored byte
+ */
+inline unsigned char to_channel(int value)
+{
+    return (unsigned char)value;
+}
+
+/**
+ * Converts a legacy image to the packed representation
+ * @param image the image as a vector of vector of Pixels
+ * @return the packed image
+ */
+Image to_image(const vector<vector<Pixel>>& image)
+{
+    if (image.empty())
+    {
+        return Image();
+    }
+
+    Image result(image[0].size(), image.size());
+    for (int row = 0; row < result.height; row++)
+    {
+        unsigned char* out = result.row(row);
+        for (int col = 0; col < result.width; col++)
         {
-            
-            // Retrieve the red, green, and blue values of the current pixel
-            int blue_color = image[row][col].blue;
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green;
-            
-            
-            // Calculate the average of the RGB components to determine the gray shade
-            double gray_color = (red_color + green_color + blue_color) / 3.0;
-            
-            // Assign the same gray value to each RGB component to create a grayscale pixel
-            int newred = gray_color;
-            int newgreen = gray_color;
-            int newblue = gray_color;
-            
-            // Set the grayscale pixel values in the corresponding position of the new image
-            new_image[row][col].blue = newblue;
-            new_image[row][col].red = newred;
-            new_image[row][col].green = newgreen;
+            out[3 * col + 0] = to_channel(image[row][col].blue);
+            out[3 * col + 1] = to_channel(image[row][col].green);
+            out[3 * col + 2] = to_channel(image[row][col].red);
         }
     }
+    return result;
+}
 
-    // Return the newly created grayscale image
-    return new_image;
+/**
+ * Converts a packed image to the legacy representation
+ * @param image the packed image
+ * @return the image as a vector of vector of Pixels
+ */
+vector<vector<Pixel>> to_pixels(const Image& image)
+{
+    vector<vector<Pixel>> result(image.height, vector<Pixel>(image.width));
+    for (int row = 0; row < image.height; row++)
+    {
+        const unsigned char* in = image.row(row);
+        for (int col = 0; col < image.width; col++)
+        {
+            result[row][col].blue = in[3 * col + 0];
+            result[row][col].green = in[3 * col + 1];
+            result[row][col].red = in[3 * col + 2];
+        }
+    }
+    return result;
+}
+
+
+// Rectangle of pixels, such as a region of interest to crop to
+struct Rect
+{
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+/**
+ * Clips a rectangle to an image
+ * @param rect   the rectangle; replaced by its part inside the image
+ * @param width  the image width
+ * @param height the image height
+ * @return true if any of the rectangle is inside the image
+ */
+bool clip_rect(Rect& rect, int width, int height)
+{
+    int right = (int)min((long long)width, max(0LL, (long long)rect.x + rect.width));
+    int bottom = (int)min((long long)height, max(0LL, (long long)rect.y + rect.height));
+    rect.x = max(0, min(rect.x, width));
+    rect.y = max(0, min(rect.y, height));
+    rect.width = max(0, right - rect.x);
+    rect.height = max(0, bottom - rect.y);
+    return rect.width > 0 && rect.height > 0;
 }
 
+/**
+ * Views a region of an image without copying it
+ * @param image the image
+ * @param rect  the region; must lie inside the image (see clip_rect())
+ * @return the view of the region
+ */
+ConstImageView crop_view(ConstImageView image, Rect rect)
+{
+    return ConstImageView(image.row(rect.y) + BYTES_PER_PIXEL * rect.x, rect.width, rect.height, image.stride);
+}
 
 //*****************************************
-//     PROCESS 4
+//     IMAGE POOL
 //*****************************************
 
-// Function to rotate an image 90 degrees clockwise
-vector<vector<Pixel>> process_4(const vector<vector<Pixel>>& image)
+// Counters reported by ImagePool::stats()
+struct ImagePoolStats
 {
-    
-    // Get the number of rows (height) in the original image
-    int num_rows = image.size();
-    
-    // Get the number of columns (width) in the original image
-    int num_columns = image[0].size();
+    unsigned long long hits;        // acquire() calls served from the pool
+    unsigned long long misses;      // acquire() calls that allocated a new buffer
+    unsigned long long evictions;   // Buffers freed to stay under the capacity
+    size_t buffers_retained;        // Buffers waiting in the pool now
+    size_t bytes_retained;          // Their total size in bytes
+};
+
+/**
+ * Keeps the buffers of finished images for reuse by images of the same size.
+ * Filters take their output images from acquire(), and callers hand images
+ * they are done with to recycle(), so a long-running job that sees the same
+ * sizes again stops allocating and freeing hundreds of megabytes per image.
+ * When the retained bytes would exceed the capacity the oldest buffers are
+ * freed first.
+ */
+class ImagePool
+{
+public:
+    explicit ImagePool(size_t capacity) : capacity(capacity)
+    {
+        counters.hits = 0;
+        counters.misses = 0;
+        counters.evictions = 0;
+        counters.buffers_retained = 0;
+        counters.bytes_retained = 0;
+    }
+
+    /**
+     * Gets an image of the given size. A recycled buffer's pixels are left as
+     * they were, so callers must write every pixel.
+     * @param width  the width in pixels
+     * @param height the height in pixels
+     * @return the image
+     */
+    Image acquire(int width, int height)
+    {
+        {
+            lock_guard<mutex> lock(entries_mutex);
+
+            // Search from the newest buffer, which is the likeliest to still be cached
+            for (size_t i = entries.size(); i-- > 0; )
+            {
+                if (entries[i].width == width && entries[i].height == height)
+                {
+                    Image image;
+                    image.width = width;
+                    image.height = height;
+                    image.stride = packed_stride(width);
+                    image.pixels.swap(entries[i].pixels);
+                    entries.erase(entries.begin() + i);
+
+                    counters.hits++;
+                    counters.buffers_retained--;
+                    counters.bytes_retained -= image.pixels.size();
+                    return image;
+                }
+            }
+            counters.misses++;
+        }
+        return Image(width, height);
+    }
+
+    /**
+     * Takes the buffer of an image that is no longer needed
+     * @param image the image; moved from, so callers pass move(image)
+     * @return nothing
+     */
+    void recycle(Image image)
+    {
+        if (image.pixels.empty())
+        {
+            return;
+        }
+
+        Entry entry;
+        entry.width = image.width;
+        entry.height = image.height;
+        entry.pixels.swap(image.pixels);
+
+        // Evicted buffers are freed after the lock is released
+        deque<Entry> evicted;
+        lock_guard<mutex> lock(entries_mutex);
+        counters.buffers_retained++;
+        counters.bytes_retained += entry.pixels.size();
+        entries.push_back(move(entry));
+        trim(evicted);
+    }
+
+    // Sets the most bytes the pool keeps, freeing the oldest buffers if needed
+    void set_capacity(size_t bytes)
+    {
+        deque<Entry> evicted;
+        lock_guard<mutex> lock(entries_mutex);
+        capacity = bytes;
+        trim(evicted);
+    }
+
+    ImagePoolStats stats() const
+    {
+        lock_guard<mutex> lock(entries_mutex);
+        return counters;
+    }
+
+private:
+    struct Entry
+    {
+        int width;
+        int height;
+        vector<unsigned char> pixels;
+    };
+
+    // Moves the oldest buffers into evicted until the pool fits its capacity
+    void trim(deque<Entry>& evicted)
+    {
+        while (counters.bytes_retained > capacity)
+        {
+            counters.evictions++;
+            counters.buffers_retained--;
+            counters.bytes_retained -= entries.front().pixels.size();
+            evicted.push_back(move(entries.front()));
+            entries.pop_front();
+        }
+    }
+
+    size_t capacity;
+    deque<Entry> entries;           // Oldest first
+    ImagePoolStats counters;
+    mutable mutex entries_mutex;
+};
+
+// Bytes the shared pool keeps unless set_capacity() says otherwise
+const size_t DEFAULT_POOL_CAPACITY = (size_t)512 << 20;
+
+/**
+ * Gets the pool the filters draw their output images from
+ * @return the pool
+ */
+ImagePool& image_pool()
+{
+    static ImagePool pool(DEFAULT_POOL_CAPACITY);
+    return pool;
+}
+
+
+//*****************************************
+//     MEMORY-MAPPED FILES
+//*****************************************
+
+/**
+ * A file mapped into memory, read-only or read-write. The mapping and the
+ * file descriptor are released when the object is destroyed or closed.
+ * Where mmap() is not available open() and create() fail, and callers fall
+ * back to the stream-based functions.
+ */
+class MappedFile
+{
+public:
+    MappedFile() : bytes(nullptr), length(0), fd(-1) {}
+
+    ~MappedFile()
+    {
+        close();
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    /**
+     * Maps an existing file read-only
+     * @param filename the file
+     * @return true if the file is mapped; false for an empty or unmappable file
+     */
+    bool open(const string& filename)
+    {
+        close();
+#if defined(__unix__) || defined(__APPLE__)
+        fd = ::open(filename.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size <= 0)
+        {
+            close();
+            return false;
+        }
+        return map((size_t)info.st_size, PROT_READ);
+#else
+        (void)filename;
+        return false;
+#endif
+    }
+
+    /**
+     * Creates or truncates a file, sizes it and maps it read-write. The file
+     * reads as zeros until written. On Linux the blocks are allocated up
+     * front, so a full disk fails here instead of on a later write.
+     * @param filename the file
+     * @param size     the size of the file in bytes
+     * @return true if the file is mapped
+     */
+    bool create(const string& filename, size_t size)
+    {
+        close();
+#if defined(__unix__) || defined(__APPLE__)
+        fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        bool sized = fd >= 0 && size > 0 && ftruncate(fd, (off_t)size) == 0;
+#if defined(__linux__)
+        sized = sized && posix_fallocate(fd, 0, (off_t)size) == 0;
+#endif
+        if (!sized)
+        {
+            close();
+            return false;
+        }
+        return map(size, PROT_READ | PROT_WRITE);
+#else
+        (void)filename; (void)size;
+        return false;
+#endif
+    }
+
+    // Unmaps the file and closes it; changes to a read-write mapping reach the file
+    void close()
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        if (bytes)
+        {
+            munmap(bytes, length);
+        }
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+#endif
+        bytes = nullptr;
+        length = 0;
+        fd = -1;
+    }
+
+    unsigned char* data() const
+    {
+        return bytes;
+    }
+
+    size_t size() const
+    {
+        return length;
+    }
+
+private:
+#if defined(__unix__) || defined(__APPLE__)
+    bool map(size_t size, int protection)
+    {
+        void* address = mmap(nullptr, size, protection, MAP_SHARED, fd, 0);
+        if (address == MAP_FAILED)
+        {
+            close();
+            return false;
+        }
+        bytes = (unsigned char*)address;
+        length = size;
+
+        // Filters walk the pixels of an input front to back, so ask for aggressive read-ahead,
+        // and start reading now: batch mode maps inputs before a filter thread is free for them
+        if (!(protection & PROT_WRITE))
+        {
+            madvise(bytes, length, MADV_SEQUENTIAL);
+            madvise(bytes, length, MADV_WILLNEED);
+        }
+        return true;
+    }
+#endif
+
+    unsigned char* bytes;
+    size_t length;
+    int fd;
+};
+
+/**
+ * Checks whether two paths name the same existing file, through links or
+ * different spellings. Creating an output over a mapped input would
+ * truncate the pixels being read.
+ * @param first  a path
+ * @param second another path
+ * @return true if both exist and are the same file
+ */
+bool same_file(const string& first, const string& second)
+{
+#if defined(__unix__) || defined(__APPLE__)
+    struct stat first_info;
+    struct stat second_info;
+    return stat(first.c_str(), &first_info) == 0 && stat(second.c_str(), &second_info) == 0 &&
+           first_info.st_dev == second_info.st_dev && first_info.st_ino == second_info.st_ino;
+#else
+    return first == second;
+#endif
+}
+
+
+//*****************************************
+//     BMP INPUT AND OUTPUT
+//*****************************************
+
+/**
+ * Gets a little-endian integer from a byte buffer.
+ * Buffer counterpart of get_int() for the bulk loader.
+ * @param data   the buffer
+ * @param offset the offset at which to read the integer
+ * @param bytes  the number of bytes to read (at most 4)
+ * @return the unsigned integer starting at the given offset
+ */
+unsigned int get_int(const unsigned char* data, size_t offset, int bytes)
+{
+    unsigned int result = 0;
+    for (int i = bytes - 1; i >= 0; i--)
+    {
+        result = (result << 8) | data[offset + i];
+    }
+    return result;
+}
+
+// Where the pixel array of a BMP file lies and how its scan lines are stored
+struct BmpLayout
+{
+    int width;
+    int height;
+    bool top_down;            // Rows stored from the top down (negative height in the file)
+    int bytes_per_pixel;      // 3 for BGR, 4 for BGRA
+    size_t start;             // Offset of the pixel array
+    size_t scanline_stride;   // Bytes per stored scan line, padding included
+};
+
+/**
+ * Validates the headers of a BMP file and works out where its pixels are.
+ * Accepts uncompressed 24-bit BGR and 32-bit BGRA, stored bottom-up or
+ * top-down (negative height).
+ * @param data      the start of the file
+ * @param size      the number of bytes in data; at least the 66 header bytes
+ *                  unless the file is shorter
+ * @param file_size the size of the whole file
+ * @param layout    receives the layout
+ * @return true if this is a valid image
+ */
+bool parse_bmp_layout(const unsigned char* data, size_t size, size_t file_size, BmpLayout& layout)
+{
+    const size_t HEADERS_SIZE = 14 + 40;
+    if (size < HEADERS_SIZE || data[0] != 'B' || data[1] != 'M')
+    {
+        return false;
+    }
+
+    // Get the image properties
+    size_t start = get_int(data, 10, 4);
+    unsigned int dib_size = get_int(data, 14, 4);
+    int width = (int)get_int(data, 18, 4);
+    int height = (int)get_int(data, 22, 4);
+    int planes = get_int(data, 26, 2);
+    int bits_per_pixel = get_int(data, 28, 2);
+    int compression = get_int(data, 30, 4);
+
+    // A negative height marks a top-down image; INT_MIN has no positive counterpart
+    bool top_down = height < 0;
+    if (top_down)
+    {
+        if (height == INT_MIN)
+        {
+            return false;
+        }
+        height = -height;
+    }
+
+    if (dib_size < 40 || planes != 1 || width <= 0 || height <= 0 ||
+        (bits_per_pixel != 24 && bits_per_pixel != 32))
+    {
+        return false;
+    }
+
+    // Only BI_RGB, or BI_BITFIELDS with the standard BGRA masks, is stored as plain bytes
+    const int BI_RGB = 0;
+    const int BI_BITFIELDS = 3;
+    if (compression == BI_BITFIELDS)
+    {
+        if (bits_per_pixel != 32 || size < HEADERS_SIZE + 12 ||
+            get_int(data, 54, 4) != 0x00FF0000 || get_int(data, 58, 4) != 0x0000FF00 ||
+            get_int(data, 62, 4) != 0x000000FF)
+        {
+            return false;
+        }
+    }
+    else if (compression != BI_RGB)
+    {
+        return false;
+    }
+
+    // Scan lines must occupy multiples of four bytes
+    int bytes_per_pixel = bits_per_pixel / 8;
+    size_t scanline_stride = ((size_t)width * bytes_per_pixel + 3) / 4 * 4;
+
+    // Reject the file if the pixel array does not fit in it
+    if (start < HEADERS_SIZE || start > file_size || (file_size - start) / scanline_stride < (size_t)height)
+    {
+        return false;
+    }
+
+    layout.width = width;
+    layout.height = height;
+    layout.top_down = top_down;
+    layout.bytes_per_pixel = bytes_per_pixel;
+    layout.start = start;
+    layout.scanline_stride = scanline_stride;
+    return true;
+}
+
+/**
+ * Converts one stored scan line to packed blue, green, red pixels
+ * @param in              the stored scan line
+ * @param out             the packed row; may be the same as in for 24-bit scan lines
+ * @param width           the number of pixels
+ * @param bytes_per_pixel 3 for BGR, 4 for BGRA (alpha is ignored, as in read_image())
+ * @return nothing
+ */
+void unpack_scanline(const unsigned char* in, unsigned char* out, int width, int bytes_per_pixel)
+{
+    if (bytes_per_pixel == BYTES_PER_PIXEL)
+    {
+        // Already in blue, green, red order
+        if (in != out)
+        {
+            memcpy(out, in, (size_t)width * BYTES_PER_PIXEL);
+        }
+        return;
+    }
+
+    // Drop the alpha channel
+    for (int col = 0; col < width; col++)
+    {
+        out[3 * col + 0] = in[4 * col + 0];
+        out[3 * col + 1] = in[4 * col + 1];
+        out[3 * col + 2] = in[4 * col + 2];
+    }
+}
+
+/**
+ * Decodes a BMP file held in memory into a packed image.
+ * Accepts the formats parse_bmp_layout() does. Whole scan lines are decoded
+ * at once, with the row padding skipped by the stride.
+ * @param data the file contents
+ * @param size the number of bytes in data
+ * @return the packed image, empty if this is not a valid image
+ */
+Image decode_bmp(const unsigned char* data, size_t size)
+{
+    BmpLayout layout;
+    if (!parse_bmp_layout(data, size, size, layout))
+    {
+        return Image();
+    }
+
+    Image image = image_pool().acquire(layout.width, layout.height);
+    for (int i = 0; i < layout.height; i++)
+    {
+        // BMP files store pixels from bottom to top unless the height is negative
+        const unsigned char* in = data + layout.start + i * layout.scanline_stride;
+        unsigned char* out = image.row(layout.top_down ? i : layout.height - 1 - i);
+        unpack_scanline(in, out, layout.width, layout.bytes_per_pixel);
+    }
+    return image;
+}
+
+/**
+ * Reads the BMP image specified into a packed image.
+ * The file is mapped into memory, or where that is not possible read with a
+ * single call, and then decoded by decode_bmp(), instead of seeking and
+ * reading each pixel like read_image().
+ * @param filename BMP image filename
+ * @return the packed image, empty if this is not a valid image
+ */
+Image read_bmp(string filename)
+{
+    TraceScope scope("read_bmp", "decode");
+
+    // Decode straight out of the page cache when the file can be mapped
+    MappedFile file;
+    if (file.open(filename))
+    {
+        trace_bytes_read(file.size());
+        Image image = decode_bmp(file.data(), file.size());
+        scope.set_pixels((unsigned long long)image.width * image.height);
+        return image;
+    }
+
+    fstream stream;
+    stream.open(filename, ios::in | ios::binary | ios::ate);
+    if (!stream.is_open())
+    {
+        return Image();
+    }
+
+    // Size the buffer from the end position, then read everything at once
+    streamoff file_size = stream.tellg();
+    if (file_size <= 0)
+    {
+        return Image();
+    }
+    vector<unsigned char> contents((size_t)file_size);
+    stream.seekg(0);
+    stream.read((char*)&contents[0], file_size);
+    if (stream.gcount() != file_size)
+    {
+        return Image();
+    }
+    stream.close();
+    trace_bytes_read(contents.size());
+
+    Image image = decode_bmp(&contents[0], contents.size());
+    scope.set_pixels((unsigned long long)image.width * image.height);
+    return image;
+}
+
+// Size of the BMP header plus the 40-byte DIB header written by write_bmp()
+const int BMP_HEADERS_SIZE = 14 + 40;
+
+/**
+ * Reads only a region of a BMP image.
+ * The headers are read first, then just the scan lines that cross the region
+ * in a single call, and only the region's columns are converted. Enlarging
+ * one quadrant of a large image therefore reads a quarter of the file.
+ * @param filename BMP image filename
+ * @param region   the region to read; clipped to the image
+ * @return the region as a packed image, empty if this is not a valid image or
+ *         the region lies outside it
+ */
+Image read_bmp_region(string filename, Rect region)
+{
+    TraceScope scope("read_bmp_region", "decode");
+    fstream stream;
+    stream.open(filename, ios::in | ios::binary | ios::ate);
+    if (!stream.is_open())
+    {
+        return Image();
+    }
+    streamoff file_size = stream.tellg();
+    if (file_size <= 0)
+    {
+        return Image();
+    }
+
+    // The headers, including the 12 bytes of BI_BITFIELDS masks, come first
+    unsigned char headers[BMP_HEADERS_SIZE + 12];
+    size_t headers_size = min((size_t)file_size, sizeof(headers));
+    stream.seekg(0);
+    stream.read((char*)headers, headers_size);
+
+    BmpLayout layout;
+    if (!stream || !parse_bmp_layout(headers, headers_size, (size_t)file_size, layout) ||
+        !clip_rect(region, layout.width, layout.height))
+    {
+        return Image();
+    }
+
+    // Scan lines are stored bottom-up unless the height is negative
+    int first_scanline = layout.top_down ? region.y : layout.height - region.y - region.height;
+    vector<unsigned char> scanlines(layout.scanline_stride * region.height);
+    stream.seekg(layout.start + first_scanline * layout.scanline_stride);
+    stream.read((char*)&scanlines[0], scanlines.size());
+    if (!stream)
+    {
+        return Image();
+    }
+    trace_bytes_read(headers_size + scanlines.size());
+    scope.set_pixels((unsigned long long)region.width * region.height);
+
+    Image image = image_pool().acquire(region.width, region.height);
+    for (int i = 0; i < region.height; i++)
+    {
+        const unsigned char* in = &scanlines[i * layout.scanline_stride] + (size_t)layout.bytes_per_pixel * region.x;
+        unpack_scanline(in, image.row(layout.top_down ? i : region.height - 1 - i), region.width,
+                        layout.bytes_per_pixel);
+    }
+    return image;
+}
+
+/**
+ * Calculates the size of the 24-bit BMP file written for an image
+ * @param width  the width in pixels
+ * @param height the height in pixels
+ * @return the file size in bytes, headers and row padding included
+ */
+size_t bmp_file_size(int width, int height)
+{
+    return BMP_HEADERS_SIZE + (size_t)packed_stride(width) * height;
+}
+
+// Largest file the 32-bit size field of a BMP header can describe
+const size_t BMP_MAX_FILE_SIZE = 0xFFFFFFFF;
+
+/**
+ * Checks whether an image can be written as a BMP file
+ * @param width  the width in pixels
+ * @param height the height in pixels
+ * @return true if the size fits the header's fields and the file its size field
+ */
+bool fits_bmp(long long width, long long height)
+{
+    return width >= 0 && height >= 0 && width <= INT_MAX && height <= INT_MAX &&
+           bmp_file_size((int)width, (int)height) <= BMP_MAX_FILE_SIZE;
+}
+
+/**
+ * Fills in the BMP and DIB headers for a 24-bit image, with the same field
+ * values as write_image().
+ * @param headers  Array of BMP_HEADERS_SIZE bytes to fill
+ * @param width    Width of the bitmap in pixels
+ * @param height   Height of the bitmap in pixels (negative for top-down rows)
+ * @return nothing
+ */
+void set_bmp_headers(unsigned char headers[], int width, int height)
+{
+    int array_bytes = (int)(packed_stride(width) * (height < 0 ? -height : height));
+
+    memset(headers, 0, BMP_HEADERS_SIZE);
+
+    // BMP Header
+    set_bytes(headers,  0, 1, 'B');                 // ID field
+    set_bytes(headers,  1, 1, 'M');                 // ID field
+    set_bytes(headers,  2, 4, BMP_HEADERS_SIZE + array_bytes); // Size of BMP file
+    set_bytes(headers, 10, 4, BMP_HEADERS_SIZE);    // Pixel array offset
+
+    // DIB Header
+    set_bytes(headers, 14, 4, 40);                  // DIB header size
+    set_bytes(headers, 18, 4, width);               // Width of bitmap in pixels
+    set_bytes(headers, 22, 4, height);              // Height of bitmap in pixels
+    set_bytes(headers, 26, 2, 1);                   // Number of color planes
+    set_bytes(headers, 28, 2, 24);                  // Number of bits per pixel
+    set_bytes(headers, 34, 4, array_bytes);         // Size of raw bitmap data (including padding)
+    set_bytes(headers, 38, 4, 2835);                // Print resolution of image (2835 pixels/meter)
+    set_bytes(headers, 42, 4, 2835);                // Print resolution of image (2835 pixels/meter)
+}
+
+/**
+ * Encodes an image as a complete 24-bit BMP file into a caller-provided buffer
+ * @param image  The image to encode
+ * @param buffer Array of bmp_file_size(image.width, image.height) bytes
+ * @return nothing
+ */
+void encode_bmp(ConstImageView image, unsigned char buffer[])
+{
+    set_bmp_headers(buffer, image.width, image.height);
+
+    // Pixel array (bottom to top), each scan line zero padded to four bytes
+    size_t width_bytes = (size_t)image.width * BYTES_PER_PIXEL;
+    size_t scanline_stride = packed_stride(image.width);
+    unsigned char* out = buffer + BMP_HEADERS_SIZE;
+    for (int row = image.height - 1; row >= 0; row--)
+    {
+        memcpy(out, image.row(row), width_bytes);
+        memset(out + width_bytes, 0, scanline_stride - width_bytes);
+        out += scanline_stride;
+    }
+}
+
+/**
+ * Encodes an image as a complete 24-bit BMP file in memory, so it can be
+ * handed to the next stage without going through the filesystem
+ * @param image The image to encode
+ * @return the file contents
+ */
+vector<unsigned char> encode_bmp(const Image& image)
+{
+    vector<unsigned char> buffer(bmp_file_size(image.width, image.height));
+    encode_bmp(image.view(), &buffer[0]);
+    return buffer;
+}
+
+/**
+ * Writes a packed image to the BMP file name specified.
+ * Produces the same file as write_image(), but the file is assembled in one
+ * preallocated buffer and written with a single call.
+ * @param filename The BMP file name to save the image to
+ * @param image    The image to save
+ * @return True if successful and false otherwise
+ */
+bool write_bmp(string filename, const Image& image)
+{
+    TraceScope scope("write_bmp", "encode", (unsigned long long)image.width * image.height);
+    fstream stream;
+    stream.open(filename, ios::out | ios::binary);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+
+    vector<unsigned char> buffer = encode_bmp(image);
+    stream.write((char*)&buffer[0], buffer.size());
+    stream.close();
+    trace_bytes_written(buffer.size());
+    return !stream.fail();
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+/**
+ * Writes a packed image as a BMP file to an open file descriptor, such as a
+ * pipe or socket feeding the next stage. The descriptor is left open.
+ * @param fd    The file descriptor to write to
+ * @param image The image to save
+ * @return True if every byte was written and false otherwise
+ */
+bool write_bmp(int fd, const Image& image)
+{
+    TraceScope scope("write_bmp", "encode", (unsigned long long)image.width * image.height);
+    vector<unsigned char> buffer = encode_bmp(image);
+
+    // write() may accept fewer bytes than asked for on pipes and sockets
+    size_t written = 0;
+    while (written < buffer.size())
+    {
+        ssize_t result = write(fd, &buffer[written], buffer.size() - written);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        written += result;
+    }
+    trace_bytes_written(written);
+    return true;
+}
+#endif
+
+/**
+ * Exposes the pixel array of a mapped 24-bit BMP file as an image view,
+ * without copying. Bottom-up files get a negative stride starting from the
+ * top row, and the scan line padding lies between rows where the view never
+ * looks.
+ * @param file the mapped file
+ * @param view receives the view
+ * @return true for a valid 24-bit BMP; 32-bit files need converting with decode_bmp()
+ */
+bool map_bmp(const MappedFile& file, ConstImageView& view)
+{
+    BmpLayout layout;
+    if (!file.data() || !parse_bmp_layout(file.data(), file.size(), file.size(), layout) ||
+        layout.bytes_per_pixel != BYTES_PER_PIXEL)
+    {
+        return false;
+    }
+
+    // The pages are read as the view is, but count them here, once
+    trace_bytes_read(file.size());
+
+    ptrdiff_t stride = layout.scanline_stride;
+    const unsigned char* pixels = file.data() + layout.start;
+    view = layout.top_down ? ConstImageView(pixels, layout.width, layout.height, stride)
+                           : ConstImageView(pixels + (layout.height - 1) * stride, layout.width, layout.height,
+                                            -stride);
+    return true;
+}
+
+/**
+ * Creates a 24-bit BMP file of the given size, mapped for writing, with its
+ * headers already filled in by set_bmp_headers(). Filters write their output
+ * straight into the view; the padding at the end of each scan line is
+ * already zero. The file is complete once the MappedFile is closed.
+ * @param file     receives the mapping
+ * @param filename the file to create
+ * @param width    the width in pixels
+ * @param height   the height in pixels
+ * @param view     receives a view of the pixel array, top row first
+ * @return true if the file was created and mapped
+ */
+bool create_bmp(MappedFile& file, const string& filename, int width, int height, ImageView& view)
+{
+    if (width <= 0 || height <= 0 || !file.create(filename, bmp_file_size(width, height)))
+    {
+        return false;
+    }
+    set_bmp_headers(file.data(), width, height);
+    trace_bytes_written(file.size());
+
+    // Bottom-up scan lines: the top row is the last one in the file
+    view.width = width;
+    view.height = height;
+    view.stride = -packed_stride(width);
+    view.data = file.data() + BMP_HEADERS_SIZE + (height - 1) * packed_stride(width);
+    return true;
+}
+
+
+//*****************************************
+//     DECODED IMAGE CACHE
+//*****************************************
+
+/**
+ * Identifies one version of a file: its path, size and modification time.
+ * A file rewritten in place gets a new key, so stale images are never served.
+ */
+struct FileKey
+{
+    string path;
+    long long size;
+    long long mtime_ns;     // Nanoseconds where the platform records them, whole seconds otherwise
+
+    bool operator==(const FileKey& other) const
+    {
+        return path == other.path && size == other.size && mtime_ns == other.mtime_ns;
+    }
+};
+
+/**
+ * Looks up the size and modification time of a file
+ * @param path the file path
+ * @param key  receives the key
+ * @return true if the file exists
+ */
+bool file_key(const string& path, FileKey& key)
+{
+    key.path = path;
+#if defined(__unix__) || defined(__APPLE__)
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0)
+    {
+        return false;
+    }
+    key.size = info.st_size;
+#if defined(__linux__)
+    key.mtime_ns = info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+#elif defined(__APPLE__)
+    key.mtime_ns = info.st_mtimespec.tv_sec * 1000000000LL + info.st_mtimespec.tv_nsec;
+#else
+    key.mtime_ns = info.st_mtime * 1000000000LL;
+#endif
+    return true;
+#else
+    // Without stat() the size alone has to tell versions apart
+    fstream stream;
+    stream.open(path, ios::in | ios::binary | ios::ate);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+    key.size = stream.tellg();
+    key.mtime_ns = 0;
+    return true;
+#endif
+}
+
+/**
+ * Least recently used cache of decoded images.
+ * Repeated filters on the same source skip reading and decoding it. Images
+ * are shared read-only, and the least recently used ones are dropped once
+ * their total size passes the memory budget. Images that could not be read
+ * are not cached.
+ */
+class ImageCache
+{
+public:
+    explicit ImageCache(size_t budget) : budget(budget), bytes(0), hits(0), misses(0) {}
+
+    /**
+     * Gets the decoded image for a file, reading it on a miss
+     * @param path the BMP file path
+     * @return the image, empty if the file is not a readable BMP image
+     */
+    shared_ptr<const Image> load(const string& path)
+    {
+        FileKey key;
+        if (!file_key(path, key))
+        {
+            return make_shared<Image>();
+        }
+
+        {
+            lock_guard<mutex> lock(entries_mutex);
+            for (list<Entry>::iterator it = entries.begin(); it != entries.end(); ++it)
+            {
+                if (it->key == key)
+                {
+                    // Move to the front as the most recently used
+                    entries.splice(entries.begin(), entries, it);
+                    hits++;
+                    return it->image;
+                }
+            }
+            misses++;
+        }
+
+        // Decode outside the lock; two threads missing on one file both read it and one copy is kept
+        shared_ptr<const Image> image = make_shared<Image>(read_bmp(path));
+        if (image->empty())
+        {
+            return image;
+        }
+
+        lock_guard<mutex> lock(entries_mutex);
+        for (list<Entry>::iterator it = entries.begin(); it != entries.end(); )
+        {
+            // Drop older versions of the same file
+            if (it->key.path == path)
+            {
+                bytes -= it->image->pixels.size();
+                it = entries.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+        Entry entry = { key, image };
+        entries.push_front(entry);
+        bytes += image->pixels.size();
+        trim();
+        return image;
+    }
+
+    // Sets the most bytes of decoded pixels to keep, dropping images if needed
+    void set_budget(size_t new_budget)
+    {
+        lock_guard<mutex> lock(entries_mutex);
+        budget = new_budget;
+        trim();
+    }
+
+    // Number of loads served from the cache and loads that read the file
+    void counts(unsigned long long& cache_hits, unsigned long long& cache_misses) const
+    {
+        lock_guard<mutex> lock(entries_mutex);
+        cache_hits = hits;
+        cache_misses = misses;
+    }
+
+private:
+    struct Entry
+    {
+        FileKey key;
+        shared_ptr<const Image> image;
+    };
+
+    // Drops the least recently used images until the cache fits its budget
+    void trim()
+    {
+        while (bytes > budget)
+        {
+            bytes -= entries.back().image->pixels.size();
+            entries.pop_back();
+        }
+    }
+
+    size_t budget;
+    size_t bytes;
+    list<Entry> entries;            // Most recently used first
+    unsigned long long hits;
+    unsigned long long misses;
+    mutable mutex entries_mutex;
+};
+
+// Bytes of decoded pixels the shared cache keeps unless set_budget() says otherwise
+const size_t DEFAULT_CACHE_BUDGET = (size_t)256 << 20;
+
+/**
+ * Gets the cache the menu and batch mode load source images through
+ * @return the cache
+ */
+ImageCache& image_cache()
+{
+    static ImageCache cache(DEFAULT_CACHE_BUDGET);
+    return cache;
+}
+
+/**
+ * Copies an image into a buffer from the image pool, for filters that work
+ * in place on a shared source
+ * @param image the image to copy
+ * @return the copy
+ */
+Image copy_image(const Image& image)
+{
+    Image copy = image_pool().acquire(image.width, image.height);
+    if (!image.pixels.empty())
+    {
+        memcpy(&copy.pixels[0], &image.pixels[0], image.pixels.size());
+    }
+    return copy;
+}
+
+
+//*****************************************
+//     CHANNEL LOOKUP TABLES
+//*****************************************
+
+// Output byte for each of the 256 possible input values of one channel
+struct ChannelLut
+{
+    unsigned char values[256];
+};
+
+// Per-channel filter formula: the new channel value for an input value and scaling factor
+typedef int (*ChannelFunction)(int value, double scaling_factor);
+
+/**
+ * Gets the lookup table for a per-channel formula at a scaling factor.
+ * Tables are built once per (formula, factor) and cached, so filters that run
+ * at fixed factors over many images never evaluate the formula again. Entries
+ * are narrowed with to_channel(), so lookups match the formula exactly.
+ * @param function       the per-channel formula
+ * @param scaling_factor the scaling factor passed to the formula
+ * @return the lookup table
+ */
+ChannelLut channel_lut(ChannelFunction function, double scaling_factor)
+{
+    // Slider-driven callers can ask for many factors, so bound the cache
+    const size_t MAX_CACHED_TABLES = 256;
+
+    static map<pair<ChannelFunction, double>, ChannelLut> cache;
+    static mutex cache_mutex;
+
+    pair<ChannelFunction, double> key(function, scaling_factor);
+    {
+        lock_guard<mutex> lock(cache_mutex);
+        map<pair<ChannelFunction, double>, ChannelLut>::const_iterator found = cache.find(key);
+        if (found != cache.end())
+        {
+            return found->second;
+        }
+    }
+
+    ChannelLut lut;
+    for (int value = 0; value < 256; value++)
+    {
+        lut.values[value] = to_channel(function(value, scaling_factor));
+    }
+
+    // NaN factors do not order, so they are never cached
+    if (scaling_factor == scaling_factor)
+    {
+        lock_guard<mutex> lock(cache_mutex);
+        if (cache.size() >= MAX_CACHED_TABLES)
+        {
+            cache.clear();
+        }
+        cache[key] = lut;
+    }
+    return lut;
+}
+
+/**
+ * Replaces every byte of a buffer by its entry in a lookup table
+ * @param in    the input bytes
+ * @param out   the output bytes; may be the same as in
+ * @param count the number of bytes
+ * @param lut   the lookup table
+ * @return nothing
+ */
+void apply_lut(const unsigned char* in, unsigned char* out, size_t count, const ChannelLut& lut)
+{
+    const unsigned char* table = lut.values;
+    size_t i = 0;
+
+    // Four independent gathers per iteration keep the load ports busy
+    for (; i + 4 <= count; i += 4)
+    {
+        unsigned char a = table[in[i + 0]];
+        unsigned char b = table[in[i + 1]];
+        unsigned char c = table[in[i + 2]];
+        unsigned char d = table[in[i + 3]];
+        out[i + 0] = a;
+        out[i + 1] = b;
+        out[i + 2] = c;
+        out[i + 3] = d;
+    }
+    for (; i < count; i++)
+    {
+        out[i] = table[in[i]];
+    }
+}
+
+
+//*****************************************
+//     SIMD KERNELS
+//*****************************************
+
+// Instruction sets the row kernels can use
+enum SimdLevel
+{
+    SIMD_SCALAR,   // Plain loops only
+    SIMD_SSSE3,    // 128-bit registers (SSSE3 adds the byte shuffle needed to split BGR triplets)
+    SIMD_AVX2      // 256-bit registers
+};
+
+/**
+ * Finds the widest instruction set this CPU supports
+ * @return the detected level
+ */
+SimdLevel detect_simd_level()
+{
+#ifdef IMAGE_APP_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        return SIMD_SSSE3;
+    }
+#endif
+    return SIMD_SCALAR;
+}
+
+// Level used by the row kernels, detected on first use
+SimdLevel active_simd_level = detect_simd_level();
+
+/**
+ * Selects the instruction set for the row kernels, for example to compare the
+ * vector kernels against the scalar fallback. Levels the CPU does not support
+ * are lowered to the best one it does.
+ * @param level the requested level
+ * @return nothing
+ */
+void set_simd_level(SimdLevel level)
+{
+    active_simd_level = min(level, detect_simd_level());
+}
+
+#ifdef IMAGE_APP_X86_SIMD
+
+// Splits 16 packed pixels (48 bytes) into vectors of their blue, green and red values
+static inline __attribute__((target("ssse3")))
+void split_bgr(const unsigned char* in, __m128i& blue, __m128i& green, __m128i& red)
+{
+    __m128i v0 = _mm_loadu_si128((const __m128i*)(in + 0));
+    __m128i v1 = _mm_loadu_si128((const __m128i*)(in + 16));
+    __m128i v2 = _mm_loadu_si128((const __m128i*)(in + 32));
+
+    blue = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(v0, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+        _mm_shuffle_epi8(v1, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1))),
+        _mm_shuffle_epi8(v2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)));
+    green = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(v0, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+        _mm_shuffle_epi8(v1, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1))),
+        _mm_shuffle_epi8(v2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)));
+    red = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(v0, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+        _mm_shuffle_epi8(v1, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1))),
+        _mm_shuffle_epi8(v2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)));
+}
+
+// Joins vectors of blue, green and red values into 16 packed pixels
+static inline __attribute__((target("ssse3")))
+void join_bgr(__m128i blue, __m128i green, __m128i red, unsigned char* out)
+{
+    __m128i v0 = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(blue, _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5)),
+        _mm_shuffle_epi8(green, _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1))),
+        _mm_shuffle_epi8(red, _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1)));
+    __m128i v1 = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(blue, _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1)),
+        _mm_shuffle_epi8(green, _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10))),
+        _mm_shuffle_epi8(red, _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1)));
+    __m128i v2 = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(blue, _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1)),
+        _mm_shuffle_epi8(green, _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1))),
+        _mm_shuffle_epi8(red, _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15)));
+
+    _mm_storeu_si128((__m128i*)(out + 0), v0);
+    _mm_storeu_si128((__m128i*)(out + 16), v1);
+    _mm_storeu_si128((__m128i*)(out + 32), v2);
+}
+
+// Writes 16 values as 16 packed pixels whose three channels all equal the value
+static inline __attribute__((target("ssse3")))
+void join_gray(__m128i gray, unsigned char* out)
+{
+    _mm_storeu_si128((__m128i*)(out + 0),
+        _mm_shuffle_epi8(gray, _mm_setr_epi8(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5)));
+    _mm_storeu_si128((__m128i*)(out + 16),
+        _mm_shuffle_epi8(gray, _mm_setr_epi8(5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10)));
+    _mm_storeu_si128((__m128i*)(out + 32),
+        _mm_shuffle_epi8(gray, _mm_setr_epi8(10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15)));
+}
+
+// Divides 16-bit sums of three channels by three, rounding down.
+// (sum * 21846) >> 16 equals sum / 3 for every sum from 0 to 765.
+static inline __attribute__((target("ssse3")))
+__m128i divide_by_3(__m128i sum)
+{
+    return _mm_mulhi_epu16(sum, _mm_set1_epi16(21846));
+}
+
+static inline __attribute__((target("avx2")))
+__m256i divide_by_3(__m256i sum)
+{
+    return _mm256_mulhi_epu16(sum, _mm256_set1_epi16(21846));
+}
+
+// Adds the blue, green and red values of 8 pixels (SSSE3) or 16 pixels (AVX2) into 16-bit lanes
+static inline __attribute__((target("ssse3")))
+__m128i sum_low(__m128i blue, __m128i green, __m128i red)
+{
+    __m128i zero = _mm_setzero_si128();
+    return _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(blue, zero), _mm_unpacklo_epi8(green, zero)),
+                         _mm_unpacklo_epi8(red, zero));
+}
+
+static inline __attribute__((target("ssse3")))
+__m128i sum_high(__m128i blue, __m128i green, __m128i red)
+{
+    __m128i zero = _mm_setzero_si128();
+    return _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(blue, zero), _mm_unpackhi_epi8(green, zero)),
+                         _mm_unpackhi_epi8(red, zero));
+}
+
+static inline __attribute__((target("avx2")))
+__m256i sum_wide(__m128i blue, __m128i green, __m128i red)
+{
+    return _mm256_add_epi16(_mm256_add_epi16(_mm256_cvtepu8_epi16(blue), _mm256_cvtepu8_epi16(green)),
+                            _mm256_cvtepu8_epi16(red));
+}
+
+// Packs two vectors of 16 words into 32 bytes in their original order
+static inline __attribute__((target("avx2")))
+__m256i pack_words(__m256i first, __m256i second, bool is_signed)
+{
+    __m256i packed = is_signed ? _mm256_packs_epi16(first, second) : _mm256_packus_epi16(first, second);
+    return _mm256_permute4x64_epi64(packed, 0xD8);
+}
+
+// Grayscale: each channel becomes (blue + green + red) / 3
+
+__attribute__((target("ssse3")))
+int process_3_ssse3(const unsigned char* in, unsigned char* out, int width)
+{
+    int col = 0;
+    for (; col + 16 <= width; col += 16)
+    {
+        __m128i blue, green, red;
+        split_bgr(in + 3 * col, blue, green, red);
+        __m128i gray = _mm_packus_epi16(divide_by_3(sum_low(blue, green, red)),
+                                        divide_by_3(sum_high(blue, green, red)));
+        join_gray(gray, out + 3 * col);
+    }
+    return col;
+}
+
+__attribute__((target("avx2")))
+int process_3_avx2(const unsigned char* in, unsigned char* out, int width)
+{
+    int col = 0;
+    for (; col + 32 <= width; col += 32)
+    {
+        __m128i blue0, green0, red0, blue1, green1, red1;
+        split_bgr(in + 3 * col, blue0, green0, red0);
+        split_bgr(in + 3 * col + 48, blue1, green1, red1);
+        __m256i gray = pack_words(divide_by_3(sum_wide(blue0, green0, red0)),
+                                  divide_by_3(sum_wide(blue1, green1, red1)), false);
+        join_gray(_mm256_castsi256_si128(gray), out + 3 * col);
+        join_gray(_mm256_extracti128_si256(gray, 1), out + 3 * col + 48);
+    }
+    return col + process_3_ssse3(in + 3 * col, out + 3 * col, width - col);
+}
+
+// Gray levels: one byte of (blue + green + red) / 3 per pixel, for the histograms
+
+__attribute__((target("ssse3")))
+int gray_levels_ssse3(const unsigned char* in, unsigned char* gray, int width)
+{
+    int col = 0;
+    for (; col + 16 <= width; col += 16)
+    {
+        __m128i blue, green, red;
+        split_bgr(in + 3 * col, blue, green, red);
+        _mm_storeu_si128((__m128i*)(gray + col), _mm_packus_epi16(divide_by_3(sum_low(blue, green, red)),
+                                                                  divide_by_3(sum_high(blue, green, red))));
+    }
+    return col;
+}
+
+__attribute__((target("avx2")))
+int gray_levels_avx2(const unsigned char* in, unsigned char* gray, int width)
+{
+    int col = 0;
+    for (; col + 32 <= width; col += 32)
+    {
+        __m128i blue0, green0, red0, blue1, green1, red1;
+        split_bgr(in + 3 * col, blue0, green0, red0);
+        split_bgr(in + 3 * col + 48, blue1, green1, red1);
+        _mm256_storeu_si256((__m256i*)(gray + col), pack_words(divide_by_3(sum_wide(blue0, green0, red0)),
+                                                               divide_by_3(sum_wide(blue1, green1, red1)), false));
+    }
+    return col + gray_levels_ssse3(in + 3 * col, gray + col, width - col);
+}
+
+// High contrast: white when (blue + green + red) / 3 >= threshold, black otherwise
+
+__attribute__((target("ssse3")))
+int process_7_ssse3(const unsigned char* in, unsigned char* out, int width, int threshold_level)
+{
+    __m128i threshold = _mm_set1_epi8((char)threshold_level);
+    int col = 0;
+    for (; col + 16 <= width; col += 16)
+    {
+        __m128i blue, green, red;
+        split_bgr(in + 3 * col, blue, green, red);
+        __m128i gray = _mm_packus_epi16(divide_by_3(sum_low(blue, green, red)),
+                                        divide_by_3(sum_high(blue, green, red)));
+        // gray >= threshold exactly when max(gray, threshold) == gray
+        join_gray(_mm_cmpeq_epi8(_mm_max_epu8(gray, threshold), gray), out + 3 * col);
+    }
+    return col;
+}
+
+__attribute__((target("avx2")))
+int process_7_avx2(const unsigned char* in, unsigned char* out, int width, int threshold_level)
+{
+    __m256i threshold = _mm256_set1_epi16(threshold_level - 1);
+    int col = 0;
+    for (; col + 32 <= width; col += 32)
+    {
+        __m128i blue0, green0, red0, blue1, green1, red1;
+        split_bgr(in + 3 * col, blue0, green0, red0);
+        split_bgr(in + 3 * col + 48, blue1, green1, red1);
+        __m256i white = pack_words(_mm256_cmpgt_epi16(divide_by_3(sum_wide(blue0, green0, red0)), threshold),
+                                   _mm256_cmpgt_epi16(divide_by_3(sum_wide(blue1, green1, red1)), threshold), true);
+        join_gray(_mm256_castsi256_si128(white), out + 3 * col);
+        join_gray(_mm256_extracti128_si256(white, 1), out + 3 * col + 48);
+    }
+    return col + process_7_ssse3(in + 3 * col, out + 3 * col, width - col, threshold_level);
+}
+
+// Color dominance: white when the sum is at least 550, black when at most 150,
+// otherwise pure red, green or blue for the largest channel (ties go to red, then green)
+
+// Replaces 16 blue, green and red values by their color dominance result
+static inline __attribute__((target("ssse3")))
+void dominance_channels(__m128i& blue, __m128i& green, __m128i& red, __m128i white, __m128i black)
+{
+    __m128i max_color = _mm_max_epu8(_mm_max_epu8(blue, green), red);
+    __m128i red_max = _mm_cmpeq_epi8(max_color, red);
+    __m128i green_max = _mm_andnot_si128(red_max, _mm_cmpeq_epi8(max_color, green));
+    __m128i blue_max = _mm_andnot_si128(_mm_or_si128(red_max, green_max), _mm_set1_epi8(-1));
+    __m128i colored = _mm_andnot_si128(_mm_or_si128(white, black), _mm_set1_epi8(-1));
+
+    blue = _mm_or_si128(white, _mm_and_si128(colored, blue_max));
+    green = _mm_or_si128(white, _mm_and_si128(colored, green_max));
+    red = _mm_or_si128(white, _mm_and_si128(colored, red_max));
+}
+
+static inline __attribute__((target("ssse3")))
+void color_dominance(__m128i blue, __m128i green, __m128i red, __m128i white, __m128i black,
+                     unsigned char* out)
+{
+    dominance_channels(blue, green, red, white, black);
+    join_bgr(blue, green, red, out);
+}
+
+__attribute__((target("ssse3")))
+int process_10_ssse3(const unsigned char* in, unsigned char* out, int width)
+{
+    __m128i white_limit = _mm_set1_epi16(550 - 1);
+    __m128i black_limit = _mm_set1_epi16(150 + 1);
+    int col = 0;
+    for (; col + 16 <= width; col += 16)
+    {
+        __m128i blue, green, red;
+        split_bgr(in + 3 * col, blue, green, red);
+        __m128i sum0 = sum_low(blue, green, red);
+        __m128i sum1 = sum_high(blue, green, red);
+        __m128i white = _mm_packs_epi16(_mm_cmpgt_epi16(sum0, white_limit), _mm_cmpgt_epi16(sum1, white_limit));
+        __m128i black = _mm_packs_epi16(_mm_cmplt_epi16(sum0, black_limit), _mm_cmplt_epi16(sum1, black_limit));
+        color_dominance(blue, green, red, white, black, out + 3 * col);
+    }
+    return col;
+}
+
+__attribute__((target("avx2")))
+int process_10_avx2(const unsigned char* in, unsigned char* out, int width)
+{
+    __m256i white_limit = _mm256_set1_epi16(550 - 1);
+    __m256i black_limit = _mm256_set1_epi16(150 + 1);
+    int col = 0;
+    for (; col + 32 <= width; col += 32)
+    {
+        __m128i blue0, green0, red0, blue1, green1, red1;
+        split_bgr(in + 3 * col, blue0, green0, red0);
+        split_bgr(in + 3 * col + 48, blue1, green1, red1);
+        __m256i sum0 = sum_wide(blue0, green0, red0);
+        __m256i sum1 = sum_wide(blue1, green1, red1);
+        __m256i white = pack_words(_mm256_cmpgt_epi16(sum0, white_limit),
+                                   _mm256_cmpgt_epi16(sum1, white_limit), true);
+        __m256i black = pack_words(_mm256_cmpgt_epi16(black_limit, sum0),
+                                   _mm256_cmpgt_epi16(black_limit, sum1), true);
+        color_dominance(blue0, green0, red0, _mm256_castsi256_si128(white),
+                        _mm256_castsi256_si128(black), out + 3 * col);
+        color_dominance(blue1, green1, red1, _mm256_extracti128_si256(white, 1),
+                        _mm256_extracti128_si256(black, 1), out + 3 * col + 48);
+    }
+    return col + process_10_ssse3(in + 3 * col, out + 3 * col, width - col);
+}
+
+#endif
+
+/**
+ * Runs the widest available vector kernel for process_3, process_7 or process_10
+ * over the start of a row. The caller finishes the remaining pixels with the
+ * scalar loop, which gives bit-identical results.
+ * @param process   the process number (3, 7 or 10)
+ * @param in        the input row
+ * @param out       the output row; may be the same as in
+ * @param width     the number of pixels in the row
+ * @param threshold the gray level process_7 turns white at, 0 to 255
+ * @return the number of pixels handled
+ */
+int simd_row(int process, const unsigned char* in, unsigned char* out, int width, int threshold = 127)
+{
+#ifdef IMAGE_APP_X86_SIMD
+    if (active_simd_level == SIMD_AVX2)
+    {
+        switch (process)
+        {
+            case 3:  return process_3_avx2(in, out, width);
+            case 7:  return process_7_avx2(in, out, width, threshold);
+            case 10: return process_10_avx2(in, out, width);
+        }
+    }
+    else if (active_simd_level == SIMD_SSSE3)
+    {
+        switch (process)
+        {
+            case 3:  return process_3_ssse3(in, out, width);
+            case 7:  return process_7_ssse3(in, out, width, threshold);
+            case 10: return process_10_ssse3(in, out, width);
+        }
+    }
+#else
+    (void)process; (void)in; (void)out; (void)width; (void)threshold;
+#endif
+    return 0;
+}
+
+// Runs the widest available gray level kernel over the start of a row; returns the pixels handled
+int simd_gray_levels(const unsigned char* in, unsigned char* gray, int width)
+{
+#ifdef IMAGE_APP_X86_SIMD
+    if (active_simd_level == SIMD_AVX2)
+    {
+        return gray_levels_avx2(in, gray, width);
+    }
+    if (active_simd_level == SIMD_SSSE3)
+    {
+        return gray_levels_ssse3(in, gray, width);
+    }
+#else
+    (void)in; (void)gray; (void)width;
+#endif
+    return 0;
+}
+
+
+//*****************************************
+//     FIXED-POINT SCALING
+//*****************************************
+
+// How the scaling filters (process_1, 2, 8 and 9) multiply channels by their factors
+enum ArithmeticMode
+{
+    ARITHMETIC_EXACT,        // Double arithmetic (through lookup tables), bit-identical to the original filters
+    ARITHMETIC_FIXED_POINT   // Integer factors with SIMD multiplies; at most one level from exact
+};
+
+/**
+ * Rounds a scaling factor to Q8.8 fixed point (factor * 256).
+ * With the factor rounded to the nearest 1/256, value * factor moves by at
+ * most 255 / 512 < 0.5, so results truncated to a whole level differ from
+ * the double path by at most one. Factors that are multiples of 1/256 (0.5,
+ * 0.25, 0.75, ...) give bit-identical results.
+ * @param scaling_factor the factor, from 0 to 255.99
+ * @return the Q8.8 factor
+ */
+unsigned short q8_factor(double scaling_factor)
+{
+    return (unsigned short)lround(max(0.0, min(65535 / 256.0, scaling_factor)) * 256);
+}
+
+/**
+ * Checks whether a factor can use the fixed-point path for process_2 and
+ * process_8. Outside 0 to 1 the double formulas leave 0-255 and wrap around
+ * when narrowed, which the saturating integer kernels do not reproduce, so
+ * those factors keep the exact path.
+ * @param scaling_factor the factor
+ * @return true if the fixed-point path applies
+ */
+bool fixed_point_unit_factor(double scaling_factor)
+{
+    return scaling_factor >= 0 && scaling_factor <= 1;
+}
+
+// Scalar versions of the kernels below; they also finish the rows the vector loops leave
+
+// Fixed-point process_9_channel (and the dark branch of process_2): min(255, (value * factor) >> 8)
+inline unsigned char scale_q8(int value, int factor)
+{
+    return (unsigned char)min(255, (value * factor) >> 8);
+}
+
+// Fixed-point process_8_channel (and the bright branch of process_2), factor at most 256.
+// 255 - (255 - value) * f truncates upward in the subtracted term, so the product is rounded up.
+inline unsigned char invert_scale_q8(int value, int factor)
+{
+    return (unsigned char)(255 - (((255 - value) * factor + 255) >> 8));
+}
+
+#ifdef IMAGE_APP_X86_SIMD
+
+// scale_q8 for 16 bytes. (value << 8) * factor >> 16 is (value * factor) >> 8 for any 16-bit factor,
+// and x - (x -sat 255) saturates the result to 255.
+static inline __attribute__((target("sse2")))
+__m128i scale_q8_epu8(__m128i value, __m128i factor)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i limit = _mm_set1_epi16(255);
+    __m128i low = _mm_mulhi_epu16(_mm_unpacklo_epi8(zero, value), factor);
+    __m128i high = _mm_mulhi_epu16(_mm_unpackhi_epi8(zero, value), factor);
+    low = _mm_sub_epi16(low, _mm_subs_epu16(low, limit));
+    high = _mm_sub_epi16(high, _mm_subs_epu16(high, limit));
+    return _mm_packus_epi16(low, high);
+}
+
+// invert_scale_q8 for 16 bytes; (255 - value) * factor + 255 fits 16 bits for factors up to 256
+static inline __attribute__((target("sse2")))
+__m128i invert_scale_q8_epu8(__m128i value, __m128i factor)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i ones = _mm_set1_epi8(-1);
+    __m128i round = _mm_set1_epi16(255);
+    __m128i inverted = _mm_xor_si128(value, ones);
+    __m128i low = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(inverted, zero), factor), round), 8);
+    __m128i high = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(inverted, zero), factor), round), 8);
+    return _mm_xor_si128(_mm_packus_epi16(low, high), ones);
+}
+
+static inline __attribute__((target("avx2")))
+__m256i scale_q8_epu8(__m256i value, __m256i factor)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i limit = _mm256_set1_epi16(255);
+    __m256i low = _mm256_mulhi_epu16(_mm256_unpacklo_epi8(zero, value), factor);
+    __m256i high = _mm256_mulhi_epu16(_mm256_unpackhi_epi8(zero, value), factor);
+    low = _mm256_sub_epi16(low, _mm256_subs_epu16(low, limit));
+    high = _mm256_sub_epi16(high, _mm256_subs_epu16(high, limit));
+    // Unpacking and packing both work within 128-bit lanes, so the byte order is kept
+    return _mm256_packus_epi16(low, high);
+}
+
+static inline __attribute__((target("avx2")))
+__m256i invert_scale_q8_epu8(__m256i value, __m256i factor)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i ones = _mm256_set1_epi8(-1);
+    __m256i round = _mm256_set1_epi16(255);
+    __m256i inverted = _mm256_xor_si256(value, ones);
+    __m256i low = _mm256_srli_epi16(
+        _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(inverted, zero), factor), round), 8);
+    __m256i high = _mm256_srli_epi16(
+        _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(inverted, zero), factor), round), 8);
+    return _mm256_xor_si256(_mm256_packus_epi16(low, high), ones);
+}
+
+// Applies scale_q8 (invert false) or invert_scale_q8 (invert true) to bytes, 16 per step
+__attribute__((target("sse2")))
+size_t scale_bytes_q8_sse2(const unsigned char* in, unsigned char* out, size_t count, int factor, bool invert)
+{
+    __m128i factors = _mm_set1_epi16((short)factor);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i value = _mm_loadu_si128((const __m128i*)(in + i));
+        value = invert ? invert_scale_q8_epu8(value, factors) : scale_q8_epu8(value, factors);
+        _mm_storeu_si128((__m128i*)(out + i), value);
+    }
+    return i;
+}
+
+// Same as scale_bytes_q8_sse2, 32 bytes per step
+__attribute__((target("avx2")))
+size_t scale_bytes_q8_avx2(const unsigned char* in, unsigned char* out, size_t count, int factor, bool invert)
+{
+    __m256i factors = _mm256_set1_epi16((short)factor);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i value = _mm256_loadu_si256((const __m256i*)(in + i));
+        value = invert ? invert_scale_q8_epu8(value, factors) : scale_q8_epu8(value, factors);
+        _mm256_storeu_si256((__m256i*)(out + i), value);
+    }
+    return i;
+}
+
+// Fixed-point Clarendon: pixels with a channel sum of at least 3 * bright_from get
+// invert_scale_q8, sums below 3 * dark_below get scale_q8 and the rest are copied
+__attribute__((target("ssse3")))
+int process_2_fixed_ssse3(const unsigned char* in, unsigned char* out, int width, int factor,
+                          int dark_below, int bright_from)
+{
+    __m128i factors = _mm_set1_epi16((short)factor);
+    __m128i bright_limit = _mm_set1_epi16(3 * bright_from - 1);
+    __m128i dark_limit = _mm_set1_epi16(3 * dark_below);
+    int col = 0;
+    for (; col + 16 <= width; col += 16)
+    {
+        __m128i blue, green, red;
+        split_bgr(in + 3 * col, blue, green, red);
+        __m128i sum0 = sum_low(blue, green, red);
+        __m128i sum1 = sum_high(blue, green, red);
+        __m128i bright = _mm_packs_epi16(_mm_cmpgt_epi16(sum0, bright_limit), _mm_cmpgt_epi16(sum1, bright_limit));
+        __m128i dark = _mm_packs_epi16(_mm_cmplt_epi16(sum0, dark_limit), _mm_cmplt_epi16(sum1, dark_limit));
+        __m128i* channels[3] = { &blue, &green, &red };
+        for (int c = 0; c < 3; c++)
+        {
+            __m128i value = *channels[c];
+            __m128i scaled = _mm_or_si128(_mm_and_si128(bright, invert_scale_q8_epu8(value, factors)),
+                                          _mm_and_si128(dark, scale_q8_epu8(value, factors)));
+            *channels[c] = _mm_or_si128(scaled, _mm_andnot_si128(_mm_or_si128(bright, dark), value));
+        }
+        join_bgr(blue, green, red, out + 3 * col);
+    }
+    return col;
+}
+
+#endif
+
+/**
+ * Scales bytes with the fixed-point kernels
+ * @param in     the input bytes
+ * @param out    the output bytes; may be the same as in
+ * @param count  the number of bytes
+ * @param factor the Q8.8 factor; at most 256 when invert is true
+ * @param invert true for invert_scale_q8 (process_8), false for scale_q8 (process_9)
+ * @return nothing
+ */
+void scale_bytes_q8(const unsigned char* in, unsigned char* out, size_t count, int factor, bool invert)
+{
+    size_t i = 0;
+#ifdef IMAGE_APP_X86_SIMD
+    if (active_simd_level == SIMD_AVX2)
+    {
+        i = scale_bytes_q8_avx2(in, out, count, factor, invert);
+    }
+    else if (active_simd_level == SIMD_SSSE3)
+    {
+        i = scale_bytes_q8_sse2(in, out, count, factor, invert);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        out[i] = invert ? invert_scale_q8(in[i], factor) : scale_q8(in[i], factor);
+    }
+}
+
+
+//*****************************************
+//     THREAD POOL
+//*****************************************
+
+/**
+ * Work-stealing thread pool for splitting filters into bands of rows.
+ * Each worker owns a deque of tasks: it takes new work from the back of its
+ * own deque and, when that runs dry, steals from the front of another
+ * worker's. The thread that calls parallel_for() works through tasks as well
+ * until its own loop is finished, so nested loops cannot deadlock. Every task
+ * writes a disjoint part of the output, so results do not depend on the
+ * thread count or on which thread ran which band.
+ */
+class ThreadPool
+{
+public:
+    // Creates a pool that runs loops on thread_count threads, the caller included
+    explicit ThreadPool(int thread_count)
+        : queues(max(thread_count, 1)), queued(0), next_queue(0), stopping(false)
+    {
+        for (int i = 1; i < (int)queues.size(); i++)
+        {
+            workers.push_back(thread(&ThreadPool::worker_loop, this, i));
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            lock_guard<mutex> lock(wake_mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            workers[i].join();
+        }
+    }
+
+    // Number of threads loops run on, the caller included
+    int size() const
+    {
+        return queues.size();
+    }
+
+    /**
+     * Runs body(begin, end) over consecutive ranges covering [0, count) and
+     * waits for all of them to finish
+     * @param count the number of items
+     * @param grain the number of items per range
+     * @param body  the function to run on each range
+     * @return nothing
+     */
+    void parallel_for(int count, int grain, const function<void(int, int)>& body)
+    {
+        grain = max(grain, 1);
+        if (queues.size() == 1 || count <= grain)
+        {
+            if (count > 0)
+            {
+                body(0, count);
+            }
+            return;
+        }
+
+        Loop loop;
+        loop.body = &body;
+        loop.remaining = (count + grain - 1) / grain;
+
+        // Count the tasks before queueing them so queued never undercounts
+        {
+            lock_guard<mutex> lock(wake_mutex);
+            queued += loop.remaining;
+        }
+
+        // Deal the ranges out round-robin so every worker starts with local work
+        int first_queue = next_queue++ % queues.size();
+        int chunk = 0;
+        for (int begin = 0; begin < count; begin += grain, chunk++)
+        {
+            Task task = { &loop, begin, min(begin + grain, count) };
+            Queue& queue = queues[(first_queue + chunk) % queues.size()];
+            lock_guard<mutex> lock(queue.lock);
+            queue.tasks.push_back(task);
+        }
+        wake.notify_all();
+
+        // Help out until every range of this loop has run
+        while (loop.remaining.load() > 0)
+        {
+            Task task;
+            if (take_task(first_queue, task))
+            {
+                run_task(task);
+            }
+            else
+            {
+                unique_lock<mutex> lock(loop.done_mutex);
+                loop.done.wait(lock, [&loop] { return loop.remaining.load() == 0; });
+            }
+        }
+
+        // The last task may still hold done_mutex; wait for it before loop goes out of scope
+        lock_guard<mutex> lock(loop.done_mutex);
+    }
+
+private:
+    // A parallel_for() call in progress
+    struct Loop
+    {
+        const function<void(int, int)>* body;
+        atomic<int> remaining;
+        mutex done_mutex;
+        condition_variable done;
+    };
+
+    // One range of a loop
+    struct Task
+    {
+        Loop* loop;
+        int begin;
+        int end;
+    };
+
+    struct Queue
+    {
+        mutex lock;
+        deque<Task> tasks;
+    };
+
+    // Pops from the back of queue home, or steals from the front of another queue
+    bool take_task(int home, Task& task)
+    {
+        for (size_t i = 0; i < queues.size(); i++)
+        {
+            Queue& queue = queues[(home + i) % queues.size()];
+            lock_guard<mutex> lock(queue.lock);
+            if (!queue.tasks.empty())
+            {
+                if (i == 0)
+                {
+                    task = queue.tasks.back();
+                    queue.tasks.pop_back();
+                }
+                else
+                {
+                    task = queue.tasks.front();
+                    queue.tasks.pop_front();
+                }
+                queued--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run_task(const Task& task)
+    {
+        (*task.loop->body)(task.begin, task.end);
+
+        // The last range wakes the thread waiting in parallel_for()
+        Loop* loop = task.loop;
+        lock_guard<mutex> lock(loop->done_mutex);
+        if (--loop->remaining == 0)
+        {
+            loop->done.notify_all();
+        }
+    }
+
+    void worker_loop(int index)
+    {
+        while (true)
+        {
+            Task task;
+            if (take_task(index, task))
+            {
+                run_task(task);
+                continue;
+            }
+
+            unique_lock<mutex> lock(wake_mutex);
+            wake.wait(lock, [this] { return stopping || queued.load() > 0; });
+            if (stopping)
+            {
+                return;
+            }
+        }
+    }
+
+    vector<Queue> queues;             // One per thread; index 0 belongs to callers
+    vector<thread> workers;
+    atomic<int> queued;               // Tasks waiting in any queue
+    atomic<unsigned> next_queue;      // Round-robin start for the next loop
+    mutex wake_mutex;
+    condition_variable wake;
+    bool stopping;
+};
+
+// Thread count requested by set_thread_count(); 0 means one per hardware thread
+int requested_thread_count = 0;
+
+/**
+ * Gets the shared pool the filters run on, creating it on first use
+ * @return the pool
+ */
+ThreadPool& thread_pool()
+{
+    static unique_ptr<ThreadPool> pool;
+    static mutex pool_mutex;
+
+    lock_guard<mutex> lock(pool_mutex);
+    int count = requested_thread_count > 0 ? requested_thread_count : (int)thread::hardware_concurrency();
+    if (!pool || pool->size() != max(count, 1))
+    {
+        pool.reset(new ThreadPool(count));
+    }
+    return *pool;
+}
+
+/**
+ * Sets how many threads the filters run on. Must not be called while a
+ * filter is running.
+ * @param count the number of threads, or 0 for one per hardware thread
+ * @return nothing
+ */
+void set_thread_count(int count)
+{
+    requested_thread_count = max(count, 0);
+}
+
+/**
+ * Runs body(begin, end) over bands of rows on the shared pool.
+ * Bands hold at least 64K pixels so small images stay on one thread, and
+ * there are several bands per thread so idle threads have work to steal.
+ * @param rows       the number of rows
+ * @param row_pixels the number of pixels in each row
+ * @param body       the function to run on each band
+ * @return nothing
+ */
+void parallel_rows(int rows, int row_pixels, const function<void(int, int)>& body)
+{
+    const int MIN_BAND_PIXELS = 1 << 16;
+    const int BANDS_PER_THREAD = 4;
+
+    ThreadPool& pool = thread_pool();
+    int band = (rows + pool.size() * BANDS_PER_THREAD - 1) / (pool.size() * BANDS_PER_THREAD);
+    band = max(band, MIN_BAND_PIXELS / max(row_pixels, 1));
+    if (!tracing_enabled.load(memory_order_relaxed))
+    {
+        pool.parallel_for(rows, band, body);
+        return;
+    }
+
+    // Each band becomes a scope on the thread that ran it, for per-thread time
+    pool.parallel_for(rows, band, [&](int first_row, int last_row)
+    {
+        TraceScope scope("rows", "worker", (unsigned long long)(last_row - first_row) * row_pixels);
+        body(first_row, last_row);
+    });
+}
+
+
+//*****************************************
+//     IMAGE STATISTICS
+//*****************************************
+
+// Histograms of ImageStats
+const int STATS_BLUE = 0;
+const int STATS_GREEN = 1;
+const int STATS_RED = 2;
+const int STATS_GRAY = 3;   // (blue + green + red) / 3, rounded down as process_3 and process_7 compute it
+
+// Per-channel and gray level histograms of an image
+struct ImageStats
+{
+    unsigned long long count;               // Pixels counted
+    unsigned long long histograms[4][256];  // Indexed by STATS_BLUE to STATS_GRAY, then by level
+
+    ImageStats() : count(0)
+    {
+        memset(histograms, 0, sizeof(histograms));
+    }
+
+    // Average level of one histogram, 0 for an empty image
+    double mean(int channel = STATS_GRAY) const
+    {
+        double total = 0;
+        for (int level = 0; level < 256; level++)
+        {
+            total += (double)level * histograms[channel][level];
+        }
+        return count ? total / count : 0;
+    }
+
+    // Lowest level with at least percent of the pixels at or below it
+    int percentile(double percent, int channel = STATS_GRAY) const
+    {
+        double target = max(0.0, min(percent, 100.0)) / 100 * count;
+        unsigned long long total = 0;
+        for (int level = 0; level < 255; level++)
+        {
+            total += histograms[channel][level];
+            if (total > 0 && total >= target)
+            {
+                return level;
+            }
+        }
+        return 255;
+    }
+};
+
+/**
+ * Counts the histograms of an image in one pass.
+ * Bands of rows are counted in parallel into per-band sub-histograms that
+ * are added together at the end. Within a band, consecutive pixels update
+ * four separate copies of each histogram so a run of equal values does not
+ * make every increment wait for the one before; gray levels come from the
+ * same SIMD kernels as process_3.
+ * @param image the image
+ * @return the statistics
+ */
+ImageStats image_stats(ConstImageView image)
+{
+    TraceScope scope("image_stats", "filter", (unsigned long long)image.width * image.height);
+    const int COPIES = 4;
+
+    ImageStats stats;
+    stats.count = (unsigned long long)max(image.width, 0) * max(image.height, 0);
+    mutex merge;
+    parallel_rows(image.height, image.width, [&](int first_row, int last_row)
+    {
+        vector<unsigned int> bins(COPIES * 4 * 256, 0);
+        vector<unsigned char> gray(image.width);
+        for (int row = first_row; row < last_row; row++)
+        {
+            const unsigned char* in = image.row(row);
+            int col = simd_gray_levels(in, &gray[0], image.width);
+            for (; col < image.width; col++)
+            {
+                gray[col] = (in[3 * col + 0] + in[3 * col + 1] + in[3 * col + 2]) / 3;
+            }
+
+            for (col = 0; col < image.width; col++)
+            {
+                unsigned int* copy = &bins[(col & (COPIES - 1)) * 4 * 256];
+                copy[STATS_BLUE * 256 + in[3 * col + 0]]++;
+                copy[STATS_GREEN * 256 + in[3 * col + 1]]++;
+                copy[STATS_RED * 256 + in[3 * col + 2]]++;
+                copy[STATS_GRAY * 256 + gray[col]]++;
+            }
+        }
+
+        lock_guard<mutex> lock(merge);
+        for (int copy = 0; copy < COPIES; copy++)
+        {
+            for (int i = 0; i < 4 * 256; i++)
+            {
+                stats.histograms[i / 256][i % 256] += bins[copy * 4 * 256 + i];
+            }
+        }
+    });
+    return stats;
+}
+
+ImageStats image_stats(const Image& image)
+{
+    return image_stats(image.view());
+}
+
+/**
+ * Otsu's threshold: the split of a histogram into a dark and a bright class
+ * that maximizes the variance between the two classes. When several splits
+ * tie, as they do across a gap of empty levels, the middle one is used.
+ * @param stats   the image statistics
+ * @param channel the histogram to split
+ * @return the lowest level of the bright class, or 127 if the image has only one level
+ */
+int otsu_threshold(const ImageStats& stats, int channel = STATS_GRAY)
+{
+    const unsigned long long* histogram = stats.histograms[channel];
+    double total_sum = 0;
+    for (int level = 0; level < 256; level++)
+    {
+        total_sum += (double)level * histogram[level];
+    }
+
+    double dark_count = 0;
+    double dark_sum = 0;
+    double best = 0;
+    int first_best = 0;
+    int last_best = 0;
+    for (int level = 0; level < 255; level++)
+    {
+        dark_count += histogram[level];
+        dark_sum += (double)level * histogram[level];
+        double bright_count = stats.count - dark_count;
+        if (dark_count == 0 || bright_count == 0)
+        {
+            continue;
+        }
+
+        double difference = dark_sum / dark_count - (total_sum - dark_sum) / bright_count;
+        double variance = dark_count * bright_count * difference * difference;
+        if (variance > best)
+        {
+            best = variance;
+            first_best = last_best = level + 1;
+        }
+        else if (variance == best)
+        {
+            last_best = level + 1;
+        }
+    }
+    return best > 0 ? (first_best + last_best) / 2 : 255 / 2;
+}
+
+// How process_2 and process_7 choose their lightness thresholds
+enum ThresholdMethod
+{
+    THRESHOLD_FIXED,        // The built-in levels: 90 and 170 for process_2, 127 for process_7
+    THRESHOLD_OTSU,         // From Otsu's split of the gray histogram
+    THRESHOLD_PERCENTILE    // At percentiles of the gray histogram
+};
+
+
+//*****************************************
+//     ROTATION ENGINE
+//*****************************************
+
+// Side length in pixels of the tiles rotations are copied in; a source and a
+// destination tile (3 KB each) fit in the L1 cache together
+const int ROTATION_TILE = 32;
+
+/**
+ * Normalizes a number of clockwise quarter turns to 0-3
+ * @param quarter_turns the number of 90 degree clockwise turns (may be negative)
+ * @return the equivalent number of turns from 0 to 3
+ */
+int normalize_quarter_turns(int quarter_turns)
+{
+    return (quarter_turns % 4 + 4) % 4;
+}
+
+/**
+ * Rotates an image clockwise in one pass, with the number of quarter turns
+ * fixed at compile time so each rotation gets its own loops.
+ * 90 and 270 degrees are copied as tiled transposes, so both the reads and the
+ * scattered writes stay within a cache-sized tile; 180 degrees reverses each
+ * row into its mirrored row. Bands of output rows run in parallel.
+ * @param image     the source image
+ * @param new_image the destination; image.height wide and image.width tall
+ *                  for odd quarter turns, the same size as image otherwise
+ * @return nothing
+ */
+template <int QuarterTurns>
+void rotate_turns(ConstImageView image, ImageView new_image)
+{
+    static_assert(QuarterTurns >= 0 && QuarterTurns < 4, "quarter turns must be normalized");
+
+    int num_rows = image.height;
+    int num_columns = image.width;
+
+    if (QuarterTurns % 2 == 0)
+    {
+        parallel_rows(num_rows, num_columns, [&](int first_row, int last_row)
+        {
+            for (int row = first_row; row < last_row; row++)
+            {
+                const unsigned char* in = image.row(row);
+                if (QuarterTurns == 0)
+                {
+                    memcpy(new_image.row(row), in, (size_t)BYTES_PER_PIXEL * num_columns);
+                    continue;
+                }
+
+                // 180 degrees: (row, col) moves to (num_rows - 1 - row, num_columns - 1 - col)
+                unsigned char* out = new_image.row(num_rows - 1 - row) + 3 * (num_columns - 1);
+                for (int col = 0; col < num_columns; col++, out -= 3)
+                {
+                    out[0] = in[3 * col + 0];
+                    out[1] = in[3 * col + 1];
+                    out[2] = in[3 * col + 2];
+                }
+            }
+        });
+        return;
+    }
+
+    // Output row y is source column y (90 degrees) or num_columns - 1 - y (270 degrees),
+    // read from the bottom source row up (90 degrees) or the top row down (270 degrees).
+    // Each band of output rows is filled tile by tile.
+    ptrdiff_t in_step = QuarterTurns == 1 ? -image.stride : image.stride;
+    parallel_rows(num_columns, num_rows, [&](int first_row, int last_row)
+    {
+        for (int tile_y = first_row; tile_y < last_row; tile_y += ROTATION_TILE)
+        {
+            int tile_y_end = min(tile_y + ROTATION_TILE, last_row);
+            for (int tile_x = 0; tile_x < num_rows; tile_x += ROTATION_TILE)
+            {
+                int tile_x_end = min(tile_x + ROTATION_TILE, num_rows);
+                for (int y = tile_y; y < tile_y_end; y++)
+                {
+                    // 90 degrees: (row, col) moves to (col, num_rows - 1 - row)
+                    // 270 degrees: (row, col) moves to (num_columns - 1 - col, row)
+                    unsigned char* out = new_image.row(y) + 3 * tile_x;
+                    const unsigned char* in = QuarterTurns == 1
+                        ? image.row(num_rows - 1 - tile_x) + 3 * y
+                        : image.row(tile_x) + 3 * (num_columns - 1 - y);
+                    for (int x = tile_x; x < tile_x_end; x++, out += 3, in += in_step)
+                    {
+                        out[0] = in[0];
+                        out[1] = in[1];
+                        out[2] = in[2];
+                    }
+                }
+            }
+        }
+    });
+}
+
+/**
+ * Rotates an image clockwise in one pass; see rotate_turns()
+ * @param image         the source image
+ * @param new_image     the destination; image.height wide and image.width tall
+ *                      for odd quarter turns, the same size as image otherwise
+ * @param quarter_turns the number of 90 degree clockwise turns
+ * @return nothing
+ */
+void rotate_image(ConstImageView image, ImageView new_image, int quarter_turns)
+{
+    switch (normalize_quarter_turns(quarter_turns))
+    {
+        case 0:  rotate_turns<0>(image, new_image); break;
+        case 1:  rotate_turns<1>(image, new_image); break;
+        case 2:  rotate_turns<2>(image, new_image); break;
+        default: rotate_turns<3>(image, new_image); break;
+    }
+}
+
+Image rotate_image(const Image& image, int quarter_turns)
+{
+    // Odd numbers of turns swap the width and height
+    bool swap = normalize_quarter_turns(quarter_turns) % 2 == 1;
+    Image new_image = image_pool().acquire(swap ? image.height : image.width, swap ? image.width : image.height);
+    rotate_image(image.view(), new_image.view(), quarter_turns);
+    return new_image;
+}
+
+// Swaps two packed pixels
+inline void swap_pixels(unsigned char* a, unsigned char* b)
+{
+    for (int channel = 0; channel < BYTES_PER_PIXEL; channel++)
+    {
+        unsigned char value = a[channel];
+        a[channel] = b[channel];
+        b[channel] = value;
+    }
+}
+
+/**
+ * Rotates an image clockwise without a second buffer.
+ * 180 degrees works for any size by swapping each pixel with its mirror. 90 and
+ * 270 degrees need a square image; they move pixels in cycles of four, with
+ * the cycles visited tile by tile so the four positions of neighboring cycles
+ * share cache lines.
+ * @param image         the image to rotate
+ * @param quarter_turns the number of 90 degree clockwise turns
+ * @return true if the image was rotated, false if the rotation needs a new buffer
+ */
+bool rotate_in_place(ImageView image, int quarter_turns)
+{
+    int num_rows = image.height;
+    int num_columns = image.width;
+    quarter_turns = normalize_quarter_turns(quarter_turns);
+
+    if (quarter_turns == 0)
+    {
+        return true;
+    }
+
+    if (quarter_turns == 2)
+    {
+        // Swap row pairs from the outside in; a middle row is mirrored onto itself
+        parallel_rows((num_rows + 1) / 2, num_columns, [&](int first_row, int last_row)
+        {
+            for (int row = first_row; row < last_row; row++)
+            {
+                unsigned char* top = image.row(row);
+                unsigned char* bottom = image.row(num_rows - 1 - row);
+                int count = top == bottom ? num_columns / 2 : num_columns;
+                for (int col = 0; col < count; col++)
+                {
+                    swap_pixels(top + 3 * col, bottom + 3 * (num_columns - 1 - col));
+                }
+            }
+        });
+        return true;
+    }
+
+    if (num_rows != num_columns)
+    {
+        return false;
+    }
+
+    // Each cycle starts at (row, col) with row < n / 2 and row <= col < n - 1 - row.
+    // Bands of starting rows touch disjoint cycles, so they run in parallel.
+    int n = num_rows;
+    parallel_rows(n / 2, n, [&](int first_row, int last_row)
+    {
+        for (int tile_y = first_row; tile_y < last_row; tile_y += ROTATION_TILE)
+        {
+            int tile_y_end = min(tile_y + ROTATION_TILE, last_row);
+            for (int tile_x = tile_y; tile_x < n - 1 - tile_y; tile_x += ROTATION_TILE)
+            {
+                int tile_x_end = min(tile_x + ROTATION_TILE, n - 1 - tile_y);
+                for (int row = tile_y; row < tile_y_end; row++)
+                {
+                    for (int col = max(tile_x, row); col < min(tile_x_end, n - 1 - row); col++)
+                    {
+                        unsigned char* a = image.row(row) + 3 * col;
+                        unsigned char* b = image.row(col) + 3 * (n - 1 - row);
+                        unsigned char* c = image.row(n - 1 - row) + 3 * (n - 1 - col);
+                        unsigned char* d = image.row(n - 1 - col) + 3 * row;
+
+                        // Clockwise: a takes d, d takes c, c takes b and b takes a
+                        // Counterclockwise runs the same cycle the other way
+                        if (quarter_turns == 1)
+                        {
+                            swap_pixels(a, d);
+                            swap_pixels(d, c);
+                            swap_pixels(c, b);
+                        }
+                        else
+                        {
+                            swap_pixels(a, b);
+                            swap_pixels(b, c);
+                            swap_pixels(c, d);
+                        }
+                    }
+                }
+            }
+        }
+    });
+    return true;
+}
+
+/**
+ * Rotates an owned image clockwise, in place when rotate_in_place() can and
+ * into a new buffer otherwise
+ * @param image         the image to rotate
+ * @param quarter_turns the number of 90 degree clockwise turns
+ * @return nothing
+ */
+void rotate_in_place(Image& image, int quarter_turns)
+{
+    if (!rotate_in_place(image.view(), quarter_turns))
+    {
+        Image rotated = rotate_image(image, quarter_turns);
+        swap(image, rotated);
+        image_pool().recycle(move(rotated));
+    }
+}
+
+
+//*****************************************
+//     VIGNETTE ENGINE
+//*****************************************
+
+/**
+ * Radial weights of the vignette (process_1) for one image size.
+ * The weight of a pixel is (num_rows - distance) / num_rows, where distance is
+ * measured from the center (num_columns / 2.0, num_rows / 2.0). It depends only
+ * on the absolute offsets from the center, so one quadrant holds every weight:
+ * quadrant column |2 * col - width| / 2 and quadrant row |2 * row - height| / 2.
+ */
+struct VignetteMap
+{
+    int width;
+    int height;
+    int quadrant_width;                     // width / 2 + 1
+    int quadrant_height;                    // height / 2 + 1
+    vector<double> weights;                 // Exact weights, row by row
+    vector<unsigned short> fixed_weights;   // Weights clamped to [0, 1] in Q15 fixed point
+    vector<int> negative_from;              // Per quadrant row, the first quadrant column with a negative weight
+
+    VignetteMap(int width, int height)
+        : width(width), height(height), quadrant_width(width / 2 + 1), quadrant_height(height / 2 + 1),
+          weights((size_t)quadrant_width * quadrant_height),
+          fixed_weights(weights.size()),
+          negative_from(quadrant_height, quadrant_width)
+    {
+        // Offsets from the center are whole numbers for even sizes and halves for odd ones
+        double x_offset = (width % 2) / 2.0;
+        double y_offset = (height % 2) / 2.0;
+
+        for (int y = 0; y < quadrant_height; y++)
+        {
+            for (int x = 0; x < quadrant_width; x++)
+            {
+                // Same expression as the original per-pixel formula, so the weights are bit-identical
+                double distance = sqrt(pow(x + x_offset, 2) + pow(y + y_offset, 2));
+                double scaling_factor = (height - distance) / height;
+
+                size_t index = (size_t)y * quadrant_width + x;
+                weights[index] = scaling_factor;
+                fixed_weights[index] = (unsigned short)lround(max(0.0, min(1.0, scaling_factor)) * 32768);
+
+                // Weights fall with the distance, so the negative ones end each row
+                if (scaling_factor < 0 && negative_from[y] == quadrant_width)
+                {
+                    negative_from[y] = x;
+                }
+            }
+        }
+    }
+
+    int quadrant_column(int col) const
+    {
+        return abs(2 * col - width) / 2;
+    }
+
+    // Exact weights for the quadrant row that holds image row row
+    const double* weight_row(int row) const
+    {
+        return &weights[(size_t)(abs(2 * row - height) / 2) * quadrant_width];
+    }
+
+    const unsigned short* fixed_weight_row(int row) const
+    {
+        return &fixed_weights[(size_t)(abs(2 * row - height) / 2) * quadrant_width];
+    }
+
+    int negative_from_row(int row) const
+    {
+        return negative_from[abs(2 * row - height) / 2];
+    }
+};
+
+/**
+ * Gets the vignette map for an image size, building it on first use.
+ * The most recently used maps are kept, so images of a size seen before skip
+ * every square root.
+ * @param width  the image width
+ * @param height the image height
+ * @return the shared map
+ */
+shared_ptr<const VignetteMap> vignette_map(int width, int height)
+{
+    // Product images come in a handful of sizes; keep a few more than that
+    const size_t MAX_CACHED_MAPS = 16;
+
+    static map<pair<int, int>, pair<shared_ptr<const VignetteMap>, unsigned long> > cache;
+    static unsigned long use_count = 0;
+    static mutex cache_mutex;
+
+    pair<int, int> key(width, height);
+    {
+        lock_guard<mutex> lock(cache_mutex);
+        map<pair<int, int>, pair<shared_ptr<const VignetteMap>, unsigned long> >::iterator found = cache.find(key);
+        if (found != cache.end())
+        {
+            found->second.second = ++use_count;
+            return found->second.first;
+        }
+    }
+
+    // Build outside the lock; two threads racing on a new size both build it and one copy is kept
+    shared_ptr<const VignetteMap> built = make_shared<VignetteMap>(width, height);
+
+    lock_guard<mutex> lock(cache_mutex);
+    if (cache.size() >= MAX_CACHED_MAPS)
+    {
+        // Evict the least recently used map
+        map<pair<int, int>, pair<shared_ptr<const VignetteMap>, unsigned long> >::iterator oldest = cache.begin();
+        for (map<pair<int, int>, pair<shared_ptr<const VignetteMap>, unsigned long> >::iterator it = cache.begin();
+             it != cache.end(); ++it)
+        {
+            if (it->second.second < oldest->second.second)
+            {
+                oldest = it;
+            }
+        }
+        cache.erase(oldest);
+    }
+    cache[key] = make_pair(built, ++use_count);
+    return built;
+}
+
+#ifdef IMAGE_APP_X86_SIMD
+
+// Multiplies bytes by Q15 weights: (2 * value * weight) >> 16, 16 bytes per step
+__attribute__((target("sse2")))
+int scale_bytes_sse2(const unsigned char* in, unsigned char* out, const unsigned short* weights, int count)
+{
+    __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i value = _mm_loadu_si128((const __m128i*)(in + i));
+        __m128i low = _mm_unpacklo_epi8(value, zero);
+        __m128i high = _mm_unpackhi_epi8(value, zero);
+        low = _mm_mulhi_epu16(_mm_add_epi16(low, low), _mm_loadu_si128((const __m128i*)(weights + i)));
+        high = _mm_mulhi_epu16(_mm_add_epi16(high, high), _mm_loadu_si128((const __m128i*)(weights + i + 8)));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(low, high));
+    }
+    return i;
+}
+
+// Same as scale_bytes_sse2, 32 bytes per step
+__attribute__((target("avx2")))
+int scale_bytes_avx2(const unsigned char* in, unsigned char* out, const unsigned short* weights, int count)
+{
+    int i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i low = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(in + i)));
+        __m256i high = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(in + i + 16)));
+        low = _mm256_mulhi_epu16(_mm256_add_epi16(low, low), _mm256_loadu_si256((const __m256i*)(weights + i)));
+        high = _mm256_mulhi_epu16(_mm256_add_epi16(high, high), _mm256_loadu_si256((const __m256i*)(weights + i + 16)));
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(low, high), 0xD8);
+        _mm256_storeu_si256((__m256i*)(out + i), packed);
+    }
+    return i;
+}
+
+#endif
+
+// Applies the exact vignette to columns [begin, end) of a span; see apply_vignette_span()
+void apply_vignette_exact(const VignetteMap& map, int row, int first_col, int begin, int end,
+                          const unsigned char* in, unsigned char* out)
+{
+    const double* weights = map.weight_row(row);
+    for (int col = begin; col < end; col++)
+    {
+        // Scale the blue, green and red values using the pixel's weight
+        double scaling_factor = weights[map.quadrant_column(first_col + col)];
+        for (int channel = 0; channel < BYTES_PER_PIXEL; channel++)
+        {
+            int new_value = in[3 * col + channel] * scaling_factor;
+            out[3 * col + channel] = to_channel(new_value);
+        }
+    }
+}
+
+/**
+ * Applies the vignette to part of a row; see apply_vignette_row()
+ * @param map         the map for the image size
+ * @param row         the row index within the image
+ * @param first_col   the column of the first pixel
+ * @param num_columns the number of pixels
+ * @param in          the input pixels, from first_col
+ * @param out         the output pixels; may be the same as in
+ * @param mode        the arithmetic to use
+ * @param scratch     buffer reused between calls for per-channel fixed-point weights
+ * @return nothing
+ */
+void apply_vignette_span(const VignetteMap& map, int row, int first_col, int num_columns,
+                         const unsigned char* in, unsigned char* out, ArithmeticMode mode,
+                         vector<unsigned short>& scratch)
+{
+    if (mode == ARITHMETIC_EXACT)
+    {
+        apply_vignette_exact(map, row, first_col, 0, num_columns, in, out);
+        return;
+    }
+
+    // Exact negative weights wrap the channels around and the clamped Q15 ones cannot,
+    // so the columns that have them, at both ends of the row, keep the exact formula
+    int negative_from = map.negative_from_row(row);
+    int begin = 0;
+    int end = num_columns;
+    while (begin < end && map.quadrant_column(first_col + begin) >= negative_from)
+    {
+        begin++;
+    }
+    while (end > begin && map.quadrant_column(first_col + end - 1) >= negative_from)
+    {
+        end--;
+    }
+    apply_vignette_exact(map, row, first_col, 0, begin, in, out);
+    apply_vignette_exact(map, row, first_col, end, num_columns, in, out);
+    if (begin == end)
+    {
+        return;
+    }
+    first_col += begin;
+    num_columns = end - begin;
+    in += BYTES_PER_PIXEL * begin;
+    out += BYTES_PER_PIXEL * begin;
+
+    // Mirror the quadrant row out to one weight per channel byte
+    const unsigned short* weights = map.fixed_weight_row(row);
+    int count = BYTES_PER_PIXEL * num_columns;
+    scratch.resize(count);
+    for (int col = 0; col < num_columns; col++)
+    {
+        unsigned short weight = weights[map.quadrant_column(first_col + col)];
+        scratch[3 * col + 0] = weight;
+        scratch[3 * col + 1] = weight;
+        scratch[3 * col + 2] = weight;
+    }
+
+    int i = 0;
+#ifdef IMAGE_APP_X86_SIMD
+    if (active_simd_level == SIMD_AVX2)
+    {
+        i = scale_bytes_avx2(in, out, &scratch[0], count);
+    }
+    else if (active_simd_level == SIMD_SSSE3)
+    {
+        i = scale_bytes_sse2(in, out, &scratch[0], count);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        out[i] = (2 * in[i] * scratch[i]) >> 16;
+    }
+}
+
+/**
+ * Applies the vignette to one row.
+ * In ARITHMETIC_FIXED_POINT mode each channel becomes (value * weight) >> 15 with
+ * the weight rounded to Q15. That is at most one level away from the exact
+ * result. Weights below zero, which only occur in the corners of images more
+ * than about 1.7 times wider than tall, make the exact formula wrap around;
+ * the pixels that have them use the exact formula in both modes.
+ * @param map     the map for the image size
+ * @param row     the row index within the image
+ * @param in      the input row
+ * @param out     the output row; may be the same as in
+ * @param mode    the arithmetic to use
+ * @param scratch buffer reused between rows for per-channel fixed-point weights
+ * @return nothing
+ */
+void apply_vignette_row(const VignetteMap& map, int row, const unsigned char* in, unsigned char* out,
+                        ArithmeticMode mode, vector<unsigned short>& scratch)
+{
+    apply_vignette_span(map, row, 0, map.width, in, out, mode, scratch);
+}
+
+/**
+ * Applies the vignette using the cached map for the image size
+ * @param image     the input image
+ * @param new_image the output image, the same size; may be the same buffer
+ * @param mode      the arithmetic to use
+ * @return nothing
+ */
+void apply_vignette(ConstImageView image, ImageView new_image, ArithmeticMode mode)
+{
+    shared_ptr<const VignetteMap> map = vignette_map(image.width, image.height);
+
+    parallel_rows(image.height, image.width, [&](int first_row, int last_row)
+    {
+        vector<unsigned short> scratch;
+        for (int row = first_row; row < last_row; row++)
+        {
+            apply_vignette_row(*map, row, image.row(row), new_image.row(row), mode, scratch);
+        }
+    });
+}
+
+
+//*****************************************
+//     ENLARGE ENGINE
+//*****************************************
+
+#ifdef IMAGE_APP_X86_SIMD
+
+// Repeats pixels with byte shuffles: each step loads 5 pixels (15 of 16 bytes) and
+// writes their 15 * x_scale output bytes, one shuffle per 16-byte store
+__attribute__((target("ssse3")))
+int repeat_pixels_ssse3(const unsigned char* in, unsigned char* out, int width, int x_scale,
+                        const signed char* masks, const int* offsets, int stores)
+{
+    int col = 0;
+
+    // The 16-byte load reads one byte past the 5 pixels, so stop while it stays inside the row
+    for (; col + 6 <= width; col += 5)
+    {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(in + 3 * col));
+        unsigned char* block = out + 3 * col * x_scale;
+        for (int store = 0; store < stores; store++)
+        {
+            __m128i mask = _mm_loadu_si128((const __m128i*)(masks + 16 * store));
+            _mm_storeu_si128((__m128i*)(block + offsets[store]), _mm_shuffle_epi8(pixels, mask));
+        }
+    }
+    return col;
+}
+
+#endif
+
+/**
+ * Repeats every pixel of a row x_scale times, the horizontal half of
+ * process_6. The shuffle masks depend only on x_scale, so they are built once
+ * and reused for every row.
+ */
+class PixelRepeater
+{
+public:
+    explicit PixelRepeater(int x_scale) : x_scale(x_scale)
+    {
+        // Five input pixels become 15 * x_scale bytes; the last store is moved back to
+        // end exactly there, overlapping the one before it with the same values
+        int block_bytes = 15 * x_scale;
+        for (int store = 0; x_scale > 1 && 16 * store < block_bytes; store++)
+        {
+            int offset = min(16 * store, block_bytes - 16);
+            offsets.push_back(offset);
+            for (int i = 0; i < 16; i++)
+            {
+                int byte = offset + i;
+                masks.push_back((signed char)(3 * (byte / 3 / x_scale) + byte % 3));
+            }
+        }
+    }
+
+    /**
+     * Enlarges one row
+     * @param in    the input row
+     * @param out   the output row, x_scale times as wide; must not overlap in
+     * @param width the number of input pixels
+     * @return nothing
+     */
+    void run(const unsigned char* in, unsigned char* out, int width) const
+    {
+        if (x_scale == 1)
+        {
+            memcpy(out, in, (size_t)BYTES_PER_PIXEL * width);
+            return;
+        }
+
+        int col = 0;
+#ifdef IMAGE_APP_X86_SIMD
+        if (active_simd_level >= SIMD_SSSE3)
+        {
+            col = repeat_pixels_ssse3(in, out, width, x_scale, &masks[0], &offsets[0], offsets.size());
+        }
+#endif
+        for (; col < width; col++)
+        {
+            unsigned char* copy = out + (size_t)3 * col * x_scale;
+            for (int i = 0; i < x_scale; i++, copy += 3)
+            {
+                memcpy(copy, in + 3 * col, BYTES_PER_PIXEL);
+            }
+        }
+    }
+
+private:
+    int x_scale;
+    vector<signed char> masks;      // 16 shuffle indices per store
+    vector<int> offsets;            // Byte offset of each store within a block
+};
+
+/**
+ * Enlarges an image by whole factors with nearest-neighbor sampling.
+ * Each distinct output row is built once by PixelRepeater and then copied
+ * to the y_scale - 1 rows below it, instead of every output pixel being
+ * looked up with two divisions.
+ * @param image     the input image
+ * @param new_image the output image, x_scale times wider and y_scale times taller
+ * @param x_scale   the horizontal factor, at least 1
+ * @param y_scale   the vertical factor, at least 1
+ * @return nothing
+ */
+void enlarge_image(ConstImageView image, ImageView new_image, int x_scale, int y_scale)
+{
+    PixelRepeater repeater(x_scale);
+    size_t row_bytes = (size_t)BYTES_PER_PIXEL * new_image.width;
+
+    // Bands of input rows are independent, so they run in parallel
+    parallel_rows(image.height, new_image.width * y_scale, [&](int first_row, int last_row)
+    {
+        for (int row = first_row; row < last_row; row++)
+        {
+            unsigned char* out = new_image.row(row * y_scale);
+            repeater.run(image.row(row), out, image.width);
+            for (int copy = 1; copy < y_scale; copy++)
+            {
+                memcpy(new_image.row(row * y_scale + copy), out, row_bytes);
+            }
+        }
+    });
+}
+
+
+//*****************************************
+//     RESAMPLING ENGINE
+//*****************************************
+
+// Reconstruction filters for resample_image()
+enum ResampleFilter
+{
+    RESAMPLE_BOX,        // Area average; the sharpest choice for whole-number downscales
+    RESAMPLE_BILINEAR,   // Triangle, support 1
+    RESAMPLE_BICUBIC,    // Catmull-Rom cubic (a = -0.5), support 2
+    RESAMPLE_LANCZOS     // Lanczos, three lobes; the best quality for thumbnails
+};
+
+// Fixed-point precision of resampling weights: 1.0 is 1 << RESAMPLE_BITS
+const int RESAMPLE_BITS = 14;
+
+/**
+ * Evaluates a reconstruction filter
+ * @param filter the filter
+ * @param x      the distance from the sample, in source pixels
+ * @return the unnormalized weight
+ */
+double resample_kernel(ResampleFilter filter, double x)
+{
+    const double PI = 3.14159265358979323846;
+    x = fabs(x);
+    switch (filter)
+    {
+        case RESAMPLE_BOX:
+            return x < 0.5 ? 1.0 : 0.0;
+        case RESAMPLE_BILINEAR:
+            return x < 1.0 ? 1.0 - x : 0.0;
+        case RESAMPLE_BICUBIC:
+            if (x < 1.0)
+            {
+                return (1.5 * x - 2.5) * x * x + 1.0;
+            }
+            return x < 2.0 ? ((-0.5 * x + 2.5) * x - 4.0) * x + 2.0 : 0.0;
+        case RESAMPLE_LANCZOS:
+            if (x < 1e-8)
+            {
+                return 1.0;
+            }
+            return x < 3.0 ? 3.0 * sin(PI * x) * sin(PI * x / 3.0) / (PI * PI * x * x) : 0.0;
+    }
+    return 0.0;
+}
+
+// Half-width of each filter's kernel in source pixels, before widening for downscales
+double resample_support(ResampleFilter filter)
+{
+    switch (filter)
+    {
+        case RESAMPLE_BOX:      return 0.5;
+        case RESAMPLE_BILINEAR: return 1.0;
+        case RESAMPLE_BICUBIC:  return 2.0;
+        case RESAMPLE_LANCZOS:  return 3.0;
+    }
+    return 1.0;
+}
+
+/**
+ * Resampling weights for one axis, computed once per (sizes, filter) and
+ * shared by every row or column. Output position i reads the taps source
+ * positions starting at first[i]. The number of taps is even so the SIMD
+ * passes can take them in pairs; unused taps have weight zero. Only on an
+ * axis shorter than the taps do they point past its end.
+ */
+struct ResampleWeights
+{
+    int taps;
+    vector<int> first;
+    vector<short> weights;      // taps weights per output position, summing to 1 << RESAMPLE_BITS
+
+    ResampleWeights(int in_size, int out_size, ResampleFilter filter)
+    {
+        // Downscales widen the kernel so every source pixel contributes
+        double scale = (double)in_size / out_size;
+        double filter_scale = max(scale, 1.0);
+        double support = resample_support(filter) * filter_scale;
+        taps = min(in_size, (int)ceil(support) * 2 + 1);
+        taps += taps % 2;
+
+        first.resize(out_size);
+        weights.assign((size_t)out_size * taps, 0);
+        vector<double> exact(taps);
+        for (int i = 0; i < out_size; i++)
+        {
+            // Centers of output pixels map to the source at (i + 0.5) * scale
+            double center = (i + 0.5) * scale;
+            int low = max(0, (int)(center - support + 0.5));
+            int high = min(in_size, (int)(center + support + 0.5));
+            int count = min(high - low, taps);
+
+            double total = 0;
+            for (int k = 0; k < count; k++)
+            {
+                exact[k] = resample_kernel(filter, (low + k - center + 0.5) / filter_scale);
+                total += exact[k];
+            }
+
+            // Keep the tap window inside the axis: shift it left at the end, padding with zero weights
+            int start = max(0, min(low, in_size - taps));
+            first[i] = start;
+            short* out = &weights[(size_t)i * taps];
+            int sum = 0;
+            int largest = low - start;
+            for (int k = 0; k < count; k++)
+            {
+                int weight = (int)lround((total != 0 ? exact[k] / total : (k == 0)) * (1 << RESAMPLE_BITS));
+                out[low - start + k] = (short)weight;
+                sum += weight;
+                if (weight > out[largest])
+                {
+                    largest = low - start + k;
+                }
+            }
+
+            // Rounding may leave the sum a little off; the largest weight absorbs the difference
+            out[largest] = (short)(out[largest] + (1 << RESAMPLE_BITS) - sum);
+        }
+    }
+
+    const short* row(int i) const
+    {
+        return &weights[(size_t)i * taps];
+    }
+};
+
+// Rounds a weighted sum back to a channel value, clamped to 0-255
+inline unsigned char resample_round(int sum)
+{
+    return (unsigned char)max(0, min(255, (sum + (1 << (RESAMPLE_BITS - 1))) >> RESAMPLE_BITS));
+}
+
+#ifdef IMAGE_APP_X86_SIMD
+
+// Horizontal pass: pairs[k] holds pixels k and k + 1 interleaved as 16-bit
+// (blue k, blue k+1, green k, green k+1, red k, red k+1, 0, 0), so one
+// multiply-add applies two taps to all three channels
+__attribute__((target("sse2")))
+void resample_row_sse2(const short* pairs, unsigned char* out, int out_width, const ResampleWeights& weights)
+{
+    for (int x = 0; x < out_width; x++)
+    {
+        const short* w = weights.row(x);
+        const short* in = pairs + 8 * weights.first[x];
+        __m128i sum = _mm_setzero_si128();
+        for (int k = 0; k < weights.taps; k += 2)
+        {
+            __m128i pair_weights = _mm_set1_epi32((unsigned short)w[k] | ((unsigned int)(unsigned short)w[k + 1] << 16));
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_loadu_si128((const __m128i*)(in + 8 * k)), pair_weights));
+        }
+        int channels[4];
+        _mm_storeu_si128((__m128i*)channels, sum);
+        out[3 * x + 0] = resample_round(channels[0]);
+        out[3 * x + 1] = resample_round(channels[1]);
+        out[3 * x + 2] = resample_round(channels[2]);
+    }
+}
+
+// Vertical pass: multiplies two source rows by their weights, 16 bytes per step,
+// with the rows' bytes interleaved so each multiply-add handles both
+static inline __attribute__((target("sse2")))
+void madd_rows_sse2(const unsigned char* a, const unsigned char* b, __m128i weights, __m128i sums[4])
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i va = _mm_loadu_si128((const __m128i*)a);
+    __m128i vb = _mm_loadu_si128((const __m128i*)b);
+    __m128i low_a = _mm_unpacklo_epi8(va, zero);
+    __m128i low_b = _mm_unpacklo_epi8(vb, zero);
+    __m128i high_a = _mm_unpackhi_epi8(va, zero);
+    __m128i high_b = _mm_unpackhi_epi8(vb, zero);
+    sums[0] = _mm_add_epi32(sums[0], _mm_madd_epi16(_mm_unpacklo_epi16(low_a, low_b), weights));
+    sums[1] = _mm_add_epi32(sums[1], _mm_madd_epi16(_mm_unpackhi_epi16(low_a, low_b), weights));
+    sums[2] = _mm_add_epi32(sums[2], _mm_madd_epi16(_mm_unpacklo_epi16(high_a, high_b), weights));
+    sums[3] = _mm_add_epi32(sums[3], _mm_madd_epi16(_mm_unpackhi_epi16(high_a, high_b), weights));
+}
+
+__attribute__((target("sse2")))
+int resample_column_sse2(const unsigned char* const* rows, const short* w, int taps, unsigned char* out, int i, int count)
+{
+    __m128i round = _mm_set1_epi32(1 << (RESAMPLE_BITS - 1));
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i sums[4] = { round, round, round, round };
+        for (int k = 0; k < taps; k += 2)
+        {
+            __m128i weights = _mm_set1_epi32((unsigned short)w[k] | ((unsigned int)(unsigned short)w[k + 1] << 16));
+            madd_rows_sse2(rows[k] + i, rows[k + 1] + i, weights, sums);
+        }
+        __m128i low = _mm_packs_epi32(_mm_srai_epi32(sums[0], RESAMPLE_BITS), _mm_srai_epi32(sums[1], RESAMPLE_BITS));
+        __m128i high = _mm_packs_epi32(_mm_srai_epi32(sums[2], RESAMPLE_BITS), _mm_srai_epi32(sums[3], RESAMPLE_BITS));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(low, high));
+    }
+    return i;
+}
+
+// Same as resample_column_sse2, 32 bytes per step. Every unpack and pack works
+// within 128-bit lanes, so the bytes come out in their original order.
+__attribute__((target("avx2")))
+int resample_column_avx2(const unsigned char* const* rows, const short* w, int taps, unsigned char* out, int i, int count)
+{
+    __m256i round = _mm256_set1_epi32(1 << (RESAMPLE_BITS - 1));
+    __m256i zero = _mm256_setzero_si256();
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i sums[4] = { round, round, round, round };
+        for (int k = 0; k < taps; k += 2)
+        {
+            __m256i weights = _mm256_set1_epi32((unsigned short)w[k] | ((unsigned int)(unsigned short)w[k + 1] << 16));
+            __m256i va = _mm256_loadu_si256((const __m256i*)(rows[k] + i));
+            __m256i vb = _mm256_loadu_si256((const __m256i*)(rows[k + 1] + i));
+            __m256i low_a = _mm256_unpacklo_epi8(va, zero);
+            __m256i low_b = _mm256_unpacklo_epi8(vb, zero);
+            __m256i high_a = _mm256_unpackhi_epi8(va, zero);
+            __m256i high_b = _mm256_unpackhi_epi8(vb, zero);
+            sums[0] = _mm256_add_epi32(sums[0], _mm256_madd_epi16(_mm256_unpacklo_epi16(low_a, low_b), weights));
+            sums[1] = _mm256_add_epi32(sums[1], _mm256_madd_epi16(_mm256_unpackhi_epi16(low_a, low_b), weights));
+            sums[2] = _mm256_add_epi32(sums[2], _mm256_madd_epi16(_mm256_unpacklo_epi16(high_a, high_b), weights));
+            sums[3] = _mm256_add_epi32(sums[3], _mm256_madd_epi16(_mm256_unpackhi_epi16(high_a, high_b), weights));
+        }
+        __m256i low = _mm256_packs_epi32(_mm256_srai_epi32(sums[0], RESAMPLE_BITS),
+                                         _mm256_srai_epi32(sums[1], RESAMPLE_BITS));
+        __m256i high = _mm256_packs_epi32(_mm256_srai_epi32(sums[2], RESAMPLE_BITS),
+                                          _mm256_srai_epi32(sums[3], RESAMPLE_BITS));
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_packus_epi16(low, high));
+    }
+    return i;
+}
+
+#endif
+
+/**
+ * Resamples one row horizontally
+ * @param in      the source row
+ * @param out     the output row, weights.first.size() pixels wide
+ * @param width   the number of source pixels
+ * @param weights the horizontal weights
+ * @param pairs   scratch buffer reused between rows
+ * @return nothing
+ */
+void resample_row(const unsigned char* in, unsigned char* out, int width, const ResampleWeights& weights,
+                  vector<short>& pairs)
+{
+    int out_width = weights.first.size();
+#ifdef IMAGE_APP_X86_SIMD
+    if (active_simd_level >= SIMD_SSSE3)
+    {
+        // Zero pixels past the end of the row cover taps beyond a short axis
+        pairs.assign((size_t)8 * (width + weights.taps), 0);
+        for (int k = 0; k < width; k++)
+        {
+            const unsigned char* next = in + 3 * min(k + 1, width - 1);
+            short* pair = &pairs[(size_t)8 * k];
+            pair[0] = in[3 * k + 0];
+            pair[1] = next[0];
+            pair[2] = in[3 * k + 1];
+            pair[3] = next[1];
+            pair[4] = in[3 * k + 2];
+            pair[5] = next[2];
+            pair[6] = 0;
+            pair[7] = 0;
+        }
+        resample_row_sse2(&pairs[0], out, out_width, weights);
+        return;
+    }
+#else
+    (void)pairs;
+#endif
+    for (int x = 0; x < out_width; x++)
+    {
+        const short* w = weights.row(x);
+        const unsigned char* pixel = in + 3 * weights.first[x];
+        int taps = min(weights.taps, width - weights.first[x]);
+        int blue = 0;
+        int green = 0;
+        int red = 0;
+        for (int k = 0; k < taps; k++, pixel += 3)
+        {
+            blue += w[k] * pixel[0];
+            green += w[k] * pixel[1];
+            red += w[k] * pixel[2];
+        }
+        out[3 * x + 0] = resample_round(blue);
+        out[3 * x + 1] = resample_round(green);
+        out[3 * x + 2] = resample_round(red);
+    }
+}
+
+/**
+ * Resamples one output row vertically from rows of the horizontal pass
+ * @param rows  the taps source rows, already resampled horizontally
+ * @param w     the weights of those rows
+ * @param taps  the number of rows (even)
+ * @param out   the output row
+ * @param count the number of bytes in a row
+ * @return nothing
+ */
+void resample_column(const unsigned char* const* rows, const short* w, int taps, unsigned char* out, int count)
+{
+    int i = 0;
+#ifdef IMAGE_APP_X86_SIMD
+    if (active_simd_level == SIMD_AVX2)
+    {
+        i = resample_column_avx2(rows, w, taps, out, i, count);
+    }
+    if (active_simd_level >= SIMD_SSSE3)
+    {
+        i = resample_column_sse2(rows, w, taps, out, i, count);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        int sum = 0;
+        for (int k = 0; k < taps; k++)
+        {
+            sum += w[k] * rows[k][i];
+        }
+        out[i] = resample_round(sum);
+    }
+}
+
+/**
+ * Resamples an image to another size with a separable filter.
+ * Weights for each axis are computed once. The horizontal pass resamples
+ * every source row into an intermediate image as wide as the output; the
+ * vertical pass then combines intermediate rows into each output row. Both
+ * passes use 14-bit fixed-point weights and run bands of rows in parallel.
+ * Pass a crop_view() to resample only a region.
+ * @param image     the source image or region
+ * @param new_image the output image, of any size
+ * @param filter    the reconstruction filter
+ * @return nothing
+ */
+void resample_image(ConstImageView image, ImageView new_image, ResampleFilter filter)
+{
+    TraceScope scope("resample_image", "filter", (unsigned long long)new_image.width * new_image.height);
+    if (image.width <= 0 || image.height <= 0 || new_image.width <= 0 || new_image.height <= 0)
+    {
+        return;
+    }
+
+    ResampleWeights horizontal(image.width, new_image.width, filter);
+    ResampleWeights vertical(image.height, new_image.height, filter);
+
+    Image intermediate = image_pool().acquire(new_image.width, image.height);
+    parallel_rows(image.height, image.width, [&](int first_row, int last_row)
+    {
+        vector<short> pairs;
+        for (int row = first_row; row < last_row; row++)
+        {
+            resample_row(image.row(row), intermediate.row(row), image.width, horizontal, pairs);
+        }
+    });
+
+    int count = BYTES_PER_PIXEL * new_image.width;
+    parallel_rows(new_image.height, new_image.width * vertical.taps, [&](int first_row, int last_row)
+    {
+        vector<const unsigned char*> rows(vertical.taps);
+        for (int row = first_row; row < last_row; row++)
+        {
+            for (int k = 0; k < vertical.taps; k++)
+            {
+                rows[k] = intermediate.row(min(vertical.first[row] + k, image.height - 1));
+            }
+            resample_column(&rows[0], vertical.row(row), vertical.taps, new_image.row(row), count);
+        }
+    });
+    image_pool().recycle(move(intermediate));
+}
+
+Image resample_image(const Image& image, int width, int height, ResampleFilter filter)
+{
+    Image new_image = image_pool().acquire(max(width, 0), max(height, 0));
+    resample_image(image.view(), new_image.view(), filter);
+    return new_image;
+}
+
+/**
+ * Copies a region of an image
+ * @param image  the source image
+ * @param region the region to copy; clipped to the image
+ * @return the region, empty if it lies outside the image
+ */
+Image crop_image(const Image& image, Rect region)
+{
+    if (!clip_rect(region, image.width, image.height))
+    {
+        return Image();
+    }
+    ConstImageView view = crop_view(image.view(), region);
+    Image cropped = image_pool().acquire(region.width, region.height);
+    for (int row = 0; row < region.height; row++)
+    {
+        memcpy(cropped.row(row), view.row(row), BYTES_PER_PIXEL * region.width);
+    }
+    return cropped;
+}
+
+/**
+ * Crops an image to a region and resamples the region to a new size
+ * @param image  the source image
+ * @param region the region to keep; clipped to the image
+ * @param width  the output width
+ * @param height the output height
+ * @param filter the reconstruction filter
+ * @return the resampled region, empty if the region lies outside the image
+ */
+Image resample_image(const Image& image, Rect region, int width, int height, ResampleFilter filter)
+{
+    if (!clip_rect(region, image.width, image.height))
+    {
+        return Image();
+    }
+    Image new_image = image_pool().acquire(max(width, 0), max(height, 0));
+    resample_image(crop_view(image.view(), region), new_image.view(), filter);
+    return new_image;
+}
+
+// Legacy signature for resample_image
+vector<vector<Pixel>> resample_image(const vector<vector<Pixel>>& image, int width, int height, ResampleFilter filter)
+{
+    return to_pixels(resample_image(to_image(image), width, height, filter));
+}
+
+
+//*****************************************
+//     CONVOLUTION ENGINE
+//*****************************************
+
+// How convolution filters sample beyond the edges of an image
+enum BorderMode
+{
+    BORDER_CLAMP,       // Repeat the edge pixel
+    BORDER_REFLECT,     // Mirror about the edge pixel: 3 2 1 | 0 1 2 3
+    BORDER_WRAP,        // Continue from the opposite edge
+    BORDER_ZERO         // Black
+};
+
+// Largest values the neighborhood filters accept
+const int MAX_BOX_RADIUS = 10000;
+const double MAX_BLUR_SIGMA = 10000;
+const double MAX_SHARPEN_AMOUNT = 1000;
+
+/**
+ * Maps a position that may lie outside an axis back into it
+ * @param index the position
+ * @param size  the length of the axis
+ * @param mode  the border mode
+ * @return the position to sample, or -1 for a black sample (BORDER_ZERO)
+ */
+int border_index(int index, int size, BorderMode mode)
+{
+    if (index >= 0 && index < size)
+    {
+        return index;
+    }
+    switch (mode)
+    {
+        case BORDER_CLAMP:
+            return index < 0 ? 0 : size - 1;
+        case BORDER_REFLECT:
+        {
+            int period = max(2 * (size - 1), 1);
+            index %= period;
+            index += index < 0 ? period : 0;
+            return index < size ? index : period - index;
+        }
+        case BORDER_WRAP:
+            index %= size;
+            return index < 0 ? index + size : index;
+        case BORDER_ZERO:
+            break;
+    }
+    return -1;
+}
+
+/**
+ * A convolution kernel of width by height weights, centered on the pixel
+ * being computed; width and height are odd. A separable kernel is the
+ * product of a horizontal and a vertical vector and runs as two 1-D passes,
+ * width + height multiplies per pixel instead of width * height.
+ */
+struct Kernel
+{
+    int width;
+    int height;
+    vector<float> horizontal;   // Separable kernels: width weights
+    vector<float> vertical;     // Separable kernels: height weights
+    vector<float> weights;      // Other kernels: height rows of width weights
+    float bias;                 // Added to every result, e.g. 128 to center signed results on gray
+    bool absolute;              // Use the magnitude of each result, for edge detectors
+
+    bool separable() const
+    {
+        return weights.empty();
+    }
+};
+
+Kernel separable_kernel(const vector<float>& horizontal, const vector<float>& vertical)
+{
+    Kernel kernel;
+    kernel.width = horizontal.size();
+    kernel.height = vertical.size();
+    kernel.horizontal = horizontal;
+    kernel.vertical = vertical;
+    kernel.bias = 0;
+    kernel.absolute = false;
+    return kernel;
+}
+
+Kernel general_kernel(int width, int height, const vector<float>& weights)
+{
+    Kernel kernel;
+    kernel.width = width;
+    kernel.height = height;
+    kernel.weights = weights;
+    kernel.bias = 0;
+    kernel.absolute = false;
+    return kernel;
+}
+
+// Gaussian weights for one axis, cut off at three sigma or at max_radius, whichever is nearer
+vector<float> gaussian_weights(double sigma, int max_radius)
+{
+    int radius = (int)max(0.0, min(ceil(3 * sigma), (double)max_radius));
+    vector<float> weights(2 * radius + 1, 1.0f);
+    if (sigma > 0)
+    {
+        double total = 0;
+        for (int i = -radius; i <= radius; i++)
+        {
+            total += exp(-0.5 * i * i / (sigma * sigma));
+        }
+        for (int i = -radius; i <= radius; i++)
+        {
+            weights[i + radius] = exp(-0.5 * i * i / (sigma * sigma)) / total;
+        }
+    }
+    return weights;
+}
+
+/**
+ * Gaussian blur with standard deviation sigma, cut off at three sigma. Taps
+ * more than twice the image's size away only revisit pixels nearer taps
+ * already reach, so each axis stops there.
+ * @param sigma  the standard deviation, at most MAX_BLUR_SIGMA
+ * @param width  the width of the image the kernel is for
+ * @param height the height of the image the kernel is for
+ * @return the kernel
+ */
+Kernel gaussian_kernel(double sigma, int width, int height)
+{
+    return separable_kernel(gaussian_weights(sigma, 2 * max(width, 1)), gaussian_weights(sigma, 2 * max(height, 1)));
+}
+
+// Sharpening: each pixel minus amount times the difference from its four neighbors
+Kernel sharpen_kernel(double amount)
+{
+    float side = -amount;
+    float center = 1 + 4 * amount;
+    float weights[] = { 0,    side,   0,
+                        side, center, side,
+                        0,    side,   0 };
+    return general_kernel(3, 3, vector<float>(weights, weights + 9));
+}
+
+// Edge detection: the magnitude of the Laplacian over all eight neighbors
+Kernel edge_kernel()
+{
+    float weights[] = { -1, -1, -1,
+                        -1,  8, -1,
+                        -1, -1, -1 };
+    Kernel kernel = general_kernel(3, 3, vector<float>(weights, weights + 9));
+    kernel.absolute = true;
+    return kernel;
+}
+
+#ifdef IMAGE_APP_X86_SIMD
+
+// acc[i] += in[i] * weights[0] + in[i + step] * weights[1] + ..., 4 values at a time
+__attribute__((target("sse2")))
+int convolve_row_sse2(const float* in, float* acc, const float* weights, int taps, int step, int count)
+{
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 sum = _mm_loadu_ps(acc + i);
+        for (int k = 0; k < taps; k++)
+        {
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(in + i + step * k), _mm_set1_ps(weights[k])));
+        }
+        _mm_storeu_ps(acc + i, sum);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+int convolve_row_avx2(const float* in, float* acc, const float* weights, int taps, int step, int count)
+{
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 sum = _mm256_loadu_ps(acc + i);
+        for (int k = 0; k < taps; k++)
+        {
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(in + i + step * k), _mm256_set1_ps(weights[k])));
+        }
+        _mm256_storeu_ps(acc + i, sum);
+    }
+    return i;
+}
+
+// out[i] = rows[0][i] * weights[0] + rows[1][i] * weights[1] + ..., 8 values at a time
+__attribute__((target("avx2")))
+int convolve_column_avx2(const float* const* rows, const float* weights, int taps, float* out, int count)
+{
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 sum = _mm256_setzero_ps();
+        for (int k = 0; k < taps; k++)
+        {
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(rows[k] + i), _mm256_set1_ps(weights[k])));
+        }
+        _mm256_storeu_ps(out + i, sum);
+    }
+    return i;
+}
+
+__attribute__((target("sse2")))
+int convolve_column_sse2(const float* const* rows, const float* weights, int taps, float* out, int i, int count)
+{
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 sum = _mm_setzero_ps();
+        for (int k = 0; k < taps; k++)
+        {
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(rows[k] + i), _mm_set1_ps(weights[k])));
+        }
+        _mm_storeu_ps(out + i, sum);
+    }
+    return i;
+}
+
+// Rounds 16 results to channel values; see store_row()
+__attribute__((target("sse2")))
+int store_row_sse2(const float* acc, unsigned char* out, int count, float bias, bool absolute)
+{
+    __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 biases = _mm_set1_ps(bias);
+    __m128 low = _mm_set1_ps(-1.0f);
+    __m128 high = _mm_set1_ps(256.0f);
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i words[4];
+        for (int j = 0; j < 4; j++)
+        {
+            __m128 value = _mm_loadu_ps(acc + i + 4 * j);
+            value = absolute ? _mm_andnot_ps(sign, value) : value;
+            value = _mm_min_ps(_mm_max_ps(_mm_add_ps(value, biases), low), high);
+            words[j] = _mm_cvtps_epi32(value);
+        }
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(words[0], words[1]), _mm_packs_epi32(words[2], words[3]));
+        _mm_storeu_si128((__m128i*)(out + i), packed);
+    }
+    return i;
+}
+
+// Box blur window update: sums[i] += entering[i] - leaving[i], 4 values at a time
+__attribute__((target("sse2")))
+int slide_sums_sse2(int* sums, const int* entering, const int* leaving, int count)
+{
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i sum = _mm_loadu_si128((const __m128i*)(sums + i));
+        sum = _mm_add_epi32(sum, _mm_loadu_si128((const __m128i*)(entering + i)));
+        sum = _mm_sub_epi32(sum, _mm_loadu_si128((const __m128i*)(leaving + i)));
+        _mm_storeu_si128((__m128i*)(sums + i), sum);
+    }
+    return i;
+}
+
+// Box blur averages: (int)(sums[i] * inverse + half), computed in double, 4 values at a time
+__attribute__((target("sse2")))
+int average_sums_sse2(const int* sums, unsigned char* out, int count, double inverse, double half)
+{
+    __m128d inverses = _mm_set1_pd(inverse);
+    __m128d halves = _mm_set1_pd(half);
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i sum = _mm_loadu_si128((const __m128i*)(sums + i));
+        __m128d low = _mm_add_pd(_mm_mul_pd(_mm_cvtepi32_pd(sum), inverses), halves);
+        __m128d high = _mm_add_pd(_mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(sum, 8)), inverses), halves);
+        __m128i values = _mm_unpacklo_epi64(_mm_cvttpd_epi32(low), _mm_cvttpd_epi32(high));
+        values = _mm_packus_epi16(_mm_packs_epi32(values, values), values);
+        int packed = _mm_cvtsi128_si32(values);
+        memcpy(out + i, &packed, 4);
+    }
+    return i;
+}
+
+#endif
+
+/**
+ * Adds a 1-D convolution of a row of floats to an accumulator
+ * @param in      the input; in[i + step * (taps - 1)] must exist for every i
+ * @param acc     the accumulator, count values
+ * @param weights the taps weights
+ * @param taps    the number of weights
+ * @param step    the distance between the values one output combines
+ * @param count   the number of outputs
+ * @return nothing
+ */
+void convolve_row(const float* in, float* acc, const float* weights, int taps, int step, int count)
+{
+    int i = 0;
+#ifdef IMAGE_APP_X86_SIMD
+    if (active_simd_level == SIMD_AVX2)
+    {
+        i = convolve_row_avx2(in, acc, weights, taps, step, count);
+    }
+    if (active_simd_level >= SIMD_SSSE3)
+    {
+        i += convolve_row_sse2(in + i, acc + i, weights, taps, step, count - i);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        float sum = acc[i];
+        for (int k = 0; k < taps; k++)
+        {
+            sum += in[i + step * k] * weights[k];
+        }
+        acc[i] = sum;
+    }
+}
+
+// Weighted sum of taps rows of floats into out; the vertical pass of a separable kernel
+void convolve_column(const float* const* rows, const float* weights, int taps, float* out, int count)
+{
+    int i = 0;
+#ifdef IMAGE_APP_X86_SIMD
+    if (active_simd_level == SIMD_AVX2)
+    {
+        i = convolve_column_avx2(rows, weights, taps, out, count);
+    }
+    if (active_simd_level >= SIMD_SSSE3)
+    {
+        i = convolve_column_sse2(rows, weights, taps, out, i, count);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        float sum = 0;
+        for (int k = 0; k < taps; k++)
+        {
+            sum += rows[k][i] * weights[k];
+        }
+        out[i] = sum;
+    }
+}
+
+/**
+ * Rounds convolution results to channel values: the magnitude if absolute,
+ * plus the bias, rounded to nearest (ties to even) and clamped to 0-255
+ * @return nothing
+ */
+void store_row(const float* acc, unsigned char* out, int count, float bias, bool absolute)
+{
+    int i = 0;
+#ifdef IMAGE_APP_X86_SIMD
+    if (active_simd_level >= SIMD_SSSE3)
+    {
+        i = store_row_sse2(acc, out, count, bias, absolute);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        float value = absolute ? fabsf(acc[i]) : acc[i];
+        value = min(max(value + bias, -1.0f), 256.0f);
+        out[i] = (unsigned char)max(0, min(255, (int)lrintf(value)));
+    }
+}
+
+// Converts a row to floats with pad pixels on each side filled according to the border mode
+void pad_row(const unsigned char* in, int width, int pad, BorderMode mode, float* out)
+{
+    for (int i = 0; i < BYTES_PER_PIXEL * width; i++)
+    {
+        out[BYTES_PER_PIXEL * pad + i] = in[i];
+    }
+    for (int col = -pad; col < 0; col++)
+    {
+        for (int side = 0; side < 2; side++)
+        {
+            int position = side == 0 ? col : width - 1 - col;
+            int source = border_index(position, width, mode);
+            float* pixel = out + BYTES_PER_PIXEL * (position + pad);
+            for (int channel = 0; channel < BYTES_PER_PIXEL; channel++)
+            {
+                pixel[channel] = source < 0 ? 0.0f : in[BYTES_PER_PIXEL * source + channel];
+            }
+        }
+    }
+}
+
+/**
+ * Convolves an image with a kernel.
+ * Rows are converted to floats with their borders filled in, and each band
+ * of rows runs on the thread pool. A separable kernel filters each source
+ * row horizontally once into a ring of kernel.height rows, and every output
+ * row is then a weighted sum down the ring. Other kernels add up one
+ * horizontal pass per kernel row. Both passes use SSE2 or AVX2 on the
+ * interleaved channels directly, and the scalar fallback gives the same
+ * results.
+ * @param image     the input image
+ * @param new_image the output image, the same size; must not overlap image
+ * @param kernel    the kernel
+ * @param mode      how to sample beyond the edges
+ * @return nothing
+ */
+void convolve(ConstImageView image, ImageView new_image, const Kernel& kernel, BorderMode mode = BORDER_REFLECT)
+{
+    TraceScope scope("convolve", "filter", (unsigned long long)image.width * image.height);
+    int radius_x = kernel.width / 2;
+    int radius_y = kernel.height / 2;
+    int count = BYTES_PER_PIXEL * image.width;
+
+    parallel_rows(image.height, image.width * (kernel.width + kernel.height), [&](int first_row, int last_row)
+    {
+        vector<float> padded(BYTES_PER_PIXEL * (image.width + 2 * radius_x));
+        vector<float> acc(count);
+        if (!kernel.separable())
+        {
+            for (int row = first_row; row < last_row; row++)
+            {
+                fill(acc.begin(), acc.end(), 0.0f);
+                for (int k = 0; k < kernel.height; k++)
+                {
+                    int source = border_index(row + k - radius_y, image.height, mode);
+                    if (source >= 0)
+                    {
+                        pad_row(image.row(source), image.width, radius_x, mode, &padded[0]);
+                        convolve_row(&padded[0], &acc[0], &kernel.weights[k * kernel.width], kernel.width,
+                                     BYTES_PER_PIXEL, count);
+                    }
+                }
+                store_row(&acc[0], new_image.row(row), count, kernel.bias, kernel.absolute);
+            }
+            return;
+        }
+
+        // Source row r, filtered horizontally, lives in slot (r - first_row + radius_y) % height
+        vector<float> ring((size_t)kernel.height * count);
+        vector<const float*> rows(kernel.height);
+        for (int row = first_row - radius_y; row < last_row + radius_y; row++)
+        {
+            float* slot = &ring[(size_t)((row - first_row + radius_y) % kernel.height) * count];
+            fill(slot, slot + count, 0.0f);
+            int source = border_index(row, image.height, mode);
+            if (source >= 0)
+            {
+                pad_row(image.row(source), image.width, radius_x, mode, &padded[0]);
+                convolve_row(&padded[0], slot, &kernel.horizontal[0], kernel.width, BYTES_PER_PIXEL, count);
+            }
+
+            // Once the ring holds every row the output row below needs, combine them
+            int output = row - radius_y;
+            if (output >= first_row)
+            {
+                for (int k = 0; k < kernel.height; k++)
+                {
+                    rows[k] = &ring[(size_t)((output + k - first_row) % kernel.height) * count];
+                }
+                convolve_column(&rows[0], &kernel.vertical[0], kernel.height, &acc[0], count);
+                store_row(&acc[0], new_image.row(output), count, kernel.bias, kernel.absolute);
+            }
+        }
+    });
+}
+
+Image convolve(const Image& image, const Kernel& kernel, BorderMode mode = BORDER_REFLECT)
+{
+    Image new_image = image_pool().acquire(image.width, image.height);
+    convolve(image.view(), new_image.view(), kernel, mode);
+    return new_image;
+}
+
+// Legacy signature for convolve
+vector<vector<Pixel>> convolve(const vector<vector<Pixel>>& image, const Kernel& kernel,
+                               BorderMode mode = BORDER_REFLECT)
+{
+    return to_pixels(convolve(to_image(image), kernel, mode));
+}
+
+// Box blur window update: sums[i] += entering[i] - leaving[i]; returns how many values SIMD covered
+int slide_sums(int* sums, const int* entering, const int* leaving, int count)
+{
+#ifdef IMAGE_APP_X86_SIMD
+    if (active_simd_level >= SIMD_SSSE3)
+    {
+        return slide_sums_sse2(sums, entering, leaving, count);
+    }
+#endif
+    return 0;
+}
+
+int slide_sums(long long*, const int*, const int*, int)
+{
+    return 0;
+}
+
+// Box blur averages: (int)(sums[i] * inverse + half); returns how many values SIMD covered
+int average_sums(const int* sums, unsigned char* out, int count, double inverse, double half)
+{
+#ifdef IMAGE_APP_X86_SIMD
+    if (active_simd_level >= SIMD_SSSE3)
+    {
+        return average_sums_sse2(sums, out, count, inverse, half);
+    }
+#endif
+    return 0;
+}
+
+int average_sums(const long long*, unsigned char*, int, double, double)
+{
+    return 0;
+}
+
+/**
+ * Box blurs a band of rows; see box_blur(). Sum is int while 255 times the
+ * window's area fits one, and long long for the larger windows.
+ * @param image     the input image
+ * @param new_image the output image
+ * @param radius    the neighborhood radius
+ * @param mode      how to sample beyond the edges
+ * @param first_row the first row of the band
+ * @param last_row  one past the last row of the band
+ * @return nothing
+ */
+template <typename Sum>
+void box_blur_rows(ConstImageView image, ImageView new_image, int radius, BorderMode mode, int first_row, int last_row)
+{
+    int size = 2 * radius + 1;
+    int count = BYTES_PER_PIXEL * image.width;
+
+    // (sum + area / 2 + 1/4) / area rounds exactly: the quarter covers the error of the double
+    // reciprocal and is too small to reach the next whole number
+    double area = (double)size * size;
+    double inverse = 1.0 / area;
+    double half = (area / 2 + 0.25) * inverse;
+
+    vector<unsigned char> padded(BYTES_PER_PIXEL * (image.width + 2 * radius));
+    vector<int> row_sums(count);
+    vector<int> entering(count);
+    vector<Sum> column_sums(count, 0);
+
+    // Fills row_sums with the horizontal window sums of a row; false for a black row
+    auto sum_row = [&](int row)
+    {
+        int source = border_index(row, image.height, mode);
+        if (source < 0)
+        {
+            return false;
+        }
+        const unsigned char* in = image.row(source);
+        memcpy(&padded[BYTES_PER_PIXEL * radius], in, count);
+        for (int col = -radius; col < 0; col++)
+        {
+            int left = border_index(col, image.width, mode);
+            int right = border_index(image.width - 1 - col, image.width, mode);
+            for (int channel = 0; channel < BYTES_PER_PIXEL; channel++)
+            {
+                padded[BYTES_PER_PIXEL * (col + radius) + channel] =
+                    left < 0 ? 0 : in[BYTES_PER_PIXEL * left + channel];
+                padded[BYTES_PER_PIXEL * (image.width - 1 - col + radius) + channel] =
+                    right < 0 ? 0 : in[BYTES_PER_PIXEL * right + channel];
+            }
+        }
+
+        // The three running sums stay in registers as the window slides along the row
+        int blue = 0;
+        int green = 0;
+        int red = 0;
+        for (int k = 0; k < size; k++)
+        {
+            blue += padded[3 * k + 0];
+            green += padded[3 * k + 1];
+            red += padded[3 * k + 2];
+        }
+        const unsigned char* leaving = &padded[0];
+        const unsigned char* entering_pixel = &padded[BYTES_PER_PIXEL * size];
+        int* sums = &row_sums[0];
+        for (int col = 0; col < image.width; col++)
+        {
+            sums[3 * col + 0] = blue;
+            sums[3 * col + 1] = green;
+            sums[3 * col + 2] = red;
+            if (col + 1 < image.width)
+            {
+                blue += entering_pixel[3 * col + 0] - leaving[3 * col + 0];
+                green += entering_pixel[3 * col + 1] - leaving[3 * col + 1];
+                red += entering_pixel[3 * col + 2] - leaving[3 * col + 2];
+            }
+        }
+        return true;
+    };
+
+    for (int row = first_row - radius; row <= first_row + radius; row++)
+    {
+        if (sum_row(row))
+        {
+            for (int i = 0; i < count; i++)
+            {
+                column_sums[i] += row_sums[i];
+            }
+        }
+    }
+    for (int row = first_row; row < last_row; row++)
+    {
+        unsigned char* out = new_image.row(row);
+        for (int i = average_sums(&column_sums[0], out, count, inverse, half); i < count; i++)
+        {
+            out[i] = (unsigned char)(int)(column_sums[i] * inverse + half);
+        }
+        if (row + 1 == last_row)
+        {
+            break;
+        }
+
+        // Slide the window down: add the entering row and subtract the leaving one in one pass
+        if (!sum_row(row + radius + 1))
+        {
+            fill(row_sums.begin(), row_sums.end(), 0);
+        }
+        entering.swap(row_sums);
+        if (!sum_row(row - radius))
+        {
+            fill(row_sums.begin(), row_sums.end(), 0);
+        }
+        for (int i = slide_sums(&column_sums[0], &entering[0], &row_sums[0], count); i < count; i++)
+        {
+            column_sums[i] += entering[i] - row_sums[i];
+        }
+    }
+}
+
+/**
+ * Averages each pixel's (2 * radius + 1) square neighborhood with running
+ * sums, so the cost per pixel is the same for every radius. Each band keeps
+ * the sum of every column over the rows in its window; moving down a row
+ * adds the horizontal window sums of the row entering and subtracts those of
+ * the row leaving, each found by sliding along the row. Results round to
+ * nearest, exactly.
+ * @param image     the input image
+ * @param new_image the output image, the same size; must not overlap image
+ * @param radius    the neighborhood radius, at most MAX_BOX_RADIUS
+ * @param mode      how to sample beyond the edges
+ * @return nothing
+ */
+void box_blur(ConstImageView image, ImageView new_image, int radius, BorderMode mode = BORDER_REFLECT)
+{
+    TraceScope scope("box_blur", "filter", (unsigned long long)image.width * image.height);
+    radius = min(max(radius, 0), MAX_BOX_RADIUS);
+    double size = 2.0 * radius + 1;
+    bool wide = 255 * size * size > INT_MAX;
+    parallel_rows(image.height, image.width, [&](int first_row, int last_row)
+    {
+        if (wide)
+        {
+            box_blur_rows<long long>(image, new_image, radius, mode, first_row, last_row);
+        }
+        else
+        {
+            box_blur_rows<int>(image, new_image, radius, mode, first_row, last_row);
+        }
+    });
+}
+
+Image box_blur(const Image& image, int radius, BorderMode mode = BORDER_REFLECT)
+{
+    Image new_image = image_pool().acquire(image.width, image.height);
+    box_blur(image.view(), new_image.view(), radius, mode);
+    return new_image;
+}
+
+Image gaussian_blur(const Image& image, double sigma, BorderMode mode = BORDER_REFLECT)
+{
+    return convolve(image, gaussian_kernel(sigma, image.width, image.height), mode);
+}
+
+Image sharpen(const Image& image, double amount, BorderMode mode = BORDER_REFLECT)
+{
+    return convolve(image, sharpen_kernel(amount), mode);
+}
+
+Image detect_edges(const Image& image, BorderMode mode = BORDER_REFLECT)
+{
+    return convolve(image, edge_kernel(), mode);
+}
+
+
+//************************************
+//     PROCESS 1
+//************************************
+
+// Function to apply a radial darkening effect to an image based on distance from the center
+// mode selects double weights or Q15 weights; see apply_vignette_row()
+void process_1(ConstImageView image, ImageView new_image, ArithmeticMode mode = ARITHMETIC_EXACT)
+{
+    TraceScope scope("process_1", "filter", (unsigned long long)image.width * image.height);
+    // Each pixel is scaled by (num_rows - distance) / num_rows, closer to center = brighter.
+    // The weights come from the cached map for this image size.
+    apply_vignette(image, new_image, mode);
+}
+
+Image process_1(const Image& image, ArithmeticMode mode = ARITHMETIC_EXACT)
+{
+    Image new_image = image_pool().acquire(image.width, image.height);
+    process_1(image.view(), new_image.view(), mode);
+    return new_image;
+}
+
+// Legacy signature for process_1
+vector<vector<Pixel>> process_1(const vector<vector<Pixel>>& image)
+{
+    return to_pixels(process_1(to_image(image)));
+}
+
+
+
+//************************************
+//     PROCESS 2
+//************************************
+
+// Function to adjust pixel brightness based on lightness using a scaling factor
+// Brightens one channel of a bright pixel using inverse scaling
+int process_2_bright_channel(int value, double scaling_factor)
+{
+    return 255 - (255 - value) * scaling_factor;
+}
+
+// Darkens one channel of a dark pixel using direct scaling
+int process_2_dark_channel(int value, double scaling_factor)
+{
+    return value * scaling_factor;
+}
+
+// Lightness bands of process_2: pixels whose average is below DARK_BELOW are darkened,
+// those from BRIGHT_FROM up are brightened
+const int CLARENDON_DARK_BELOW = 90;
+const int CLARENDON_BRIGHT_FROM = 170;
+
+// Applies process_2 to one row of pixels; in and out may point to the same row
+// bright and dark are the lookup tables for process_2_bright_channel and process_2_dark_channel
+void process_2_row(const unsigned char* in, unsigned char* out, int width,
+                   const ChannelLut& bright, const ChannelLut& dark,
+                   int dark_below = CLARENDON_DARK_BELOW, int bright_from = CLARENDON_BRIGHT_FROM)
+{
+    // Loop through each column in the input image
+    for (int col = 0; col < width; col++)
+    {
+        // Sum the blue, green, and red components of the current pixel
+        // (an average of at least 170 is a sum of at least 510, below 90 is below 270)
+        int sum = in[3 * col + 0] + in[3 * col + 1] + in[3 * col + 2];
+
+        // Bright pixels are brightened further, dark pixels darkened further
+        // and everything in between is kept unchanged
+        const unsigned char* table = nullptr;
+        if (sum >= 3 * bright_from)
+        {
+            table = bright.values;
+        }
+        else if (sum < 3 * dark_below)
+        {
+            table = dark.values;
+        }
+
+        if (table)
+        {
+            out[3 * col + 0] = table[in[3 * col + 0]];
+            out[3 * col + 1] = table[in[3 * col + 1]];
+            out[3 * col + 2] = table[in[3 * col + 2]];
+        }
+        else if (in != out)
+        {
+            memcpy(out + 3 * col, in + 3 * col, BYTES_PER_PIXEL);
+        }
+    }
+}
+
+// Fixed-point version of process_2_row; factor is the Q8.8 scaling factor, at most 256
+void process_2_fixed_row(const unsigned char* in, unsigned char* out, int width, int factor,
+                         int dark_below = CLARENDON_DARK_BELOW, int bright_from = CLARENDON_BRIGHT_FROM)
+{
+    int col = 0;
+#ifdef IMAGE_APP_X86_SIMD
+    if (active_simd_level >= SIMD_SSSE3)
+    {
+        col = process_2_fixed_ssse3(in, out, width, factor, dark_below, bright_from);
+    }
+#endif
+    for (; col < width; col++)
+    {
+        int sum = in[3 * col + 0] + in[3 * col + 1] + in[3 * col + 2];
+        for (int channel = 0; channel < BYTES_PER_PIXEL; channel++)
+        {
+            int value = in[3 * col + channel];
+            if (sum >= 3 * bright_from)
+            {
+                out[3 * col + channel] = invert_scale_q8(value, factor);
+            }
+            else if (sum < 3 * dark_below)
+            {
+                out[3 * col + channel] = scale_q8(value, factor);
+            }
+            else
+            {
+                out[3 * col + channel] = value;
+            }
+        }
+    }
+}
+
+// mode selects the lookup tables or, for factors from 0 to 1, Q8.8 integer kernels (see q8_factor())
+// dark_below and bright_from move the lightness bands, as averages of the three channels
+void process_2(ConstImageView image, ImageView new_image, double scaling_factor,
+               ArithmeticMode mode = ARITHMETIC_EXACT,
+               int dark_below = CLARENDON_DARK_BELOW, int bright_from = CLARENDON_BRIGHT_FROM)
+{
+    TraceScope scope("process_2", "filter", (unsigned long long)image.width * image.height);
+    if (mode == ARITHMETIC_FIXED_POINT && fixed_point_unit_factor(scaling_factor))
+    {
+        int factor = q8_factor(scaling_factor);
+        parallel_rows(image.height, image.width, [&](int first_row, int last_row)
+        {
+            for (int row = first_row; row < last_row; row++)
+            {
+                process_2_fixed_row(image.row(row), new_image.row(row), image.width, factor,
+                                    dark_below, bright_from);
+            }
+        });
+        return;
+    }
+
+    // Build the lookup tables once for this scaling factor
+    ChannelLut bright = channel_lut(process_2_bright_channel, scaling_factor);
+    ChannelLut dark = channel_lut(process_2_dark_channel, scaling_factor);
+
+    parallel_rows(image.height, image.width, [&](int first_row, int last_row)
+    {
+        // Loop through each row in the input image
+        for (int row = first_row; row < last_row; row++)
+        {
+            process_2_row(image.row(row), new_image.row(row), image.width, bright, dark, dark_below, bright_from);
+        }
+    });
+}
+
+Image process_2(const Image& image, double scaling_factor, ArithmeticMode mode = ARITHMETIC_EXACT,
+                int dark_below = CLARENDON_DARK_BELOW, int bright_from = CLARENDON_BRIGHT_FROM)
+{
+    Image new_image = image_pool().acquire(image.width, image.height);
+    process_2(image.view(), new_image.view(), scaling_factor, mode, dark_below, bright_from);
+    return new_image;
+}
+
+// Legacy signature for process_2
+vector<vector<Pixel>> process_2(const vector<vector<Pixel>>& image, double scaling_factor)
+{
+    return to_pixels(process_2(to_image(image), scaling_factor));
+}
+
+/**
+ * Chooses the lightness bands of process_2 from an image's statistics.
+ * Otsu's method splits the pixels into a dark and a bright class; pixels
+ * darker than the dark class's average are darkened and pixels at least as
+ * bright as the bright class's average are brightened. With percentiles,
+ * pixels at or below the dark percentile are darkened and pixels above the
+ * bright percentile are brightened.
+ * @param stats          the image statistics
+ * @param method         how to choose the bands
+ * @param dark_percent   the dark percentile, 0 to 100
+ * @param bright_percent the bright percentile, 0 to 100
+ * @param dark_below     receives the average below which pixels are darkened
+ * @param bright_from    receives the average from which pixels are brightened
+ * @return nothing
+ */
+void clarendon_bands(const ImageStats& stats, ThresholdMethod method, double dark_percent, double bright_percent,
+                     int& dark_below, int& bright_from)
+{
+    dark_below = CLARENDON_DARK_BELOW;
+    bright_from = CLARENDON_BRIGHT_FROM;
+    if (method == THRESHOLD_PERCENTILE)
+    {
+        dark_below = stats.percentile(dark_percent) + 1;
+        bright_from = stats.percentile(bright_percent) + 1;
+    }
+    else if (method == THRESHOLD_OTSU)
+    {
+        int threshold = otsu_threshold(stats);
+        const unsigned long long* gray = stats.histograms[STATS_GRAY];
+        double sums[2] = { 0, 0 };
+        double counts[2] = { 0, 0 };
+        for (int level = 0; level < 256; level++)
+        {
+            sums[level >= threshold] += (double)level * gray[level];
+            counts[level >= threshold] += gray[level];
+        }
+        if (counts[0] > 0 && counts[1] > 0)
+        {
+            dark_below = (int)lround(sums[0] / counts[0]);
+            bright_from = (int)lround(sums[1] / counts[1]);
+        }
+    }
+}
+
+/**
+ * Applies process_2 with lightness bands chosen from the image: one extra
+ * read of the image to count its histogram, then the usual single pass
+ * @param image          the image
+ * @param scaling_factor the scaling factor
+ * @param method         how to choose the bands (see clarendon_bands())
+ * @param dark_percent   the dark percentile for THRESHOLD_PERCENTILE
+ * @param bright_percent the bright percentile for THRESHOLD_PERCENTILE
+ * @param mode           exact or fixed-point arithmetic
+ * @return the new image
+ */
+Image process_2_adaptive(const Image& image, double scaling_factor, ThresholdMethod method,
+                         double dark_percent = 25, double bright_percent = 75, ArithmeticMode mode = ARITHMETIC_EXACT)
+{
+    int dark_below;
+    int bright_from;
+    clarendon_bands(image_stats(image), method, dark_percent, bright_percent, dark_below, bright_from);
+    return process_2(image, scaling_factor, mode, dark_below, bright_from);
+}
+
+
+//*****************************************
+//     PROCESS 3
+//*****************************************
+
+// Function to convert a color image to grayscale by averaging RGB values
+// Applies process_3 to one row of pixels; in and out may point to the same row
+void process_3_row(const unsigned char* in, unsigned char* out, int width)
+{
+    // The vector kernel handles as many pixels as it can; the loop below finishes the row
+    int col = simd_row(3, in, out, width);
+
+    // Loop through each column of the image
+    for (; col < width; col++)
+    {
+        // Calculate the average of the RGB components to determine the gray shade
+        double gray_color = (in[3 * col + 0] + in[3 * col + 1] + in[3 * col + 2]) / 3.0;
+
+        // Assign the same gray value to each component to create a grayscale pixel
+        unsigned char gray = to_channel(gray_color);
+        out[3 * col + 0] = gray;
+        out[3 * col + 1] = gray;
+        out[3 * col + 2] = gray;
+    }
+}
+
+void process_3(ConstImageView image, ImageView new_image)
+{
+    TraceScope scope("process_3", "filter", (unsigned long long)image.width * image.height);
+    parallel_rows(image.height, image.width, [&](int first_row, int last_row)
+    {
+        // Loop through each row of the image
+        for (int row = first_row; row < last_row; row++)
+        {
+            process_3_row(image.row(row), new_image.row(row), image.width);
+        }
+    });
+}
+
+Image process_3(const Image& image)
+{
+    Image new_image = image_pool().acquire(image.width, image.height);
+    process_3(image.view(), new_image.view());
+    return new_image;
+}
+
+// Legacy signature for process_3
+vector<vector<Pixel>> process_3(const vector<vector<Pixel>>& image)
+{
+    return to_pixels(process_3(to_image(image)));
+}
+
+
+//*****************************************
+//     PROCESS 4
+//*****************************************
+
+// Function to rotate an image 90 degrees clockwise
+// new_image must be image.height pixels wide and image.width pixels tall
+void process_4(ConstImageView image, ImageView new_image)
+{
+    TraceScope scope("process_4", "filter", (unsigned long long)image.width * image.height);
+    // Copy each pixel (row, col) to (col, num_rows - 1 - row) as a tiled transpose
+    rotate_image(image, new_image, 1);
+}
+
+Image process_4(const Image& image)
+{
+    // Create a new image with swapped dimensions (width becomes height, height becomes width)
+    Image new_image = image_pool().acquire(image.height, image.width);
+    process_4(image.view(), new_image.view());
+    return new_image;
+}
+
+// Legacy signature for process_4
+vector<vector<Pixel>> process_4(const vector<vector<Pixel>>& image)
+{
+    return to_pixels(process_4(to_image(image)));
+}
+
+
+//*****************************************
+//     PROCESS 5
+//*****************************************
+
+// Function to rotate an image by 90-degree increments based on the input number
+Image process_5(const Image& image, int number)
+{
+    TraceScope scope("process_5", "filter", (unsigned long long)image.width * image.height);
+    // 90, 180 and 270 degrees are each a single pass; full rotations copy the image unchanged
+    return rotate_image(image, number);
+}
+
+// Legacy signature for process_5
+vector<vector<Pixel>> process_5(const vector<vector<Pixel>>& image, int number)
+{
+    return to_pixels(process_5(to_image(image), number));
+}
+
+
+//*****************************************
+//     PROCESS 6
+//*****************************************
+
+// Function to scale an image by repeating pixels based on x and y scaling factors
+// new_image must be x_scale times wider and y_scale times taller than image
+void process_6(ConstImageView image, ImageView new_image, int x_scale, int y_scale)
+{
+    TraceScope scope("process_6", "filter", (unsigned long long)new_image.width * new_image.height);
+    // Each source row is enlarged once and then copied down y_scale - 1 times
+    enlarge_image(image, new_image, x_scale, y_scale);
+}
+
+Image process_6(const Image& image, int x_scale, int y_scale)
+{
+    // Create a new image with the scaled dimensions
+    Image new_image = image_pool().acquire(x_scale * image.width, y_scale * image.height);
+    if (!new_image.empty())
+    {
+        process_6(image.view(), new_image.view(), x_scale, y_scale);
+    }
+    return new_image;
+}
+
+// Legacy signature for process_6
+vector<vector<Pixel>> process_6(const vector<vector<Pixel>>& image, int x_scale, int y_scale)
+{
+    return to_pixels(process_6(to_image(image), x_scale, y_scale));
+}
+
+
+
+//*****************************************
+//     PROCESS 7
+//*****************************************
+
+// Function to apply a black-and-white threshold filter to an image
+// Gray level at which process_7 turns pixels white
+const int HIGH_CONTRAST_THRESHOLD = 255 / 2;
+
+// Applies process_7 to one row of pixels; in and out may point to the same row
+// threshold is a gray level; at 0 or below every pixel turns white, above 255 every pixel black
+void process_7_row(const unsigned char* in, unsigned char* out, int width, int threshold = HIGH_CONTRAST_THRESHOLD)
+{
+    // The vector kernel handles as many pixels as it can; the loop below finishes the row.
+    // It compares gray levels as bytes, so thresholds outside 0 to 255 are left to the loop.
+    int col = threshold >= 0 && threshold <= 255 ? simd_row(7, in, out, width, threshold) : 0;
+
+    // Loop through each column of the image
+    for (; col < width; col++)
+    {
+        // Calculate the average of the color values to get a grayscale value
+        int gray_value = (in[3 * col + 0] + in[3 * col + 1] + in[3 * col + 2]) / 3;
+
+        // If the grayscale value is at the threshold (127 unless adaptive) or more, set the pixel
+        // to white, otherwise black
+        unsigned char new_value = gray_value >= threshold ? 255 : 0;
+        out[3 * col + 0] = new_value;
+        out[3 * col + 1] = new_value;
+        out[3 * col + 2] = new_value;
+    }
+}
+
+void process_7(ConstImageView image, ImageView new_image, int threshold = HIGH_CONTRAST_THRESHOLD)
+{
+    TraceScope scope("process_7", "filter", (unsigned long long)image.width * image.height);
+    parallel_rows(image.height, image.width, [&](int first_row, int last_row)
+    {
+        // Loop through each row of the image
+        for (int row = first_row; row < last_row; row++)
+        {
+            process_7_row(image.row(row), new_image.row(row), image.width, threshold);
+        }
+    });
+}
+
+Image process_7(const Image& image, int threshold = HIGH_CONTRAST_THRESHOLD)
+{
+    Image new_image = image_pool().acquire(image.width, image.height);
+    process_7(image.view(), new_image.view(), threshold);
+    return new_image;
+}
+
+// Legacy signature for process_7
+vector<vector<Pixel>> process_7(const vector<vector<Pixel>>& image)
+{
+    return to_pixels(process_7(to_image(image)));
+}
+
+/**
+ * Chooses the threshold of process_7 from an image's statistics: Otsu's
+ * split, or so pixels above the given percentile turn white
+ * @param stats   the image statistics
+ * @param method  how to choose the threshold
+ * @param percent the percentile for THRESHOLD_PERCENTILE, 0 to 100
+ * @return the gray level at which pixels turn white
+ */
+int high_contrast_threshold(const ImageStats& stats, ThresholdMethod method, double percent)
+{
+    switch (method)
+    {
+        case THRESHOLD_OTSU:       return otsu_threshold(stats);
+        case THRESHOLD_PERCENTILE: return min(stats.percentile(percent) + 1, 255);
+        default:                   return HIGH_CONTRAST_THRESHOLD;
+    }
+}
+
+// Applies process_7 with a threshold chosen from the image (see high_contrast_threshold())
+Image process_7_adaptive(const Image& image, ThresholdMethod method, double percent = 50)
+{
+    return process_7(image, high_contrast_threshold(image_stats(image), method, percent));
+}
+
+
+//*****************************************
+//     PROCESS 8
+//*****************************************
+
+// Function to brighten an image using a given scaling factor
+// Brightens one channel using the formula: 255 - (255 - original) * factor
+int process_8_channel(int value, double scaling_factor)
+{
+    return 255 - (255 - value) * scaling_factor;
+}
+
+// Applies process_8 to one row of pixels; in and out may point to the same row
+// lut is the lookup table for process_8_channel
+void process_8_row(const unsigned char* in, unsigned char* out, int width, const ChannelLut& lut)
+{
+    // Every channel is brightened the same way, so walk the row byte by byte
+    apply_lut(in, out, (size_t)BYTES_PER_PIXEL * width, lut);
+}
+
+// Fixed-point version of process_8_row; factor is the Q8.8 scaling factor, at most 256
+void process_8_fixed_row(const unsigned char* in, unsigned char* out, int width, int factor)
+{
+    scale_bytes_q8(in, out, (size_t)BYTES_PER_PIXEL * width, factor, true);
+}
+
+// mode selects the lookup table or, for factors from 0 to 1, Q8.8 integer kernels (see q8_factor())
+void process_8(ConstImageView image, ImageView new_image, double scaling_factor,
+               ArithmeticMode mode = ARITHMETIC_EXACT)
+{
+    TraceScope scope("process_8", "filter", (unsigned long long)image.width * image.height);
+    if (mode == ARITHMETIC_FIXED_POINT && fixed_point_unit_factor(scaling_factor))
+    {
+        int factor = q8_factor(scaling_factor);
+        parallel_rows(image.height, image.width, [&](int first_row, int last_row)
+        {
+            for (int row = first_row; row < last_row; row++)
+            {
+                process_8_fixed_row(image.row(row), new_image.row(row), image.width, factor);
+            }
+        });
+        return;
+    }
+
+    // Build the lookup table once for this scaling factor
+    ChannelLut lut = channel_lut(process_8_channel, scaling_factor);
+
+    parallel_rows(image.height, image.width, [&](int first_row, int last_row)
+    {
+        // Loop through each row in the image
+        for (int row = first_row; row < last_row; row++)
+        {
+            process_8_row(image.row(row), new_image.row(row), image.width, lut);
+        }
+    });
+}
+
+Image process_8(const Image& image, double scaling_factor, ArithmeticMode mode = ARITHMETIC_EXACT)
+{
+    Image new_image = image_pool().acquire(image.width, image.height);
+    process_8(image.view(), new_image.view(), scaling_factor, mode);
+    return new_image;
+}
+
+// Legacy signature for process_8
+vector<vector<Pixel>> process_8(const vector<vector<Pixel>>& image, double scaling_factor)
+{
+    return to_pixels(process_8(to_image(image), scaling_factor));
+}
+
+
+//*****************************************
+//     PROCESS 9
+//*****************************************
+
+// Function to adjust the brightness or darkness of an image by scaling each pixel's color values
+// Multiplies one channel by the scaling factor, clamped between 0 and 255
+int process_9_channel(int value, double scaling_factor)
+{
+    int new_value = value * scaling_factor;
+
+    // Clamp the value between 0 and 255 to prevent overflow or underflow
+    if (new_value > 255) new_value = 255;
+    if (new_value < 0) new_value = 0;
+
+    return new_value;
+}
+
+// Applies process_9 to one row of pixels; in and out may point to the same row
+// lut is the lookup table for process_9_channel
+void process_9_row(const unsigned char* in, unsigned char* out, int width, const ChannelLut& lut)
+{
+    // Every channel is scaled the same way, so walk the row byte by byte
+    apply_lut(in, out, (size_t)BYTES_PER_PIXEL * width, lut);
+}
+
+// Fixed-point version of process_9_row; factor is the Q8.8 scaling factor
+void process_9_fixed_row(const unsigned char* in, unsigned char* out, int width, int factor)
+{
+    scale_bytes_q8(in, out, (size_t)BYTES_PER_PIXEL * width, factor, false);
+}
+
+// mode selects the lookup table or, for factors up to 255.99, Q8.8 integer kernels (see q8_factor()).
+// Negative factors clamp to zero either way.
+void process_9(ConstImageView image, ImageView new_image, double scaling_factor,
+               ArithmeticMode mode = ARITHMETIC_EXACT)
+{
+    TraceScope scope("process_9", "filter", (unsigned long long)image.width * image.height);
+    if (mode == ARITHMETIC_FIXED_POINT && scaling_factor <= 65535 / 256.0)
+    {
+        int factor = q8_factor(scaling_factor);
+        parallel_rows(image.height, image.width, [&](int first_row, int last_row)
+        {
+            for (int row = first_row; row < last_row; row++)
+            {
+                process_9_fixed_row(image.row(row), new_image.row(row), image.width, factor);
+            }
+        });
+        return;
+    }
+
+    // Build the lookup table once for this scaling factor
+    ChannelLut lut = channel_lut(process_9_channel, scaling_factor);
+
+    parallel_rows(image.height, image.width, [&](int first_row, int last_row)
+    {
+        // Loop through each row of the original image
+        for (int row = first_row; row < last_row; row++)
+        {
+            process_9_row(image.row(row), new_image.row(row), image.width, lut);
+        }
+    });
+}
+
+Image process_9(const Image& image, double scaling_factor, ArithmeticMode mode = ARITHMETIC_EXACT)
+{
+    Image new_image = image_pool().acquire(image.width, image.height);
+    process_9(image.view(), new_image.view(), scaling_factor, mode);
+    return new_image;
+}
+
+// Legacy signature for process_9
+vector<vector<Pixel>> process_9(const vector<vector<Pixel>>& image, double scaling_factor)
+{
+    return to_pixels(process_9(to_image(image), scaling_factor));
+}
+
+
+//*****************************************
+//     PROCESS 10
+//*****************************************
+
+// Function that transforms the image into a high-contrast, color-dominance-based version
+// Applies process_10 to one row of pixels; in and out may point to the same row
+void process_10_row(const unsigned char* in, unsigned char* out, int width)
+{
+    // The vector kernel handles as many pixels as it can; the loop below finishes the row
+    int col = simd_row(10, in, out, width);
+
+    // Loop through each column in the current row
+    for (; col < width; col++)
+    {
+        // Get the blue, green, and red values of the current pixel
+        int blue_value = in[3 * col + 0];
+        int green_value = in[3 * col + 1];
+        int red_value = in[3 * col + 2];
+
+        // Initialize max_color with red and find the highest color value among R, G, B
+        int max_color = red_value;
+        if (green_value > max_color) {
+            max_color = green_value;
+        }
+        if (blue_value > max_color) {
+            max_color = blue_value;
+        }
+
+        int new_red;
+        int new_green;
+        int new_blue;
+
+        // If the pixel is very bright, turn it white
+        if (red_value + green_value + blue_value >= 550) {
+            new_red = 255;
+            new_green = 255;
+            new_blue = 255;
+        }
+
+        // If the pixel is very dark, turn it black
+        else if (red_value + green_value + blue_value <= 150) {
+            new_red = 0;
+            new_green = 0;
+            new_blue = 0;
+        }
+
+        // If red is the dominant color, turn it pure red
+        else if (max_color == red_value) {
+            new_red = 255;
+            new_green = 0;
+            new_blue = 0;
+        }
+
+        // If green is the dominant color, turn it pure green
+        else if (max_color == green_value) {
+            new_red = 0;
+            new_green = 255;
+            new_blue = 0;
+        }
+
+        // Otherwise, turn it pure blue
+        else {
+            new_red = 0;
+            new_green = 0;
+            new_blue = 255;
+        }
+
+        out[3 * col + 0] = new_blue;
+        out[3 * col + 1] = new_green;
+        out[3 * col + 2] = new_red;
+    }
+}
+
+void process_10(ConstImageView image, ImageView new_image)
+{
+    TraceScope scope("process_10", "filter", (unsigned long long)image.width * image.height);
+    parallel_rows(image.height, image.width, [&](int first_row, int last_row)
+    {
+        // Loop through each row of the image
+        for (int row = first_row; row < last_row; row++)
+        {
+            process_10_row(image.row(row), new_image.row(row), image.width);
+        }
+    });
+}
+
+Image process_10(const Image& image)
+{
+    Image new_image = image_pool().acquire(image.width, image.height);
+    process_10(image.view(), new_image.view());
+    return new_image;
+}
+
+// Legacy signature for process_10
+vector<vector<Pixel>> process_10(const vector<vector<Pixel>>& image)
+{
+    return to_pixels(process_10(to_image(image)));
+}
+
+
+//*****************************************
+//     FILTER PRESETS
+//*****************************************
+
+// Row kernel of a filter preset; in and out may point to the same row
+typedef void (*PresetRow)(const unsigned char* in, unsigned char* out, int width);
+
+/**
+ * Clarendon with its factor and lightness bands fixed at compile time.
+ * The vector kernel does most of the row; the rest of the row uses a
+ * branch-free select between the three bands, with the channel loop
+ * unrolled and the factor folded into the arithmetic.
+ * Factor is a Q8.8 factor from 0 to 256, DarkBelow and BrightFrom averages
+ * of the three channels as in process_2.
+ */
+template <int Factor, int DarkBelow, int BrightFrom>
+void clarendon_preset_row(const unsigned char* in, unsigned char* out, int width)
+{
+    static_assert(Factor >= 0 && Factor <= 256, "Q8.8 factors run from 0 to 256 (0 to 1)");
+    static_assert(DarkBelow <= BrightFrom, "the lightness bands must not overlap");
+
+    int col = 0;
+#ifdef IMAGE_APP_X86_SIMD
+    if (active_simd_level >= SIMD_SSSE3)
+    {
+        col = process_2_fixed_ssse3(in, out, width, Factor, DarkBelow, BrightFrom);
+    }
+#endif
+    for (; col < width; col++)
+    {
+        const unsigned char* pixel = in + 3 * col;
+        int sum = pixel[0] + pixel[1] + pixel[2];
+        int bright = -(sum >= 3 * BrightFrom);
+        int dark = -(sum < 3 * DarkBelow);
+        for (int channel = 0; channel < BYTES_PER_PIXEL; channel++)
+        {
+            int value = pixel[channel];
+            out[3 * col + channel] = (unsigned char)((invert_scale_q8(value, Factor) & bright) |
+                                                     (scale_q8(value, Factor) & dark) |
+                                                     (value & ~(bright | dark)));
+        }
+    }
+}
+
+/**
+ * Lighten (Invert) or darken with the Q8.8 factor fixed at compile time
+ */
+template <int Factor, bool Invert>
+void scale_preset_row(const unsigned char* in, unsigned char* out, int width)
+{
+    static_assert(Factor >= 0 && Factor <= 256, "Q8.8 factors run from 0 to 256 (0 to 1)");
+
+    size_t count = (size_t)BYTES_PER_PIXEL * width;
+    size_t i = 0;
+#ifdef IMAGE_APP_X86_SIMD
+    if (active_simd_level == SIMD_AVX2)
+    {
+        i = scale_bytes_q8_avx2(in, out, count, Factor, Invert);
+    }
+    else if (active_simd_level == SIMD_SSSE3)
+    {
+        i = scale_bytes_q8_sse2(in, out, count, Factor, Invert);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        out[i] = Invert ? invert_scale_q8(in[i], Factor) : scale_q8(in[i], Factor);
+    }
+}
+
+/**
+ * High contrast with its gray level fixed at compile time; an average of
+ * Threshold or more is a channel sum of at least 3 * Threshold
+ */
+template <int Threshold>
+void high_contrast_preset_row(const unsigned char* in, unsigned char* out, int width)
+{
+    static_assert(Threshold >= 0 && Threshold < 256, "gray levels run from 0 to 255");
+
+    int col = simd_row(7, in, out, width, Threshold);
+    for (; col < width; col++)
+    {
+        int sum = in[3 * col + 0] + in[3 * col + 1] + in[3 * col + 2];
+        unsigned char value = (unsigned char)-(sum >= 3 * Threshold);
+        out[3 * col + 0] = value;
+        out[3 * col + 1] = value;
+        out[3 * col + 2] = value;
+    }
+}
+
+// A filter setting that has a kernel compiled for it
+struct FilterPreset
+{
+    const char* name;   // The batch filter it stands for
+    int process;        // Menu number
+    int factor;         // Q8.8 scaling factor; -1 for filters without one
+    int dark_below;     // Clarendon's lightness bands
+    int bright_from;
+    int threshold;      // High contrast's gray level
+    PresetRow row;
+};
+
+/**
+ * The production settings, each with its own instantiation. The factors are
+ * multiples of 1/256, where the fixed-point kernels give exactly the result
+ * of the double formulas, so a preset matches process_N in either
+ * arithmetic mode. Rotations need no entries: rotate_image() already runs a
+ * kernel compiled for each number of quarter turns.
+ */
+const FilterPreset FILTER_PRESETS[] =
+{
+    { "clarendon:0.25", 2, 64, CLARENDON_DARK_BELOW, CLARENDON_BRIGHT_FROM, HIGH_CONTRAST_THRESHOLD,
+      clarendon_preset_row<64, CLARENDON_DARK_BELOW, CLARENDON_BRIGHT_FROM> },
+    { "clarendon:0.5", 2, 128, CLARENDON_DARK_BELOW, CLARENDON_BRIGHT_FROM, HIGH_CONTRAST_THRESHOLD,
+      clarendon_preset_row<128, CLARENDON_DARK_BELOW, CLARENDON_BRIGHT_FROM> },
+    { "clarendon:0.75", 2, 192, CLARENDON_DARK_BELOW, CLARENDON_BRIGHT_FROM, HIGH_CONTRAST_THRESHOLD,
+      clarendon_preset_row<192, CLARENDON_DARK_BELOW, CLARENDON_BRIGHT_FROM> },
+    { "high-contrast", 7, -1, CLARENDON_DARK_BELOW, CLARENDON_BRIGHT_FROM, HIGH_CONTRAST_THRESHOLD,
+      high_contrast_preset_row<HIGH_CONTRAST_THRESHOLD> },
+    { "lighten:0.25", 8, 64, CLARENDON_DARK_BELOW, CLARENDON_BRIGHT_FROM, HIGH_CONTRAST_THRESHOLD,
+      scale_preset_row<64, true> },
+    { "lighten:0.5", 8, 128, CLARENDON_DARK_BELOW, CLARENDON_BRIGHT_FROM, HIGH_CONTRAST_THRESHOLD,
+      scale_preset_row<128, true> },
+    { "lighten:0.75", 8, 192, CLARENDON_DARK_BELOW, CLARENDON_BRIGHT_FROM, HIGH_CONTRAST_THRESHOLD,
+      scale_preset_row<192, true> },
+    { "darken:0.25", 9, 64, CLARENDON_DARK_BELOW, CLARENDON_BRIGHT_FROM, HIGH_CONTRAST_THRESHOLD,
+      scale_preset_row<64, false> },
+    { "darken:0.5", 9, 128, CLARENDON_DARK_BELOW, CLARENDON_BRIGHT_FROM, HIGH_CONTRAST_THRESHOLD,
+      scale_preset_row<128, false> },
+    { "darken:0.75", 9, 192, CLARENDON_DARK_BELOW, CLARENDON_BRIGHT_FROM, HIGH_CONTRAST_THRESHOLD,
+      scale_preset_row<192, false> }
+};
+
+/**
+ * Looks up the compiled kernel for a filter setting
+ * @param process        the menu number
+ * @param scaling_factor the scaling factor of Clarendon, lighten and darken; ignored by the others
+ * @param dark_below     Clarendon's lightness bands; ignored by the others
+ * @param bright_from
+ * @param threshold      high contrast's gray level; ignored by the others
+ * @return the preset, or null when the setting has none and the generic process_N must run
+ */
+const FilterPreset* find_preset(int process, double scaling_factor,
+                                int dark_below = CLARENDON_DARK_BELOW, int bright_from = CLARENDON_BRIGHT_FROM,
+                                int threshold = HIGH_CONTRAST_THRESHOLD)
+{
+    for (size_t i = 0; i < sizeof(FILTER_PRESETS) / sizeof(FILTER_PRESETS[0]); i++)
+    {
+        const FilterPreset& preset = FILTER_PRESETS[i];
+        // Only Clarendon reads the bands and only high contrast the gray level
+        if (preset.process == process && (preset.factor < 0 || scaling_factor * 256 == preset.factor) &&
+            (process != 2 || (preset.dark_below == dark_below && preset.bright_from == bright_from)) &&
+            (process != 7 || preset.threshold == threshold))
+        {
+            return &preset;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * Applies a menu filter through its compiled preset, if the setting has one
+ * @param process        the menu number
+ * @param image          the image
+ * @param scaling_factor the scaling factor, for the filters that take one
+ * @return the new image, or an empty image when there is no preset
+ */
+Image run_preset(int process, const Image& image, double scaling_factor = 0)
+{
+    const FilterPreset* preset = find_preset(process, scaling_factor);
+    if (!preset || image.empty())
+    {
+        return Image();
+    }
+
+    TraceScope scope(preset->name, "filter", (unsigned long long)image.width * image.height);
+    Image new_image = image_pool().acquire(image.width, image.height);
+    parallel_rows(image.height, image.width, [&](int first_row, int last_row)
+    {
+        for (int row = first_row; row < last_row; row++)
+        {
+            preset->row(image.row(row), new_image.row(row), image.width);
+        }
+    });
+    return new_image;
+}
+
+
+//*****************************************
+//     PLANAR LAYOUT
+//*****************************************
+
+// How a filter would like its pixels laid out
+enum PixelLayout
+{
+    LAYOUT_PACKED,   // Blue, green and red interleaved, as in BMP files and Image
+    LAYOUT_PLANAR,   // One plane per channel, as in PlanarImage
+    LAYOUT_EITHER    // Treats every byte alike, so runs as fast on either
+};
+
+// Alignment of the rows of a PlanarImage, enough for full-width AVX2 loads
+const int PLANE_ALIGNMENT = 32;
+
+/**
+ * Image stored as three planes of blue, green and red bytes, in the channel
+ * order of the packed layout. Every row of every plane starts on a 32-byte
+ * boundary. Filters that combine the channels of a pixel read a vector from
+ * each plane instead of shuffling packed triplets apart and back together.
+ */
+struct PlanarImage
+{
+    int width;
+    int height;
+    ptrdiff_t stride;                // Bytes from one row of a plane to the next
+    vector<unsigned char> buffer;    // The planes one after another, plus room to align them
+
+    PlanarImage() : width(0), height(0), stride(0) {}
+
+    PlanarImage(int width, int height)
+        : width(width), height(height),
+          stride((width + PLANE_ALIGNMENT - 1) / PLANE_ALIGNMENT * PLANE_ALIGNMENT),
+          buffer(3 * (size_t)stride * height + PLANE_ALIGNMENT)
+    {
+    }
+
+    bool empty() const
+    {
+        return width == 0 || height == 0;
+    }
+
+    // Row y of a plane: channel 0 is blue, 1 green and 2 red
+    unsigned char* row(int channel, int y)
+    {
+        return planes() + ((size_t)channel * height + y) * stride;
+    }
+
+    const unsigned char* row(int channel, int y) const
+    {
+        return planes() + ((size_t)channel * height + y) * stride;
+    }
+
+private:
+    // The first aligned byte of the buffer; recomputed so copies stay aligned
+    unsigned char* planes() const
+    {
+        uintptr_t address = (uintptr_t)buffer.data();
+        return (unsigned char*)((address + PLANE_ALIGNMENT - 1) & ~(uintptr_t)(PLANE_ALIGNMENT - 1));
+    }
+};
+
+#ifdef IMAGE_APP_X86_SIMD
+
+// Conversions between packed pixels and planes, 16 pixels at a time. They
+// are pure shuffles, so AVX2 would only do the same work in two halves.
+
+__attribute__((target("ssse3")))
+int deinterleave_ssse3(const unsigned char* in, unsigned char* const planes[3], int width)
+{
+    int col = 0;
+    for (; col + 16 <= width; col += 16)
+    {
+        __m128i blue, green, red;
+        split_bgr(in + 3 * col, blue, green, red);
+        _mm_storeu_si128((__m128i*)(planes[0] + col), blue);
+        _mm_storeu_si128((__m128i*)(planes[1] + col), green);
+        _mm_storeu_si128((__m128i*)(planes[2] + col), red);
+    }
+    return col;
+}
+
+__attribute__((target("ssse3")))
+int interleave_ssse3(const unsigned char* const planes[3], unsigned char* out, int width)
+{
+    int col = 0;
+    for (; col + 16 <= width; col += 16)
+    {
+        join_bgr(_mm_loadu_si128((const __m128i*)(planes[0] + col)),
+                 _mm_loadu_si128((const __m128i*)(planes[1] + col)),
+                 _mm_loadu_si128((const __m128i*)(planes[2] + col)), out + 3 * col);
+    }
+    return col;
+}
+
+// Planar kernels: the packed kernels' arithmetic without the shuffles. Each
+// updates the planes in place from pixel i and returns the pixels handled.
+
+// (blue + green + red) / 3 of 32 pixels. Unpacking and packing stay within
+// each 128-bit lane, so the bytes come back in their original order.
+static inline __attribute__((target("avx2")))
+__m256i gray_levels(__m256i blue, __m256i green, __m256i red)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i low = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpacklo_epi8(blue, zero), _mm256_unpacklo_epi8(green, zero)),
+                                   _mm256_unpacklo_epi8(red, zero));
+    __m256i high = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpackhi_epi8(blue, zero), _mm256_unpackhi_epi8(green, zero)),
+                                    _mm256_unpackhi_epi8(red, zero));
+    return _mm256_packus_epi16(divide_by_3(low), divide_by_3(high));
+}
+
+// Loads 16 (SSSE3) or 32 (AVX2) values from each plane
+static inline __attribute__((target("ssse3")))
+void load_planes(unsigned char* const planes[3], int i, __m128i& blue, __m128i& green, __m128i& red)
+{
+    blue = _mm_loadu_si128((const __m128i*)(planes[0] + i));
+    green = _mm_loadu_si128((const __m128i*)(planes[1] + i));
+    red = _mm_loadu_si128((const __m128i*)(planes[2] + i));
+}
+
+static inline __attribute__((target("avx2")))
+void load_planes(unsigned char* const planes[3], int i, __m256i& blue, __m256i& green, __m256i& red)
+{
+    blue = _mm256_loadu_si256((const __m256i*)(planes[0] + i));
+    green = _mm256_loadu_si256((const __m256i*)(planes[1] + i));
+    red = _mm256_loadu_si256((const __m256i*)(planes[2] + i));
+}
+
+// Stores the same values to all three planes
+static inline __attribute__((target("ssse3")))
+void store_gray_planes(unsigned char* const planes[3], int i, __m128i gray)
+{
+    _mm_storeu_si128((__m128i*)(planes[0] + i), gray);
+    _mm_storeu_si128((__m128i*)(planes[1] + i), gray);
+    _mm_storeu_si128((__m128i*)(planes[2] + i), gray);
+}
+
+static inline __attribute__((target("avx2")))
+void store_gray_planes(unsigned char* const planes[3], int i, __m256i gray)
+{
+    _mm256_storeu_si256((__m256i*)(planes[0] + i), gray);
+    _mm256_storeu_si256((__m256i*)(planes[1] + i), gray);
+    _mm256_storeu_si256((__m256i*)(planes[2] + i), gray);
+}
+
+__attribute__((target("ssse3")))
+int planar_gray_ssse3(unsigned char* const planes[3], int i, int count)
+{
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i blue, green, red;
+        load_planes(planes, i, blue, green, red);
+        store_gray_planes(planes, i, _mm_packus_epi16(divide_by_3(sum_low(blue, green, red)),
+                                                      divide_by_3(sum_high(blue, green, red))));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+int planar_gray_avx2(unsigned char* const planes[3], int count)
+{
+    int i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i blue, green, red;
+        load_planes(planes, i, blue, green, red);
+        store_gray_planes(planes, i, gray_levels(blue, green, red));
+    }
+    return planar_gray_ssse3(planes, i, count);
+}
+
+__attribute__((target("ssse3")))
+int planar_high_contrast_ssse3(unsigned char* const planes[3], int i, int count, int threshold_level)
+{
+    __m128i threshold = _mm_set1_epi8((char)threshold_level);
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i blue, green, red;
+        load_planes(planes, i, blue, green, red);
+        __m128i gray = _mm_packus_epi16(divide_by_3(sum_low(blue, green, red)),
+                                        divide_by_3(sum_high(blue, green, red)));
+        store_gray_planes(planes, i, _mm_cmpeq_epi8(_mm_max_epu8(gray, threshold), gray));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+int planar_high_contrast_avx2(unsigned char* const planes[3], int count, int threshold_level)
+{
+    __m256i threshold = _mm256_set1_epi8((char)threshold_level);
+    int i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i blue, green, red;
+        load_planes(planes, i, blue, green, red);
+        __m256i gray = gray_levels(blue, green, red);
+        store_gray_planes(planes, i, _mm256_cmpeq_epi8(_mm256_max_epu8(gray, threshold), gray));
+    }
+    return planar_high_contrast_ssse3(planes, i, count, threshold_level);
+}
+
+__attribute__((target("ssse3")))
+int planar_dominance_ssse3(unsigned char* const planes[3], int i, int count)
+{
+    __m128i white_limit = _mm_set1_epi16(550 - 1);
+    __m128i black_limit = _mm_set1_epi16(150 + 1);
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i blue, green, red;
+        load_planes(planes, i, blue, green, red);
+        __m128i sum0 = sum_low(blue, green, red);
+        __m128i sum1 = sum_high(blue, green, red);
+        __m128i white = _mm_packs_epi16(_mm_cmpgt_epi16(sum0, white_limit), _mm_cmpgt_epi16(sum1, white_limit));
+        __m128i black = _mm_packs_epi16(_mm_cmplt_epi16(sum0, black_limit), _mm_cmplt_epi16(sum1, black_limit));
+        dominance_channels(blue, green, red, white, black);
+        _mm_storeu_si128((__m128i*)(planes[0] + i), blue);
+        _mm_storeu_si128((__m128i*)(planes[1] + i), green);
+        _mm_storeu_si128((__m128i*)(planes[2] + i), red);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+int planar_dominance_avx2(unsigned char* const planes[3], int count)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i ones = _mm256_set1_epi8(-1);
+    __m256i white_limit = _mm256_set1_epi16(550 - 1);
+    __m256i black_limit = _mm256_set1_epi16(150 + 1);
+    int i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i blue, green, red;
+        load_planes(planes, i, blue, green, red);
+
+        // In-lane unpacking and packing, as in gray_levels()
+        __m256i sum0 = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpacklo_epi8(blue, zero),
+                                                         _mm256_unpacklo_epi8(green, zero)),
+                                        _mm256_unpacklo_epi8(red, zero));
+        __m256i sum1 = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpackhi_epi8(blue, zero),
+                                                         _mm256_unpackhi_epi8(green, zero)),
+                                        _mm256_unpackhi_epi8(red, zero));
+        __m256i white = _mm256_packs_epi16(_mm256_cmpgt_epi16(sum0, white_limit),
+                                           _mm256_cmpgt_epi16(sum1, white_limit));
+        __m256i black = _mm256_packs_epi16(_mm256_cmpgt_epi16(black_limit, sum0),
+                                           _mm256_cmpgt_epi16(black_limit, sum1));
+
+        __m256i max_color = _mm256_max_epu8(_mm256_max_epu8(blue, green), red);
+        __m256i red_max = _mm256_cmpeq_epi8(max_color, red);
+        __m256i green_max = _mm256_andnot_si256(red_max, _mm256_cmpeq_epi8(max_color, green));
+        __m256i blue_max = _mm256_andnot_si256(_mm256_or_si256(red_max, green_max), ones);
+        __m256i colored = _mm256_andnot_si256(_mm256_or_si256(white, black), ones);
+        _mm256_storeu_si256((__m256i*)(planes[0] + i), _mm256_or_si256(white, _mm256_and_si256(colored, blue_max)));
+        _mm256_storeu_si256((__m256i*)(planes[1] + i), _mm256_or_si256(white, _mm256_and_si256(colored, green_max)));
+        _mm256_storeu_si256((__m256i*)(planes[2] + i), _mm256_or_si256(white, _mm256_and_si256(colored, red_max)));
+    }
+    return planar_dominance_ssse3(planes, i, count);
+}
+
+#endif
+
+/**
+ * Splits a row of packed pixels into three planes
+ * @param in     the packed row
+ * @param planes the blue, green and red rows to fill
+ * @param width  the number of pixels
+ * @return nothing
+ */
+void deinterleave_row(const unsigned char* in, unsigned char* const planes[3], int width)
+{
+    int col = 0;
+#ifdef IMAGE_APP_X86_SIMD
+    if (active_simd_level >= SIMD_SSSE3)
+    {
+        col = deinterleave_ssse3(in, planes, width);
+    }
+#endif
+    for (; col < width; col++)
+    {
+        planes[0][col] = in[3 * col + 0];
+        planes[1][col] = in[3 * col + 1];
+        planes[2][col] = in[3 * col + 2];
+    }
+}
+
+/**
+ * Joins three planes into a row of packed pixels
+ * @param planes the blue, green and red rows
+ * @param out    the packed row to fill
+ * @param width  the number of pixels
+ * @return nothing
+ */
+void interleave_row(const unsigned char* const planes[3], unsigned char* out, int width)
+{
+    int col = 0;
+#ifdef IMAGE_APP_X86_SIMD
+    if (active_simd_level >= SIMD_SSSE3)
+    {
+        col = interleave_ssse3(planes, out, width);
+    }
+#endif
+    for (; col < width; col++)
+    {
+        out[3 * col + 0] = planes[0][col];
+        out[3 * col + 1] = planes[1][col];
+        out[3 * col + 2] = planes[2][col];
+    }
+}
+
+/**
+ * Converts a packed image to planes
+ * @param image the packed image
+ * @return the planar image
+ */
+PlanarImage to_planar(ConstImageView image)
+{
+    PlanarImage planar(image.width, image.height);
+    parallel_rows(image.height, image.width, [&](int first_row, int last_row)
+    {
+        for (int row = first_row; row < last_row; row++)
+        {
+            unsigned char* planes[3] = { planar.row(0, row), planar.row(1, row), planar.row(2, row) };
+            deinterleave_row(image.row(row), planes, image.width);
+        }
+    });
+    return planar;
+}
+
+/**
+ * Converts planes back to packed pixels
+ * @param planar    the planar image
+ * @param new_image the packed output, the same size
+ * @return nothing
+ */
+void to_packed(const PlanarImage& planar, ImageView new_image)
+{
+    parallel_rows(planar.height, planar.width, [&](int first_row, int last_row)
+    {
+        for (int row = first_row; row < last_row; row++)
+        {
+            const unsigned char* planes[3] = { planar.row(0, row), planar.row(1, row), planar.row(2, row) };
+            interleave_row(planes, new_image.row(row), planar.width);
+        }
+    });
+}
+
+Image to_packed(const PlanarImage& planar)
+{
+    Image new_image = image_pool().acquire(planar.width, planar.height);
+    to_packed(planar, new_image.view());
+    return new_image;
+}
+
+// Planar process_3: every plane becomes (blue + green + red) / 3
+void planar_gray_row(unsigned char* const planes[3], int count)
+{
+    int i = 0;
+#ifdef IMAGE_APP_X86_SIMD
+    if (active_simd_level == SIMD_AVX2)
+    {
+        i = planar_gray_avx2(planes, count);
+    }
+    else if (active_simd_level == SIMD_SSSE3)
+    {
+        i = planar_gray_ssse3(planes, 0, count);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        unsigned char gray = (unsigned char)((planes[0][i] + planes[1][i] + planes[2][i]) / 3);
+        planes[0][i] = gray;
+        planes[1][i] = gray;
+        planes[2][i] = gray;
+    }
+}
+
+// Planar process_7: white from an average of threshold up, black below
+void planar_high_contrast_row(unsigned char* const planes[3], int count, int threshold)
+{
+    int i = 0;
+#ifdef IMAGE_APP_X86_SIMD
+    // The kernels compare bytes; thresholds outside 0 to 255 are left to the loop, as in process_7_row()
+    bool byte_threshold = threshold >= 0 && threshold <= 255;
+    if (byte_threshold && active_simd_level == SIMD_AVX2)
+    {
+        i = planar_high_contrast_avx2(planes, count, threshold);
+    }
+    else if (byte_threshold && active_simd_level == SIMD_SSSE3)
+    {
+        i = planar_high_contrast_ssse3(planes, 0, count, threshold);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        unsigned char value = (planes[0][i] + planes[1][i] + planes[2][i]) / 3 >= threshold ? 255 : 0;
+        planes[0][i] = value;
+        planes[1][i] = value;
+        planes[2][i] = value;
+    }
+}
+
+// Planar process_10, with the same rules and ties as process_10_row()
+void planar_dominance_row(unsigned char* const planes[3], int count)
+{
+    int i = 0;
+#ifdef IMAGE_APP_X86_SIMD
+    if (active_simd_level == SIMD_AVX2)
+    {
+        i = planar_dominance_avx2(planes, count);
+    }
+    else if (active_simd_level == SIMD_SSSE3)
+    {
+        i = planar_dominance_ssse3(planes, 0, count);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        int blue = planes[0][i];
+        int green = planes[1][i];
+        int red = planes[2][i];
+        int sum = blue + green + red;
+        int max_color = max(max(blue, green), red);
+
+        bool white = sum >= 550;
+        bool colored = !white && sum > 150;
+        planes[0][i] = white || (colored && max_color != red && max_color != green) ? 255 : 0;
+        planes[1][i] = white || (colored && max_color != red && max_color == green) ? 255 : 0;
+        planes[2][i] = white || (colored && max_color == red) ? 255 : 0;
+    }
+}
+
+// Planar process_2: bright and dark are the tables for the two lightness bands
+void planar_clarendon_row(unsigned char* const planes[3], int count, const ChannelLut& bright,
+                          const ChannelLut& dark, int dark_below, int bright_from)
+{
+    for (int i = 0; i < count; i++)
+    {
+        int sum = planes[0][i] + planes[1][i] + planes[2][i];
+        const unsigned char* table = sum >= 3 * bright_from ? bright.values
+                                   : sum < 3 * dark_below ? dark.values : nullptr;
+        if (table)
+        {
+            planes[0][i] = table[planes[0][i]];
+            planes[1][i] = table[planes[1][i]];
+            planes[2][i] = table[planes[2][i]];
+        }
+    }
+}
+
+
+//*****************************************
+//     POINT OPERATION PIPELINE
+//*****************************************
+
+// Filters whose output pixel depends only on the input pixel at the same position
+enum PointOpKind
+{
+    POINT_CLARENDON,        // process_2
+    POINT_GRAYSCALE,        // process_3
+    POINT_HIGH_CONTRAST,    // process_7
+    POINT_LIGHTEN,          // process_8
+    POINT_DARKEN,           // process_9
+    POINT_COLOR_DOMINANCE   // process_10
+};
+
+// One stage of a point operation pipeline
+struct PointOp
+{
+    PointOpKind kind;
+    double scaling_factor;  // Used by Clarendon, lighten and darken
+    bool fixed_point;       // Use the Q8.8 kernels with fixed_factor instead of the tables
+    int fixed_factor;       // q8_factor(scaling_factor)
+    ChannelLut tables[2];   // Lookup tables for scaling_factor, built when the stage is added
+    int dark_below;         // Clarendon lightness bands, as averages of the three channels
+    int bright_from;
+    int threshold;          // High contrast gray level
+    PresetRow preset;       // Compiled kernel for exactly this setting, if there is one; used first
+    bool planar;            // Runs on planes, sharing one conversion with its neighbours (see plan_layouts())
+};
+
+/**
+ * Chains point operations so they run in a single traversal of the image.
+ * Each row is processed in blocks small enough to stay in the L1 cache: the
+ * first stage reads the input block and writes the output block, and the
+ * remaining stages update the output block in place. No intermediate image is
+ * allocated and main memory is read and written once however many stages
+ * there are. The result is identical to calling the process_N functions one
+ * after another.
+ *
+ * Each stage declares the pixel layout it runs fastest on. A long enough run
+ * of stages that accept planes splits the block into planes once, runs on
+ * the planes and packs the result once (see plan_layouts()).
+ */
+class PointPipeline
+{
+public:
+    // Appends a stage; scaling_factor and mode are ignored by stages that do not take them.
+    // Factors the fixed-point kernels do not cover run exactly, as in process_2, 8 and 9.
+    PointPipeline& add(PointOpKind kind, double scaling_factor = 1.0, ArithmeticMode mode = ARITHMETIC_EXACT)
+    {
+        PointOp op;
+        op.kind = kind;
+        op.scaling_factor = scaling_factor;
+        op.fixed_point = mode == ARITHMETIC_FIXED_POINT &&
+            ((kind == POINT_CLARENDON || kind == POINT_LIGHTEN) ? fixed_point_unit_factor(scaling_factor)
+                                                                : kind == POINT_DARKEN && scaling_factor <= 65535 / 256.0);
+        op.fixed_factor = op.fixed_point ? q8_factor(scaling_factor) : 0;
+        op.dark_below = CLARENDON_DARK_BELOW;
+        op.bright_from = CLARENDON_BRIGHT_FROM;
+        op.threshold = HIGH_CONTRAST_THRESHOLD;
+        op.preset = preset_row(op);
+        op.planar = false;
+        if (op.fixed_point)
+        {
+            // The planar Clarendon kernel reads tables, so they hold the fixed-point results
+            if (kind == POINT_CLARENDON)
+            {
+                for (int value = 0; value < 256; value++)
+                {
+                    op.tables[0].values[value] = invert_scale_q8(value, op.fixed_factor);
+                    op.tables[1].values[value] = scale_q8(value, op.fixed_factor);
+                }
+            }
+            ops.push_back(op);
+            plan_layouts();
+            return *this;
+        }
+
+        // Compile the lookup tables now so run_row() never evaluates a formula
+        switch (kind)
+        {
+            case POINT_CLARENDON:
+                op.tables[0] = channel_lut(process_2_bright_channel, scaling_factor);
+                op.tables[1] = channel_lut(process_2_dark_channel, scaling_factor);
+                break;
+            case POINT_LIGHTEN:
+                op.tables[0] = channel_lut(process_8_channel, scaling_factor);
+                break;
+            case POINT_DARKEN:
+                op.tables[0] = channel_lut(process_9_channel, scaling_factor);
+                break;
+            default:
+                break;
+        }
+
+        ops.push_back(op);
+        plan_layouts();
+        return *this;
+    }
+
+    // Moves the thresholds of the last stage added: the lightness bands of a
+    // Clarendon stage, or the gray level of a high contrast stage (low alone)
+    PointPipeline& set_thresholds(int low, int high = CLARENDON_BRIGHT_FROM)
+    {
+        PointOp& op = ops.back();
+        if (op.kind == POINT_CLARENDON)
+        {
+            op.dark_below = low;
+            op.bright_from = high;
+        }
+        else if (op.kind == POINT_HIGH_CONTRAST)
+        {
+            op.threshold = low;
+        }
+        op.preset = preset_row(op);
+        return *this;
+    }
+
+    bool empty() const
+    {
+        return ops.empty();
+    }
+
+    const vector<PointOp>& stages() const
+    {
+        return ops;
+    }
+
+    /**
+     * Runs every stage over one row of pixels
+     * @param in    the input row
+     * @param out   the output row; may be the same as in
+     * @param width the number of pixels in the row
+     * @return nothing
+     */
+    void run_row(const unsigned char* in, unsigned char* out, int width) const
+    {
+        // Pixels per block: 6 KB of packed pixels
+        const int BLOCK_PIXELS = 2048;
+
+        for (int start = 0; start < width; start += BLOCK_PIXELS)
+        {
+            int count = min(BLOCK_PIXELS, width - start);
+            const unsigned char* block_in = in + 3 * start;
+            unsigned char* block_out = out + 3 * start;
+
+            if (ops.empty() && block_in != block_out)
+            {
+                memmove(block_out, block_in, 3 * count);
+            }
+            for (size_t i = 0; i < ops.size(); i++)
+            {
+                const unsigned char* stage_in = i == 0 ? block_in : block_out;
+                if (!ops[i].planar)
+                {
+                    run_stage(ops[i], stage_in, block_out, count);
+                    continue;
+                }
+
+                // Split once, run the whole planar run, then pack once
+                alignas(PLANE_ALIGNMENT) unsigned char planes[3][BLOCK_PIXELS];
+                unsigned char* rows[3] = { planes[0], planes[1], planes[2] };
+                deinterleave_row(stage_in, rows, count);
+                for (; i < ops.size() && ops[i].planar; i++)
+                {
+                    run_planar_stage(ops[i], rows, count);
+                }
+                interleave_row(rows, block_out, count);
+                i--;
+            }
+        }
+    }
+
+    /**
+     * Runs the pipeline over a whole image
+     * @param image     the input image
+     * @param new_image the output image, the same size as image; may be the same buffer
+     * @return nothing
+     */
+    void run(ConstImageView image, ImageView new_image) const
+    {
+        TraceScope scope("point_pipeline", "filter", (unsigned long long)image.width * image.height);
+
+        parallel_rows(image.height, image.width, [&](int first_row, int last_row)
+        {
+            for (int row = first_row; row < last_row; row++)
+            {
+                run_row(image.row(row), new_image.row(row), image.width);
+            }
+        });
+    }
+
+    Image run(const Image& image) const
+    {
+        Image new_image = image_pool().acquire(image.width, image.height);
+        run(image.view(), new_image.view());
+        return new_image;
+    }
+
+    /**
+     * Runs every stage over a planar image in place, whatever layout the
+     * stages prefer
+     * @param image the planar image
+     * @return nothing
+     */
+    void run(PlanarImage& image) const
+    {
+        TraceScope scope("point_pipeline", "filter", (unsigned long long)image.width * image.height);
+        parallel_rows(image.height, image.width, [&](int first_row, int last_row)
+        {
+            for (int row = first_row; row < last_row; row++)
+            {
+                unsigned char* rows[3] = { image.row(0, row), image.row(1, row), image.row(2, row) };
+                for (size_t i = 0; i < ops.size(); i++)
+                {
+                    run_planar_stage(ops[i], rows, image.width);
+                }
+            }
+        });
+    }
+
+    // The layout a stage runs fastest on. Only the vector kernels gain from
+    // planes; the scalar loops cost the same either way, so without SSSE3
+    // every stage stays packed and no conversion is paid for.
+    static PixelLayout preferred_layout(const PointOp& op)
+    {
+        switch (op.kind)
+        {
+            case POINT_GRAYSCALE:
+            case POINT_HIGH_CONTRAST:
+            case POINT_COLOR_DOMINANCE:
+                return active_simd_level >= SIMD_SSSE3 ? LAYOUT_PLANAR : LAYOUT_PACKED;
+            case POINT_LIGHTEN:
+            case POINT_DARKEN:
+                return LAYOUT_EITHER;
+            default:
+                // The Clarendon kernels need all three channels of a pixel in one vector
+                return LAYOUT_PACKED;
+        }
+    }
+
+private:
+    // Marks the stages that run on planes: every run of consecutive stages
+    // that accept planes and holds enough stages that prefer them to pay for
+    // splitting and packing the block. Each planar stage saves the shuffles
+    // of a packed one, but splitting and packing a block costs about as much
+    // as three packed stages' shuffles, so shorter runs stay packed.
+    void plan_layouts()
+    {
+        const int PLANAR_RUN_STAGES = 4;
+
+        size_t start = 0;
+        while (start < ops.size())
+        {
+            size_t end = start;
+            int planar_stages = 0;
+            while (end < ops.size() && preferred_layout(ops[end]) != LAYOUT_PACKED)
+            {
+                planar_stages += preferred_layout(ops[end]) == LAYOUT_PLANAR;
+                end++;
+            }
+            for (size_t i = start; i < end; i++)
+            {
+                ops[i].planar = planar_stages >= PLANAR_RUN_STAGES;
+            }
+            if (end == start)
+            {
+                ops[start].planar = false;
+                end++;
+            }
+            start = end;
+        }
+    }
+
+    // Finds the compiled kernel for a stage's setting; the tables or fixed-point kernels run without one
+    static PresetRow preset_row(const PointOp& op)
+    {
+        // Menu numbers of the PointOpKind values, in order
+        static const int PROCESS_NUMBERS[] = { 2, 3, 7, 8, 9, 10 };
+        const FilterPreset* preset = find_preset(PROCESS_NUMBERS[op.kind], op.scaling_factor,
+                                                 op.dark_below, op.bright_from, op.threshold);
+        return preset ? preset->row : nullptr;
+    }
+
+    static void run_stage(const PointOp& op, const unsigned char* in, unsigned char* out, int width)
+    {
+        if (op.preset)
+        {
+            op.preset(in, out, width);
+            return;
+        }
+        if (op.fixed_point)
+        {
+            switch (op.kind)
+            {
+                case POINT_CLARENDON:
+                    process_2_fixed_row(in, out, width, op.fixed_factor, op.dark_below, op.bright_from);
+                    break;
+                case POINT_LIGHTEN:   process_8_fixed_row(in, out, width, op.fixed_factor); break;
+                case POINT_DARKEN:    process_9_fixed_row(in, out, width, op.fixed_factor); break;
+                default:              break;
+            }
+            return;
+        }
+
+        switch (op.kind)
+        {
+            case POINT_CLARENDON:
+                process_2_row(in, out, width, op.tables[0], op.tables[1], op.dark_below, op.bright_from);
+                break;
+            case POINT_GRAYSCALE:       process_3_row(in, out, width); break;
+            case POINT_HIGH_CONTRAST:   process_7_row(in, out, width, op.threshold); break;
+            case POINT_LIGHTEN:         process_8_row(in, out, width, op.tables[0]); break;
+            case POINT_DARKEN:          process_9_row(in, out, width, op.tables[0]); break;
+            case POINT_COLOR_DOMINANCE: process_10_row(in, out, width); break;
+        }
+    }
+
+    static void run_planar_stage(const PointOp& op, unsigned char* const planes[3], int count)
+    {
+        switch (op.kind)
+        {
+            case POINT_CLARENDON:
+                planar_clarendon_row(planes, count, op.tables[0], op.tables[1], op.dark_below, op.bright_from);
+                break;
+            case POINT_GRAYSCALE:       planar_gray_row(planes, count); break;
+            case POINT_HIGH_CONTRAST:   planar_high_contrast_row(planes, count, op.threshold); break;
+            case POINT_COLOR_DOMINANCE: planar_dominance_row(planes, count); break;
+            case POINT_LIGHTEN:
+            case POINT_DARKEN:
+                // Every byte alike, so each plane goes through the packed kernels unchanged
+                for (int channel = 0; channel < 3; channel++)
+                {
+                    if (op.fixed_point || op.preset)
+                    {
+                        scale_bytes_q8(planes[channel], planes[channel], count, q8_factor(op.scaling_factor),
+                                       op.kind == POINT_LIGHTEN);
+                    }
+                    else
+                    {
+                        apply_lut(planes[channel], planes[channel], count, op.tables[0]);
+                    }
+                }
+                break;
+        }
+    }
+
+    vector<PointOp> ops;
+};
+
+
+//*****************************************
+//     STREAMING
+//*****************************************
+
+/**
+ * Chain of filters that only need one row and its position: point operations
+ * and the vignette. Because no stage looks at other rows, the chain can run
+ * on a file a few rows at a time. Runs of consecutive point operations share
+ * one PointPipeline stage.
+ */
+class RowPipeline
+{
+public:
+    // Appends a point operation; scaling_factor and mode are ignored by stages that do not take them
+    RowPipeline& add(PointOpKind kind, double scaling_factor = 1.0, ArithmeticMode mode = ARITHMETIC_EXACT)
+    {
+        if (stages.empty() || stages.back().vignette)
+        {
+            stages.push_back(Stage());
+        }
+        stages.back().points.add(kind, scaling_factor, mode);
+        return *this;
+    }
+
+    // Moves the thresholds of the last point operation added (see PointPipeline::set_thresholds())
+    RowPipeline& set_thresholds(int low, int high = CLARENDON_BRIGHT_FROM)
+    {
+        stages.back().points.set_thresholds(low, high);
+        return *this;
+    }
+
+    // Appends the vignette (process_1)
+    RowPipeline& add_vignette(ArithmeticMode mode = ARITHMETIC_EXACT)
+    {
+        Stage stage;
+        stage.vignette = true;
+        stage.mode = mode;
+        stages.push_back(stage);
+        return *this;
+    }
+
+    bool empty() const
+    {
+        return stages.empty();
+    }
+
+    bool has_vignette() const
+    {
+        for (size_t i = 0; i < stages.size(); i++)
+        {
+            if (stages[i].vignette)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Runs every stage over one row of pixels
+     * @param map     the vignette map for the image size; may be null if there is no vignette
+     * @param row     the row index within the image
+     * @param in      the input row
+     * @param out     the output row; may be the same as in
+     * @param width   the number of pixels in the row
+     * @param scratch buffer reused between rows by the fixed-point vignette
+     * @return nothing
+     */
+    void run_row(const VignetteMap* map, int row, const unsigned char* in, unsigned char* out,
+                 int width, vector<unsigned short>& scratch) const
+    {
+        if (stages.empty() && in != out)
+        {
+            memmove(out, in, (size_t)BYTES_PER_PIXEL * width);
+        }
+        for (size_t i = 0; i < stages.size(); i++)
+        {
+            const unsigned char* stage_in = i == 0 ? in : out;
+            if (stages[i].vignette)
+            {
+                apply_vignette_row(*map, row, stage_in, out, stages[i].mode, scratch);
+            }
+            else
+            {
+                stages[i].points.run_row(stage_in, out, width);
+            }
+        }
+    }
+
+    /**
+     * Runs the chain over a whole image held in memory
+     * @param image     the input image
+     * @param new_image the output image, the same size as image; may be the same buffer
+     * @return nothing
+     */
+    void run(ConstImageView image, ImageView new_image) const
+    {
+        TraceScope scope("row_pipeline", "filter", (unsigned long long)image.width * image.height);
+        shared_ptr<const VignetteMap> map;
+        if (has_vignette())
+        {
+            map = vignette_map(image.width, image.height);
+        }
+
+        parallel_rows(image.height, image.width, [&](int first_row, int last_row)
+        {
+            vector<unsigned short> scratch;
+            for (int row = first_row; row < last_row; row++)
+            {
+                run_row(map.get(), row, image.row(row), new_image.row(row), image.width, scratch);
+            }
+        });
+    }
+
+private:
+    struct Stage
+    {
+        bool vignette;
+        ArithmeticMode mode;
+        PointPipeline points;
+
+        Stage() : vignette(false), mode(ARITHMETIC_EXACT) {}
+    };
+
+    vector<Stage> stages;
+};
+
+// Bytes of scan lines stream_bmp() holds at a time
+const size_t STREAM_CHUNK_BYTES = 4 << 20;
+
+/**
+ * Filters a BMP file into another without decoding the whole image.
+ * Scan lines are read in chunks of about STREAM_CHUNK_BYTES, filtered in
+ * place (bands of rows in parallel) and appended to the output, which keeps
+ * the input's row order. Memory use is one chunk whatever the image size, so
+ * images larger than RAM can be processed. The output is identical to
+ * running the same chain on read_bmp() and saving with write_bmp(), except
+ * that top-down inputs stay top-down.
+ * @param in_filename  the BMP file to read
+ * @param out_filename the BMP file to write
+ * @param pipeline     the filters to apply
+ * @param chunk_bytes  the approximate number of bytes to hold at a time
+ * @return True if successful and false otherwise
+ */
+bool stream_bmp(string in_filename, string out_filename, const RowPipeline& pipeline,
+                size_t chunk_bytes = STREAM_CHUNK_BYTES)
+{
+    fstream in_stream;
+    in_stream.open(in_filename, ios::in | ios::binary | ios::ate);
+    if (!in_stream.is_open())
+    {
+        return false;
+    }
+    streamoff file_size = in_stream.tellg();
+    if (file_size <= 0)
+    {
+        return false;
+    }
+
+    // The headers, including the 12 bytes of BI_BITFIELDS masks, come first
+    unsigned char headers[BMP_HEADERS_SIZE + 12];
+    size_t headers_size = min((size_t)file_size, sizeof(headers));
+    in_stream.seekg(0);
+    in_stream.read((char*)headers, headers_size);
+
+    BmpLayout layout;
+    if (!in_stream || !parse_bmp_layout(headers, headers_size, (size_t)file_size, layout))
+    {
+        return false;
+    }
+
+    fstream out_stream;
+    out_stream.open(out_filename, ios::out | ios::binary);
+    if (!out_stream.is_open())
+    {
+        return false;
+    }
+    unsigned char out_headers[BMP_HEADERS_SIZE];
+    set_bmp_headers(out_headers, layout.width, layout.top_down ? -layout.height : layout.height);
+    out_stream.write((char*)out_headers, sizeof(out_headers));
+
+    shared_ptr<const VignetteMap> map;
+    if (pipeline.has_vignette())
+    {
+        map = vignette_map(layout.width, layout.height);
+    }
+
+    // 24-bit scan lines are already packed rows, so they are read straight into
+    // the chunk; 32-bit ones are read into a second buffer and unpacked
+    size_t out_stride = packed_stride(layout.width);
+    size_t width_bytes = (size_t)layout.width * BYTES_PER_PIXEL;
+    int chunk_rows = (int)max((size_t)1, chunk_bytes / max(out_stride, layout.scanline_stride));
+    chunk_rows = min(chunk_rows, layout.height);
+    vector<unsigned char> chunk(out_stride * chunk_rows);
+    vector<unsigned char> scanlines;
+    if (layout.scanline_stride != out_stride)
+    {
+        scanlines.resize(layout.scanline_stride * chunk_rows);
+    }
+
+    in_stream.seekg(layout.start);
+    for (int first = 0; first < layout.height; first += chunk_rows)
+    {
+        int count = min(chunk_rows, layout.height - first);
+        unsigned char* raw = scanlines.empty() ? &chunk[0] : &scanlines[0];
+        in_stream.read((char*)raw, (streamsize)layout.scanline_stride * count);
+        if (!in_stream)
+        {
+            return false;
+        }
+
+        parallel_rows(count, layout.width, [&](int first_row, int last_row)
+        {
+            vector<unsigned short> scratch;
+            for (int i = first_row; i < last_row; i++)
+            {
+                unsigned char* row = &chunk[i * out_stride];
+                unpack_scanline(raw + i * layout.scanline_stride, row, layout.width, layout.bytes_per_pixel);
+
+                // Scan line first + i is image row first + i in a top-down file and counts up from the bottom otherwise
+                int image_row = layout.top_down ? first + i : layout.height - 1 - (first + i);
+                pipeline.run_row(map.get(), image_row, row, row, layout.width, scratch);
+
+                // Input padding may hold anything; write_bmp() writes zeros
+                memset(row + width_bytes, 0, out_stride - width_bytes);
+            }
+        });
+
+        out_stream.write((char*)&chunk[0], out_stride * count);
+        if (!out_stream)
+        {
+            return false;
+        }
+    }
+
+    out_stream.close();
+    return !out_stream.fail();
+}
+
+
+//*****************************************
+//     UPSCALED VIEW
+//*****************************************
+
+/**
+ * Lazy process_6 enlargement of an image, for when the full-size result only
+ * needs to be written out. Nearest-neighbor enlargement copies pixels
+ * unchanged, so point operations give the same result before or after it;
+ * operations added to the view run on the source rows, x_scale * y_scale
+ * times fewer pixels, and rows of the enlarged image are produced on demand.
+ * The source must outlive the view.
+ */
+class UpscaledView
+{
+public:
+    UpscaledView(ConstImageView source, int x_scale, int y_scale)
+        : source(source), x_scale(x_scale), y_scale(y_scale), repeater(x_scale)
+    {
+    }
+
+    int width() const
+    {
+        return source.width * x_scale;
+    }
+
+    int height() const
+    {
+        return source.height * y_scale;
+    }
+
+    // Defers a point operation; see PointPipeline::add()
+    UpscaledView& add(PointOpKind kind, double scaling_factor = 1.0, ArithmeticMode mode = ARITHMETIC_EXACT)
+    {
+        points.add(kind, scaling_factor, mode);
+        return *this;
+    }
+
+    // Moves the thresholds of the last operation added; see PointPipeline::set_thresholds()
+    UpscaledView& set_thresholds(int low, int high = CLARENDON_BRIGHT_FROM)
+    {
+        points.set_thresholds(low, high);
+        return *this;
+    }
+
+    /**
+     * Produces the y_scale output rows that come from one source row
+     * @param source_row the source row index
+     * @param out        the first output row; the others follow stride bytes apart
+     * @param stride     bytes between output rows (may be negative)
+     * @param scratch    buffer reused between rows for the filtered source row
+     * @return nothing
+     */
+    void read_rows(int source_row, unsigned char* out, ptrdiff_t stride, vector<unsigned char>& scratch) const
+    {
+        const unsigned char* in = source.row(source_row);
+        if (!points.empty())
+        {
+            scratch.resize((size_t)BYTES_PER_PIXEL * source.width);
+            points.run_row(in, &scratch[0], source.width);
+            in = &scratch[0];
+        }
+
+        repeater.run(in, out, source.width);
+        for (int copy = 1; copy < y_scale; copy++)
+        {
+            memcpy(out + copy * stride, out, (size_t)BYTES_PER_PIXEL * width());
+        }
+    }
+
+    /**
+     * Builds the enlarged image
+     * @return the image, equal to process_6() followed by the deferred operations
+     */
+    Image materialize() const
+    {
+        Image new_image = image_pool().acquire(width(), height());
+        if (new_image.empty())
+        {
+            return new_image;
+        }
+        parallel_rows(source.height, width() * y_scale, [&](int first_row, int last_row)
+        {
+            vector<unsigned char> scratch;
+            for (int row = first_row; row < last_row; row++)
+            {
+                read_rows(row, new_image.row(row * y_scale), new_image.stride, scratch);
+            }
+        });
+        return new_image;
+    }
+
+    ConstImageView source;
+    int x_scale;
+    int y_scale;
+
+private:
+    PixelRepeater repeater;
+    PointPipeline points;
+};
+
+/**
+ * Writes an upscaled view to a BMP file without building the enlarged image.
+ * Output rows are produced in file order (bottom to top) in chunks of about
+ * STREAM_CHUNK_BYTES, with bands of source rows in parallel.
+ * @param filename The BMP file name to save the image to
+ * @param view     The view to save
+ * @return True if successful and false otherwise
+ */
+bool write_bmp(string filename, const UpscaledView& view)
+{
+    TraceScope scope("write_bmp", "encode", (unsigned long long)view.width() * view.height());
+
+    // Zeroed once, so the row padding stays zero; allocated first, so running out of memory
+    // leaves no empty file behind
+    size_t stride = packed_stride(view.width());
+    int chunk_sources = (int)max((size_t)1, STREAM_CHUNK_BYTES / (stride * view.y_scale));
+    chunk_sources = min(chunk_sources, max(view.source.height, 1));
+    vector<unsigned char> chunk(stride * view.y_scale * chunk_sources);
+
+    fstream stream;
+    stream.open(filename, ios::out | ios::binary);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+
+    unsigned char headers[BMP_HEADERS_SIZE];
+    set_bmp_headers(headers, view.width(), view.height());
+    stream.write((char*)headers, sizeof(headers));
+
+    // File chunk c holds source rows height - 1 - c * chunk_sources downwards
+    for (int first = 0; first < view.source.height; first += chunk_sources)
+    {
+        int count = min(chunk_sources, view.source.height - first);
+        parallel_rows(count, view.width() * view.y_scale, [&](int first_row, int last_row)
+        {
+            vector<unsigned char> scratch;
+            for (int i = first_row; i < last_row; i++)
+            {
+                // The last of the y_scale copies is the first one in the file
+                unsigned char* bottom = &chunk[((size_t)i * view.y_scale + view.y_scale - 1) * stride];
+                view.read_rows(view.source.height - 1 - (first + i), bottom, -(ptrdiff_t)stride, scratch);
+            }
+        });
+        stream.write((char*)&chunk[0], stride * view.y_scale * count);
+        if (!stream)
+        {
+            return false;
+        }
+        trace_bytes_written(stride * view.y_scale * count);
+    }
+
+    stream.close();
+    return !stream.fail();
+}
+
+
+//*****************************************
+//     INCREMENTAL RENDERING
+//*****************************************
+
+// Side of the square tiles an IncrementalRenderer caches and recomputes, in pixels
+const int RENDER_TILE_SIZE = 128;
+
+// Source pixels between preview samples, in each direction
+const int RENDER_PREVIEW_SCALE = 4;
+
+/**
+ * One stage of an incremental render: a point operation or the vignette.
+ * Both produce each pixel from the input pixel at the same position, so any
+ * tile of the image can be rendered on its own.
+ */
+struct RenderStage
+{
+    bool vignette;
+    PointOpKind kind;
+    double scaling_factor;   // Used by Clarendon, lighten and darken
+    ArithmeticMode mode;
+    bool custom_thresholds;  // low and high replace the default thresholds
+    int low;
+    int high;
+
+    // Moves the thresholds of a point operation; see PointPipeline::set_thresholds()
+    RenderStage& set_thresholds(int new_low, int new_high = CLARENDON_BRIGHT_FROM)
+    {
+        custom_thresholds = true;
+        low = new_low;
+        high = new_high;
+        return *this;
+    }
+
+    bool operator==(const RenderStage& other) const
+    {
+        if (vignette || other.vignette)
+        {
+            return vignette == other.vignette && mode == other.mode;
+        }
+        return kind == other.kind && scaling_factor == other.scaling_factor && mode == other.mode &&
+               custom_thresholds == other.custom_thresholds &&
+               (!custom_thresholds || (low == other.low && high == other.high));
+    }
+
+    bool operator!=(const RenderStage& other) const
+    {
+        return !(*this == other);
+    }
+};
+
+RenderStage point_stage(PointOpKind kind, double scaling_factor = 1.0, ArithmeticMode mode = ARITHMETIC_EXACT)
+{
+    RenderStage stage = { false, kind, scaling_factor, mode, false, 0, 0 };
+    return stage;
+}
+
+RenderStage vignette_stage(ArithmeticMode mode = ARITHMETIC_EXACT)
+{
+    RenderStage stage = { true, POINT_GRAYSCALE, 1.0, mode, false, 0, 0 };
+    return stage;
+}
+
+/**
+ * Renders a chain of stages over an image, recomputing only what changed.
+ * The output of every stage is kept, tile by tile. Changing a stage's
+ * parameters invalidates that stage and the ones after it, so a slider on
+ * the last stage reruns one stage; tiles whose source pixels are not marked
+ * changed keep everything.
+ *
+ * An interactive caller shows preview() right away, then calls refine()
+ * between events until it returns true; frame() holds exact tiles where they
+ * are done and the preview elsewhere. The cache holds one image per stage.
+ */
+class IncrementalRenderer
+{
+public:
+    explicit IncrementalRenderer(int tile_size = RENDER_TILE_SIZE, int preview_scale = RENDER_PREVIEW_SCALE)
+        : tile_size(tile_size), preview_scale(preview_scale), tile_columns(0), tile_rows(0)
+    {
+    }
+
+    /**
+     * Sets the image to render. Every tile of a new image is dirty.
+     * @param image the source image, shared read-only
+     * @return nothing
+     */
+    void set_source(shared_ptr<const Image> image)
+    {
+        if (image == source)
+        {
+            return;
+        }
+        bool resized = !source || image->width != source->width || image->height != source->height;
+        source = image;
+        if (resized)
+        {
+            tile_columns = (source->width + tile_size - 1) / tile_size;
+            tile_rows = (source->height + tile_size - 1) / tile_size;
+            for (size_t i = 0; i < outputs.size(); i++)
+            {
+                image_pool().recycle(move(outputs[i]));
+                outputs[i] = image_pool().acquire(source->width, source->height);
+            }
+            update_vignette_map();
+        }
+        valid_stages.assign((size_t)tile_columns * tile_rows, 0);
+    }
+
+    /**
+     * Marks source pixels as changed, after an edit to part of the image
+     * @param region the changed pixels
+     * @return nothing
+     */
+    void invalidate(Rect region)
+    {
+        if (!source || !clip_rect(region, source->width, source->height))
+        {
+            return;
+        }
+        for (int tile_row = region.y / tile_size; tile_row <= (region.y + region.height - 1) / tile_size; tile_row++)
+        {
+            for (int tile_col = region.x / tile_size; tile_col <= (region.x + region.width - 1) / tile_size; tile_col++)
+            {
+                valid_stages[(size_t)tile_row * tile_columns + tile_col] = 0;
+            }
+        }
+    }
+
+    /**
+     * Sets the chain of stages. Tiles keep the output of every stage before
+     * the first one that differs from the previous chain.
+     * @param new_stages the stages, in order
+     * @return nothing
+     */
+    void set_stages(const vector<RenderStage>& new_stages)
+    {
+        size_t unchanged = 0;
+        while (unchanged < stages.size() && unchanged < new_stages.size() &&
+               stages[unchanged] == new_stages[unchanged])
+        {
+            unchanged++;
+        }
+        for (size_t i = 0; i < valid_stages.size(); i++)
+        {
+            valid_stages[i] = min(valid_stages[i], (int)unchanged);
+        }
+        if (unchanged == stages.size() && unchanged == new_stages.size())
+        {
+            return;
+        }
+
+        stages = new_stages;
+        pipelines.resize(stages.size());
+        while (outputs.size() > stages.size())
+        {
+            image_pool().recycle(move(outputs.back()));
+            outputs.pop_back();
+        }
+        while (outputs.size() < stages.size())
+        {
+            outputs.push_back(source ? image_pool().acquire(source->width, source->height) : Image());
+        }
+
+        preview_chain = RowPipeline();
+        for (size_t i = 0; i < stages.size(); i++)
+        {
+            const RenderStage& stage = stages[i];
+            if (stage.vignette)
+            {
+                preview_chain.add_vignette(stage.mode);
+                continue;
+            }
+            preview_chain.add(stage.kind, stage.scaling_factor, stage.mode);
+            if (stage.custom_thresholds)
+            {
+                preview_chain.set_thresholds(stage.low, stage.high);
+            }
+            if (i >= unchanged)
+            {
+                pipelines[i] = PointPipeline();
+                pipelines[i].add(stage.kind, stage.scaling_factor, stage.mode);
+                if (stage.custom_thresholds)
+                {
+                    pipelines[i].set_thresholds(stage.low, stage.high);
+                }
+            }
+        }
+        update_vignette_map();
+    }
+
+    // Tiles whose exact result has not been rendered yet
+    int dirty_tiles() const
+    {
+        int count = 0;
+        for (size_t i = 0; i < valid_stages.size(); i++)
+        {
+            count += valid_stages[i] < (int)stages.size();
+        }
+        return count;
+    }
+
+    /**
+     * Fills the dirty tiles of the frame with a low-resolution render: one
+     * source pixel in preview_scale is sampled in each direction, the chain
+     * runs on those, and each result is repeated over its block as process_6
+     * does. The vignette of the preview uses the map of the sampled size.
+     * @return nothing
+     */
+    void preview()
+    {
+        vector<vector<int> > bands = dirty_bands(tile_columns * tile_rows);
+        if (bands.empty())
+        {
+            return;
+        }
+        TraceScope scope("render_preview", "filter", (unsigned long long)source->width * source->height);
+
+        int scale = preview_scale;
+        Image small = image_pool().acquire((source->width + scale - 1) / scale, (source->height + scale - 1) / scale);
+        const Image& image = *source;
+        parallel_rows(small.height, small.width, [&](int first_row, int last_row)
+        {
+            for (int row = first_row; row < last_row; row++)
+            {
+                const unsigned char* in = image.row(row * scale);
+                unsigned char* out = small.row(row);
+                for (int col = 0; col < small.width; col++)
+                {
+                    memcpy(out + 3 * col, in + 3 * col * scale, 3);
+                }
+            }
+        });
+        preview_chain.run(small.view(), small.view());
+
+        // Enlarge into the dirty tiles only; the others already hold exact pixels
+        PixelRepeater repeater(scale);
+        Image& frame = outputs.back();
+        parallel_rows((int)bands.size(), tile_size * source->width, [&](int first_band, int last_band)
+        {
+            vector<unsigned char> scratch((size_t)BYTES_PER_PIXEL * (small.width + 1) * scale);
+            for (int band = first_band; band < last_band; band++)
+            {
+                Rect rows = tile_rect(bands[band][0]);
+                vector<pair<int, int> > spans = column_spans(bands[band]);
+                for (int row = rows.y; row < rows.y + rows.height; row++)
+                {
+                    for (size_t i = 0; i < spans.size(); i++)
+                    {
+                        int x = spans[i].first;
+                        int first_sample = x / scale;
+                        int samples = (x + spans[i].second - 1) / scale - first_sample + 1;
+                        repeater.run(small.row(row / scale) + 3 * first_sample, &scratch[0], samples);
+                        memcpy(frame.row(row) + 3 * x, &scratch[3 * (x % scale)], 3 * spans[i].second);
+                    }
+                }
+            }
+        });
+        image_pool().recycle(move(small));
+    }
+
+    /**
+     * Renders dirty tiles exactly, top to bottom, from the first stage each
+     * tile has no valid output for
+     * @param max_tiles the most tiles to render in this call
+     * @return true if no dirty tiles are left
+     */
+    bool refine(int max_tiles)
+    {
+        vector<vector<int> > bands = dirty_bands(max_tiles);
+        if (bands.empty())
+        {
+            return true;
+        }
+        unsigned long long pixels = 0;
+        for (size_t band = 0; band < bands.size(); band++)
+        {
+            pixels += (unsigned long long)bands[band].size() * tile_size * tile_size;
+        }
+        TraceScope scope("render_refine", "filter", pixels);
+
+        parallel_rows((int)bands.size(), tile_size * source->width, [&](int first_band, int last_band)
+        {
+            vector<unsigned short> scratch;
+            for (int band = first_band; band < last_band; band++)
+            {
+                render_band(bands[band], scratch);
+            }
+        });
+        return dirty_tiles() == 0;
+    }
+
+    /**
+     * Renders every dirty tile exactly
+     * @return the result, equal to running the stages over the whole source
+     */
+    const Image& render()
+    {
+        refine(tile_columns * tile_rows);
+        return frame();
+    }
+
+    // Exact tiles where they are rendered, preview or stale pixels in the rest
+    const Image& frame() const
+    {
+        return stages.empty() ? *source : outputs.back();
+    }
+
+private:
+    Rect tile_rect(int tile) const
+    {
+        Rect rect;
+        rect.x = tile % tile_columns * tile_size;
+        rect.y = tile / tile_columns * tile_size;
+        rect.width = min(tile_size, source->width - rect.x);
+        rect.height = min(tile_size, source->height - rect.y);
+        return rect;
+    }
+
+    // The first max_tiles dirty tiles in row order, grouped by row of tiles
+    vector<vector<int> > dirty_bands(int max_tiles) const
+    {
+        vector<vector<int> > bands;
+        int count = 0;
+        for (int tile_row = 0; tile_row < tile_rows && count < max_tiles; tile_row++)
+        {
+            vector<int> tiles;
+            for (int tile_col = 0; tile_col < tile_columns && count < max_tiles; tile_col++)
+            {
+                int tile = tile_row * tile_columns + tile_col;
+                if (valid_stages[tile] < (int)stages.size())
+                {
+                    tiles.push_back(tile);
+                    count++;
+                }
+            }
+            if (!tiles.empty())
+            {
+                bands.push_back(tiles);
+            }
+        }
+        return bands;
+    }
+
+    // Merges side-by-side tiles of one row of tiles into spans of columns (first column, width),
+    // so each image row is processed in as few calls as possible
+    vector<pair<int, int> > column_spans(const vector<int>& tiles) const
+    {
+        vector<pair<int, int> > spans;
+        for (size_t i = 0; i < tiles.size(); i++)
+        {
+            Rect rect = tile_rect(tiles[i]);
+            if (!spans.empty() && spans.back().first + spans.back().second == rect.x)
+            {
+                spans.back().second += rect.width;
+            }
+            else
+            {
+                spans.push_back(make_pair(rect.x, rect.width));
+            }
+        }
+        return spans;
+    }
+
+    // Renders dirty tiles from one row of tiles. Each stage runs, row by row,
+    // over the tiles with no valid output for it, from the previous stage's output.
+    void render_band(const vector<int>& tiles, vector<unsigned short>& scratch)
+    {
+        Rect rows = tile_rect(tiles[0]);
+        int first_stage = (int)stages.size();
+        for (size_t i = 0; i < tiles.size(); i++)
+        {
+            first_stage = min(first_stage, valid_stages[tiles[i]]);
+        }
+
+        for (size_t stage = first_stage; stage < stages.size(); stage++)
+        {
+            vector<int> stale;
+            for (size_t i = 0; i < tiles.size(); i++)
+            {
+                if (valid_stages[tiles[i]] <= (int)stage)
+                {
+                    stale.push_back(tiles[i]);
+                }
+            }
+            vector<pair<int, int> > spans = column_spans(stale);
+
+            const Image& in = stage == 0 ? *source : outputs[stage - 1];
+            Image& out = outputs[stage];
+            for (int row = rows.y; row < rows.y + rows.height; row++)
+            {
+                for (size_t i = 0; i < spans.size(); i++)
+                {
+                    const unsigned char* in_row = in.row(row) + 3 * spans[i].first;
+                    unsigned char* out_row = out.row(row) + 3 * spans[i].first;
+                    if (stages[stage].vignette)
+                    {
+                        apply_vignette_span(*map, row, spans[i].first, spans[i].second, in_row, out_row,
+                                            stages[stage].mode, scratch);
+                    }
+                    else
+                    {
+                        pipelines[stage].run_row(in_row, out_row, spans[i].second);
+                    }
+                }
+            }
+        }
+
+        for (size_t i = 0; i < tiles.size(); i++)
+        {
+            valid_stages[tiles[i]] = (int)stages.size();
+        }
+    }
+
+    void update_vignette_map()
+    {
+        map.reset();
+        for (size_t i = 0; i < stages.size() && source; i++)
+        {
+            if (stages[i].vignette)
+            {
+                map = vignette_map(source->width, source->height);
+                break;
+            }
+        }
+    }
+
+    int tile_size;
+    int preview_scale;
+    int tile_columns;
+    int tile_rows;
+    shared_ptr<const Image> source;
+    vector<RenderStage> stages;
+    vector<PointPipeline> pipelines;     // One point operation each; unused for vignette stages
+    RowPipeline preview_chain;           // All the stages, for preview()
+    shared_ptr<const VignetteMap> map;
+    vector<Image> outputs;               // The output of every stage; the last one is the frame
+    vector<int> valid_stages;            // Per tile, how many leading stages have valid output there
+};
+
+
+//*****************************************
+//     ASYNCHRONOUS FILE I/O
+//*****************************************
+
+/**
+ * Bytes held by I/O that has been started but whose data is not consumed
+ * yet. acquire() blocks while the total would pass the limit, which is
+ * how a fast reader is held back to the pace of the filters. A request
+ * larger than the whole limit still goes through once nothing else is held.
+ */
+class IoBudget
+{
+public:
+    explicit IoBudget(size_t limit) : limit(limit), held(0) {}
+
+    void acquire(size_t bytes)
+    {
+        unique_lock<mutex> lock(held_mutex);
+        if (held > 0 && held + bytes > limit)
+        {
+            TraceScope scope("io_budget_full", "wait");
+            released.wait(lock, [&] { return held == 0 || held + bytes <= limit; });
+        }
+        held += bytes;
+    }
+
+    void release(size_t bytes)
+    {
+        lock_guard<mutex> lock(held_mutex);
+        held -= bytes;
+        released.notify_all();
+    }
+
+private:
+    size_t limit;
+    size_t held;
+    mutex held_mutex;
+    condition_variable released;
+};
+
+// How AsyncFileIo carries out reads and writes
+enum IoBackend
+{
+    IO_BACKEND_AUTO,      // io_uring where the kernel allows it, threads otherwise
+    IO_BACKEND_URING,     // One ring; a single thread reaps completions
+    IO_BACKEND_THREADS    // Blocking reads and writes on a few worker threads
+};
+
+/**
+ * Reads and writes whole files in the background. read() and write() return
+ * at once; the callback runs on an I/O thread when the transfer finishes,
+ * so it must not block. On Linux the transfers go through io_uring, driven
+ * with raw system calls so no library is needed. Where io_uring is missing
+ * or not permitted a few threads do blocking reads and writes instead.
+ */
+class AsyncFileIo
+{
+public:
+    // contents holds the whole file; error is 0 or an errno value
+    typedef function<void(vector<unsigned char>& contents, int error)> ReadCallback;
+    typedef function<void(int error)> WriteCallback;
+
+    AsyncFileIo(IoBackend backend, int threads) : stopping(false), pending(0)
+    {
+#ifdef IMAGE_APP_IO_URING
+        ring_fd = -1;
+        fallback_threads = max(threads, 1);
+        if (backend != IO_BACKEND_THREADS && setup_ring())
+        {
+            workers.push_back(thread([this] { run_ring(); }));
+            return;
+        }
+#endif
+        (void)backend;
+        for (int i = 0; i < max(threads, 1); i++)
+        {
+            workers.push_back(thread([this] { run_worker(); }));
+        }
+    }
+
+    ~AsyncFileIo()
+    {
+        drain();
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            stopping = true;
+            queue_ready.notify_all();
+        }
+#ifdef IMAGE_APP_IO_URING
+        if (ring_fd >= 0)
+        {
+            wake();
+        }
+#endif
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            workers[i].join();
+        }
+#ifdef IMAGE_APP_IO_URING
+        // Started by the ring thread if the ring failed; it has exited, so the list is final
+        for (size_t i = 0; i < fallback_workers.size(); i++)
+        {
+            fallback_workers[i].join();
+        }
+        if (ring_fd >= 0)
+        {
+            munmap(sqes, sqe_bytes);
+            if (cq_ring != sq_ring)
+            {
+                munmap(cq_ring, cq_ring_bytes);
+            }
+            munmap(sq_ring, sq_ring_bytes);
+            close(ring_fd);
+            close(wake_fd);
+        }
+#endif
+    }
+
+    AsyncFileIo(const AsyncFileIo&) = delete;
+    AsyncFileIo& operator=(const AsyncFileIo&) = delete;
+
+    const char* backend_name() const
+    {
+#ifdef IMAGE_APP_IO_URING
+        if (ring_fd >= 0)
+        {
+            return "io_uring";
+        }
+#endif
+        return "threads";
+    }
+
+    /**
+     * Starts reading a whole file
+     * @param path the file
+     * @param done called with the contents when the read finishes or fails
+     * @return nothing
+     */
+    void read(const string& path, ReadCallback done)
+    {
+        Operation* operation = new Operation();
+        operation->write = false;
+        operation->path = path;
+        operation->read_done = done;
+        start(operation);
+    }
+
+    /**
+     * Starts writing a whole file, replacing it if it exists
+     * @param path     the file
+     * @param contents the bytes to write; taken over by the operation
+     * @param done     called when the write finishes or fails
+     * @return nothing
+     */
+    void write(const string& path, vector<unsigned char> contents, WriteCallback done)
+    {
+        Operation* operation = new Operation();
+        operation->write = true;
+        operation->path = path;
+        operation->buffer = move(contents);
+        operation->write_done = done;
+        start(operation);
+    }
+
+    /**
+     * Gets a buffer for write(), reusing the memory of finished transfers so
+     * large files do not fault in fresh pages every time
+     * @param size the number of bytes
+     * @return the buffer
+     */
+    vector<unsigned char> buffer(size_t size)
+    {
+        vector<unsigned char> result;
+        {
+            lock_guard<mutex> lock(spare_mutex);
+            size_t best = spares.size();
+            for (size_t i = 0; i < spares.size(); i++)
+            {
+                if (spares[i].capacity() >= size && (best == spares.size() || spares[i].capacity() < spares[best].capacity()))
+                {
+                    best = i;
+                }
+            }
+            if (best < spares.size())
+            {
+                result = move(spares[best]);
+                spares.erase(spares.begin() + best);
+            }
+        }
+        result.resize(size);
+        return result;
+    }
+
+    // Gives back the contents of a read once they are no longer needed, for buffer() to reuse
+    void recycle(vector<unsigned char> contents)
+    {
+        // Enough for the reads and writes of a few images in flight
+        const size_t MAX_SPARES = 4;
+
+        lock_guard<mutex> lock(spare_mutex);
+        if (contents.capacity() > 0 && spares.size() < MAX_SPARES)
+        {
+            spares.push_back(move(contents));
+        }
+    }
+
+    // Waits until every operation started so far has run its callback
+    void drain()
+    {
+        unique_lock<mutex> lock(queue_mutex);
+        idle.wait(lock, [this] { return pending == 0; });
+    }
+
+private:
+    struct Operation
+    {
+        bool write;
+        string path;
+        vector<unsigned char> buffer;
+        size_t done;            // Bytes transferred so far
+        int fd;
+        int error;
+        ReadCallback read_done;
+        WriteCallback write_done;
+#ifdef IMAGE_APP_IO_URING
+        struct iovec remaining; // The part of buffer still to transfer
+        list<Operation*>::iterator slot;    // Its entry in in_flight
+#endif
+    };
+
+    void start(Operation* operation)
+    {
+        operation->done = 0;
+        operation->fd = -1;
+        operation->error = 0;
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            pending++;
+            queue.push_back(operation);
+            queue_ready.notify_one();
+        }
+#ifdef IMAGE_APP_IO_URING
+        if (ring_fd >= 0)
+        {
+            wake();
+        }
+#endif
+    }
+
+    // Runs the callback and retires the operation
+    void finish(Operation* operation)
+    {
+        if (operation->write)
+        {
+            trace_bytes_written(operation->done);
+            operation->write_done(operation->error);
+        }
+        else
+        {
+            trace_bytes_read(operation->done);
+            operation->read_done(operation->buffer, operation->error);
+        }
+        recycle(move(operation->buffer));
+        delete operation;
+
+        lock_guard<mutex> lock(queue_mutex);
+        pending--;
+        if (pending == 0)
+        {
+            idle.notify_all();
+        }
+    }
+
+    // Thread backend: each worker takes one whole transfer at a time
+    void run_worker()
+    {
+        while (true)
+        {
+            Operation* operation;
+            {
+                unique_lock<mutex> lock(queue_mutex);
+                queue_ready.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (queue.empty())
+                {
+                    return;
+                }
+                operation = queue.front();
+                queue.pop_front();
+            }
+
+            TraceScope scope(operation->write ? "async_write" : "async_read", "io");
+            fstream stream;
+            if (operation->write)
+            {
+                stream.open(operation->path, ios::out | ios::binary | ios::trunc);
+                stream.write((const char*)operation->buffer.data(), operation->buffer.size());
+                stream.close();
+                operation->done = operation->buffer.size();
+                operation->error = stream.fail() ? EIO : 0;
+            }
+            else
+            {
+                stream.open(operation->path, ios::in | ios::binary | ios::ate);
+                streamoff size = stream.is_open() ? (streamoff)stream.tellg() : -1;
+                if (size < 0)
+                {
+                    operation->error = ENOENT;
+                }
+                else
+                {
+                    operation->buffer = buffer((size_t)size);
+                    stream.seekg(0);
+                    stream.read((char*)operation->buffer.data(), size);
+                    operation->done = (size_t)stream.gcount();
+                    operation->buffer.resize(operation->done);
+                    operation->error = stream.gcount() == size ? 0 : EIO;
+                }
+            }
+            finish(operation);
+        }
+    }
+
+#ifdef IMAGE_APP_IO_URING
+    // Maps the submission and completion rings of a new io_uring instance
+    bool setup_ring()
+    {
+        // Operations in flight at once, less the entry the wake-up poll keeps; more wait in the queue
+        const unsigned RING_ENTRIES = 64;
+
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wake_fd < 0)
+        {
+            return false;
+        }
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ring_fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+        if (ring_fd < 0)
+        {
+            close(wake_fd);
+            return false;
+        }
+
+        sq_ring_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_bytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_map = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_map)
+        {
+            sq_ring_bytes = cq_ring_bytes = max(sq_ring_bytes, cq_ring_bytes);
+        }
+        sqe_bytes = params.sq_entries * sizeof(io_uring_sqe);
+
+        sq_ring = (unsigned char*)mmap(nullptr, sq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                       ring_fd, IORING_OFF_SQ_RING);
+        cq_ring = single_map || sq_ring == MAP_FAILED ? sq_ring
+                : (unsigned char*)mmap(nullptr, cq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                       ring_fd, IORING_OFF_CQ_RING);
+        sqes = (io_uring_sqe*)mmap(nullptr, sqe_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                   ring_fd, IORING_OFF_SQES);
+        if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED)
+        {
+            if (sqes != MAP_FAILED)
+            {
+                munmap(sqes, sqe_bytes);
+            }
+            if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+            {
+                munmap(cq_ring, cq_ring_bytes);
+            }
+            if (sq_ring != MAP_FAILED)
+            {
+                munmap(sq_ring, sq_ring_bytes);
+            }
+            close(ring_fd);
+            close(wake_fd);
+            ring_fd = -1;
+            return false;
+        }
+
+        sq_tail = (unsigned*)(sq_ring + params.sq_off.tail);
+        sq_mask = *(unsigned*)(sq_ring + params.sq_off.ring_mask);
+        sq_array = (unsigned*)(sq_ring + params.sq_off.array);
+        cq_head = (unsigned*)(cq_ring + params.cq_off.head);
+        cq_tail = (unsigned*)(cq_ring + params.cq_off.tail);
+        cq_mask = *(unsigned*)(cq_ring + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq_ring + params.cq_off.cqes);
+        free_entries = params.sq_entries - 1;
+        unsubmitted = 0;
+        return true;
+    }
+
+    // The next submission entry, cleared and published; run_ring() hands it to the kernel
+    io_uring_sqe* next_sqe()
+    {
+        unsigned tail = *sq_tail;
+        io_uring_sqe* sqe = &sqes[tail & sq_mask];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[tail & sq_mask] = tail & sq_mask;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        unsubmitted++;
+        return sqe;
+    }
+
+    // Polls wake_fd once; the completion carries no operation
+    void watch_wake_fd()
+    {
+        io_uring_sqe* sqe = next_sqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = wake_fd;
+        sqe->poll_events = POLLIN;
+        sqe->user_data = 0;
+    }
+
+    // Gets the ring thread to look at the queue
+    void wake()
+    {
+        uint64_t one = 1;
+        ssize_t written = ::write(wake_fd, &one, sizeof(one));
+        (void)written;
+    }
+
+    // Queues the transfer of what is left of an operation's buffer
+    void submit_transfer(Operation* operation)
+    {
+        operation->remaining.iov_base = operation->buffer.data() + operation->done;
+        operation->remaining.iov_len = operation->buffer.size() - operation->done;
+        io_uring_sqe* sqe = next_sqe();
+        sqe->opcode = operation->write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = operation->fd;
+        sqe->addr = (unsigned long long)&operation->remaining;
+        sqe->len = 1;
+        sqe->off = operation->done;
+        sqe->user_data = (unsigned long long)operation;
+    }
+
+    // Opens the file and queues the first transfer. Opening stays synchronous: it is short,
+    // and IORING_OP_OPENAT needs Linux 5.6.
+    void submit_first(Operation* operation)
+    {
+        struct stat info;
+        if (operation->write)
+        {
+            operation->fd = open(operation->path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+        else
+        {
+            operation->fd = open(operation->path.c_str(), O_RDONLY);
+            if (operation->fd >= 0 && fstat(operation->fd, &info) == 0)
+            {
+                operation->buffer = buffer((size_t)info.st_size);
+            }
+        }
+        if (operation->fd < 0)
+        {
+            operation->error = errno;
+            complete(operation);
+            return;
+        }
+        if (operation->buffer.empty())
+        {
+            complete(operation);
+            return;
+        }
+        submit_transfer(operation);
+    }
+
+    // Closes an operation's file, frees its ring entry and finishes it. The kernel ran the
+    // transfer alongside others, so the trace span covers closing and the callback, and
+    // finish() counts the bytes in it as run_worker()'s span does.
+    void complete(Operation* operation)
+    {
+        TraceScope scope(operation->write ? "async_write" : "async_read", "io");
+        if (operation->fd >= 0)
+        {
+            close(operation->fd);
+        }
+        if (!operation->write)
+        {
+            operation->buffer.resize(operation->done);
+        }
+        in_flight.erase(operation->slot);
+        free_entries++;
+        finish(operation);
+    }
+
+    /**
+     * Gives up on the ring after io_uring_enter() failed. Operations the ring
+     * had taken finish with the error; the kernel may still be using their
+     * buffers, so those are kept until the ring is closed. Operations still
+     * queued, and any started from now on, go to worker threads instead.
+     * @param error the errno value io_uring_enter() failed with
+     * @return nothing
+     */
+    void abandon_ring(int error)
+    {
+        cerr << "io_uring failed (" << strerror(error) << "); using I/O threads" << endl;
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            for (int i = 0; i < fallback_threads; i++)
+            {
+                fallback_workers.push_back(thread([this] { run_worker(); }));
+            }
+        }
+        while (!in_flight.empty())
+        {
+            Operation* operation = in_flight.front();
+            abandoned.push_back(move(operation->buffer));
+            operation->buffer.clear();
+            operation->done = 0;
+            operation->error = error;
+            complete(operation);
+        }
+    }
+
+    // Handles one completion: resubmits short transfers and finishes the rest
+    void handle_completion(Operation* operation, int result)
+    {
+        if (result == -EINTR || result == -EAGAIN)
+        {
+            submit_transfer(operation);
+            return;
+        }
+        if (result < 0)
+        {
+            operation->error = -result;
+        }
+        else
+        {
+            operation->done += result;
+            if (result == 0 && operation->write)
+            {
+                operation->error = EIO;
+            }
+            // A read returns 0 at the end of a file that shrank since it was opened
+            else if (result > 0 && operation->done < operation->buffer.size())
+            {
+                submit_transfer(operation);
+                return;
+            }
+        }
+        complete(operation);
+    }
+
+    // io_uring backend: the one thread that submits to the ring and reaps from it. The kernel
+    // ties each request to the thread that submitted it and fails what is still in flight when
+    // that thread exits, so requests must not be submitted by callers that may finish first.
+    void run_ring()
+    {
+        watch_wake_fd();
+        while (true)
+        {
+            long submitted = syscall(__NR_io_uring_enter, ring_fd, unsubmitted, 1, IORING_ENTER_GETEVENTS,
+                                     nullptr, 0);
+            if (submitted < 0 && errno != EINTR && errno != EAGAIN)
+            {
+                abandon_ring(errno);
+                return;
+            }
+            unsubmitted -= max(submitted, 0L);
+
+            unsigned head = *cq_head;
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != tail; head++)
+            {
+                const io_uring_cqe& cqe = cqes[head & cq_mask];
+                Operation* operation = (Operation*)cqe.user_data;
+                int result = cqe.res;
+                __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+                if (operation)
+                {
+                    handle_completion(operation, result);
+                    continue;
+                }
+                uint64_t wakes;
+                ssize_t got = ::read(wake_fd, &wakes, sizeof(wakes));
+                (void)got;
+                watch_wake_fd();
+            }
+
+            while (free_entries > 0)
+            {
+                Operation* operation;
+                {
+                    lock_guard<mutex> lock(queue_mutex);
+                    if (queue.empty())
+                    {
+                        if (stopping && pending == 0)
+                        {
+                            return;
+                        }
+                        break;
+                    }
+                    operation = queue.front();
+                    queue.pop_front();
+                }
+                free_entries--;
+                operation->slot = in_flight.insert(in_flight.end(), operation);
+                submit_first(operation);
+            }
+        }
+    }
+
+    int ring_fd;
+    unsigned char* sq_ring;
+    unsigned char* cq_ring;
+    io_uring_sqe* sqes;
+    size_t sq_ring_bytes;
+    size_t cq_ring_bytes;
+    size_t sqe_bytes;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe* cqes;
+    unsigned free_entries;          // Ring entries not taken by an operation, so completions never overflow
+    unsigned unsubmitted;           // Entries published to the ring that the kernel has not taken yet
+    int wake_fd;                    // Eventfd start() and the destructor signal when there is work
+    list<Operation*> in_flight;     // Operations holding a ring entry
+    int fallback_threads;           // Workers abandon_ring() starts
+    vector<thread> fallback_workers;
+    vector<vector<unsigned char> > abandoned;   // Buffers of operations abandon_ring() failed
+#endif
+
+    bool stopping;
+    int pending;                    // Operations started whose callback has not returned
+    vector<vector<unsigned char> > spares;   // Buffers of finished transfers, for buffer()
+    mutex spare_mutex;
+    deque<Operation*> queue;        // Operations waiting for a worker or for a free ring entry
+    mutex queue_mutex;
+    condition_variable queue_ready;
+    condition_variable idle;
+    vector<thread> workers;
+};
+
+
+//*****************************************
+//     BATCH MODE
+//*****************************************
+
+/**
+ * Queue with a fixed capacity connecting two pipeline stages.
+ * push() blocks while the queue is full, so a fast stage cannot run ahead of
+ * a slow one by more than the capacity. After close(), pop() drains what is
+ * left and then returns false.
+ */
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(max(capacity, (size_t)1)), closed(false) {}
+
+    void push(T item)
+    {
+        unique_lock<mutex> lock(items_mutex);
+        if (items.size() >= capacity)
+        {
+            // Shows up in a trace inside the producer's scope, as time lost to a slower next stage
+            TraceScope scope("queue_full", "wait");
+            not_full.wait(lock, [this] { return items.size() < capacity; });
+        }
+        items.push_back(move(item));
+        not_empty.notify_one();
+    }
+
+    bool pop(T& item)
+    {
+        unique_lock<mutex> lock(items_mutex);
+        not_empty.wait(lock, [this] { return closed || !items.empty(); });
+        if (items.empty())
+        {
+            return false;
+        }
+        item = move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    // Wakes every waiting pop() once the remaining items are gone
+    void close()
+    {
+        lock_guard<mutex> lock(items_mutex);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    bool closed;
+    deque<T> items;
+    mutex items_mutex;
+    condition_variable not_empty;
+    condition_variable not_full;
+};
+
+// One filter of a batch chain, parsed from a --filter argument
+struct FilterSpec
+{
+    int process;            // 1 to 10, the same numbers as the menu
+    double scaling_factor;  // Clarendon, lighten and darken; sigma for blur, amount for sharpen
+    int number;             // Quarter turns for rotate, x scale for enlarge, radius for box blur
+    int y_scale;            // Enlarge
+    ArithmeticMode mode;    // Vignette, Clarendon, lighten and darken
+    Rect region;            // Crop; the width and height alone for resize
+    ResampleFilter filter;  // Resize
+    ThresholdMethod threshold;  // Clarendon and high contrast
+    double percentiles[2];      // Dark and bright percentiles for Clarendon, one for high contrast
+    BorderMode border;          // Blur, box blur, sharpen and edges
+};
+
+// Process numbers of the batch-only filters, after the menu's 1 to 10
+const int PROCESS_RESIZE = 11;
+const int PROCESS_CROP = 12;
+const int PROCESS_BLUR = 13;
+const int PROCESS_BOX_BLUR = 14;
+const int PROCESS_SHARPEN = 15;
+const int PROCESS_EDGES = 16;
+
+/**
+ * Parses a filter argument of the form name[:value[:value]].
+ * Names are vignette, clarendon:factor, grayscale, rotate90, rotate:turns,
+ * enlarge:x_scale[:y_scale], high-contrast, lighten:factor, darken:factor and
+ * dominance; the menu numbers 1 to 10 work as names too. A final :fixed
+ * selects fixed-point arithmetic for vignette, clarendon, lighten and darken.
+ * Batch mode adds resize:width:height[:box|bilinear|bicubic|lanczos] (bicubic
+ * by default) and crop:x:y:width:height. Thresholds adapt to the image with
+ * clarendon:factor:otsu, clarendon:factor:dark%:bright%, high-contrast:otsu
+ * and high-contrast:percent. The neighborhood filters blur:sigma,
+ * box-blur:radius, sharpen:amount and edges take a final border mode of
+ * clamp, reflect (the default), wrap or zero; sigma, radius and amount are
+ * at most MAX_BLUR_SIGMA, MAX_BOX_RADIUS and MAX_SHARPEN_AMOUNT.
+ * @param text the argument
+ * @param spec receives the filter
+ * @return true if the argument names a filter with valid values
+ */
+bool parse_filter_spec(const string& text, FilterSpec& spec)
+{
+    const char* NAMES[] = { "vignette", "clarendon", "grayscale", "rotate90", "rotate", "enlarge",
+                            "high-contrast", "lighten", "darken", "dominance", "resize", "crop",
+                            "blur", "box-blur", "sharpen", "edges" };
+    const char* FILTER_NAMES[] = { "box", "bilinear", "bicubic", "lanczos" };
+    const char* BORDER_NAMES[] = { "clamp", "reflect", "wrap", "zero" };
+
+    vector<string> parts;
+    size_t begin = 0;
+    while (true)
+    {
+        size_t end = text.find(':', begin);
+        parts.push_back(text.substr(begin, end == string::npos ? string::npos : end - begin));
+        if (end == string::npos)
+        {
+            break;
+        }
+        begin = end + 1;
+    }
+
+    spec.mode = ARITHMETIC_EXACT;
+    if (parts.size() > 1 && parts.back() == "fixed")
+    {
+        spec.mode = ARITHMETIC_FIXED_POINT;
+        parts.pop_back();
+        if (parts[0] != "vignette" && parts[0] != "clarendon" && parts[0] != "lighten" && parts[0] != "darken" &&
+            parts[0] != "1" && parts[0] != "2" && parts[0] != "8" && parts[0] != "9")
+        {
+            return false;
+        }
+    }
+
+    spec.threshold = THRESHOLD_FIXED;
+    if (parts.size() > 1 && parts.back() == "otsu")
+    {
+        spec.threshold = THRESHOLD_OTSU;
+        parts.pop_back();
+        if (parts[0] != "clarendon" && parts[0] != "high-contrast" && parts[0] != "2" && parts[0] != "7")
+        {
+            return false;
+        }
+    }
+
+    spec.filter = RESAMPLE_BICUBIC;
+    if (parts[0] == "resize" && parts.size() == 4)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            if (parts.back() == FILTER_NAMES[i])
+            {
+                spec.filter = (ResampleFilter)i;
+                parts.pop_back();
+                break;
+            }
+        }
+    }
+
+    spec.border = BORDER_REFLECT;
+    if (parts.size() > 1 && (parts[0] == "blur" || parts[0] == "box-blur" || parts[0] == "sharpen" || parts[0] == "edges"))
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            if (parts.back() == BORDER_NAMES[i])
+            {
+                spec.border = (BorderMode)i;
+                parts.pop_back();
+                break;
+            }
+        }
+    }
+
+    spec.process = 0;
+    for (int i = 0; i < 16; i++)
+    {
+        if (parts[0] == NAMES[i] || (i < 10 && parts[0] == to_string(i + 1)))
+        {
+            spec.process = i + 1;
+        }
+    }
+
+    // Parses parts[index] into value, requiring the whole part to be a number
+    vector<double> values;
+    for (size_t i = 1; i < parts.size(); i++)
+    {
+        char* end = nullptr;
+        double value = strtod(parts[i].c_str(), &end);
+        if (parts[i].empty() || *end != '\0')
+        {
+            return false;
+        }
+        values.push_back(value);
+    }
+
+    // True if values[i] is a whole number an int holds; the comparisons also reject NaN
+    auto whole = [&values](size_t i)
+    {
+        return values[i] >= INT_MIN && values[i] <= INT_MAX && values[i] == (int)values[i];
+    };
+
+    spec.scaling_factor = 1.0;
+    spec.number = 1;
+    spec.y_scale = 1;
+    spec.region = Rect();
+    spec.percentiles[0] = 0;
+    spec.percentiles[1] = 0;
+    for (size_t i = 0; i < values.size(); i++)
+    {
+        if ((spec.process == PROCESS_RESIZE || spec.process == PROCESS_CROP) && !whole(i))
+        {
+            return false;
+        }
+    }
+    switch (spec.process)
+    {
+        case 2:
+            if (values.size() == 3 && spec.threshold == THRESHOLD_FIXED && values[1] >= 0 && values[1] <= 100 &&
+                values[2] >= 0 && values[2] <= 100)
+            {
+                spec.threshold = THRESHOLD_PERCENTILE;
+                spec.percentiles[0] = values[1];
+                spec.percentiles[1] = values[2];
+                values.resize(1);
+            }
+            if (values.size() != 1)
+            {
+                return false;
+            }
+            spec.scaling_factor = values[0];
+            return true;
+        case 7:
+            if (values.size() == 1 && spec.threshold == THRESHOLD_FIXED && values[0] >= 0 && values[0] <= 100)
+            {
+                spec.threshold = THRESHOLD_PERCENTILE;
+                spec.percentiles[0] = values[0];
+                return true;
+            }
+            return values.empty();
+        case 8: case 9:
+            if (values.size() != 1)
+            {
+                return false;
+            }
+            spec.scaling_factor = values[0];
+            return true;
+        case 5:
+            if (values.size() != 1 || !whole(0))
+            {
+                return false;
+            }
+            spec.number = (int)values[0];
+            return true;
+        case 6:
+            if (values.empty() || values.size() > 2 || !whole(0) || values[0] < 1 ||
+                !whole(values.size() - 1) || values.back() < 1)
+            {
+                return false;
+            }
+            spec.number = (int)values[0];
+            spec.y_scale = (int)values.back();
+            return true;
+        case 1: case 3: case 4: case 10: case PROCESS_EDGES:
+            return values.empty();
+        case PROCESS_BLUR: case PROCESS_SHARPEN:
+            // The comparisons also reject NaN
+            if (values.size() != 1 || !(values[0] >= 0) ||
+                !(values[0] <= (spec.process == PROCESS_BLUR ? MAX_BLUR_SIGMA : MAX_SHARPEN_AMOUNT)))
+            {
+                return false;
+            }
+            spec.scaling_factor = values[0];
+            return true;
+        case PROCESS_BOX_BLUR:
+            if (values.size() != 1 || !whole(0) || values[0] < 0 || values[0] > MAX_BOX_RADIUS)
+            {
+                return false;
+            }
+            spec.number = (int)values[0];
+            return true;
+        case PROCESS_RESIZE:
+            if (values.size() != 2 || values[0] < 1 || values[1] < 1 || !fits_bmp((int)values[0], (int)values[1]))
+            {
+                return false;
+            }
+            spec.region.width = (int)values[0];
+            spec.region.height = (int)values[1];
+            return true;
+        case PROCESS_CROP:
+            if (values.size() != 4 || values[2] < 1 || values[3] < 1)
+            {
+                return false;
+            }
+            spec.region.x = (int)values[0];
+            spec.region.y = (int)values[1];
+            spec.region.width = (int)values[2];
+            spec.region.height = (int)values[3];
+            return true;
+        default:
+            return false;
+    }
+}
+
+// True for a filter whose thresholds come from the image's histogram
+bool adaptive_filter(const FilterSpec& spec)
+{
+    return (spec.process == 2 || spec.process == 7) && spec.threshold != THRESHOLD_FIXED;
+}
+
+/**
+ * Adds a point filter to a pipeline
+ * @param pipeline the pipeline: a RowPipeline, or an UpscaledView that defers the filter
+ * @param spec     the filter
+ * @param stats    the histogram adaptive thresholds are chosen from
+ * @return true for process_2, 3, 7, 8, 9 or 10; false, adding nothing, for any other filter
+ */
+template <typename Pipeline>
+bool add_point_filter(Pipeline& pipeline, const FilterSpec& spec, const ImageStats& stats)
+{
+    int dark_below;
+    int bright_from;
+    switch (spec.process)
+    {
+        case 2:
+            clarendon_bands(stats, spec.threshold, spec.percentiles[0], spec.percentiles[1], dark_below, bright_from);
+            pipeline.add(POINT_CLARENDON, spec.scaling_factor, spec.mode).set_thresholds(dark_below, bright_from);
+            return true;
+        case 7:
+            pipeline.add(POINT_HIGH_CONTRAST).set_thresholds(
+                high_contrast_threshold(stats, spec.threshold, spec.percentiles[0]));
+            return true;
+        case 3:  pipeline.add(POINT_GRAYSCALE); return true;
+        case 8:  pipeline.add(POINT_LIGHTEN, spec.scaling_factor, spec.mode); return true;
+        case 9:  pipeline.add(POINT_DARKEN, spec.scaling_factor, spec.mode); return true;
+        case 10: pipeline.add(POINT_COLOR_DOMINANCE); return true;
+        default: return false;
+    }
+}
+
+/**
+ * Builds one RowPipeline for a whole chain, when every filter in it only
+ * needs its own row: point filters with fixed thresholds and the vignette
+ * @param filters  the chain
+ * @param pipeline receives the fused chain
+ * @return false if some filter needs the whole image or changes its size
+ */
+bool fuse_filters(const vector<FilterSpec>& filters, RowPipeline& pipeline)
+{
+    ImageStats none;
+    for (size_t i = 0; i < filters.size(); i++)
+    {
+        if (filters[i].process == 1)
+        {
+            pipeline.add_vignette(filters[i].mode);
+        }
+        else if (adaptive_filter(filters[i]) || !add_point_filter(pipeline, filters[i], none))
+        {
+            return false;
+        }
+    }
+    return true;
+}
 
-   
-    // Create a new image with swapped dimensions (width becomes height, height becomes width)
-    vector<vector<Pixel>> new_image(num_columns, vector<Pixel>(num_rows));
+/**
+ * Finds whether a chain ends in an enlarge followed only by point filters
+ * with fixed thresholds. Such a chain can stop before the enlarge and write
+ * the result through an UpscaledView, which never holds the enlarged image.
+ * @param filters the chain
+ * @return the index of that enlarge, or filters.size() if the chain does not end that way
+ */
+size_t upscaled_tail(const vector<FilterSpec>& filters)
+{
+    for (size_t i = filters.size(); i-- > 0; )
+    {
+        int process = filters[i].process;
+        if (process == 6)
+        {
+            return i;
+        }
+        bool point = process == 2 || process == 3 || (process >= 7 && process <= 10);
+        if (!point || adaptive_filter(filters[i]))
+        {
+            break;
+        }
+    }
+    return filters.size();
+}
+
+/**
+ * Works out the size of the image a chain of filters leaves, without running
+ * it, so a chain whose result could never be written fails before anything
+ * that large is allocated
+ * @param width   the input width; receives the output width
+ * @param height  the input height; receives the output height
+ * @param filters the chain
+ * @return false if the result, or an image along the way, would not fit a BMP file
+ */
+bool chain_output_size(int& width, int& height, const vector<FilterSpec>& filters)
+{
+    for (size_t i = 0; i < filters.size(); i++)
+    {
+        const FilterSpec& spec = filters[i];
+        long long new_width = width;
+        long long new_height = height;
+        if (spec.process == 4 || (spec.process == 5 && spec.number % 2 != 0))
+        {
+            swap(new_width, new_height);
+        }
+        else if (spec.process == 6)
+        {
+            new_width *= spec.number;
+            new_height *= spec.y_scale;
+        }
+        else if (spec.process == PROCESS_RESIZE)
+        {
+            new_width = spec.region.width;
+            new_height = spec.region.height;
+        }
+        else if (spec.process == PROCESS_CROP)
+        {
+            // Outside the image the crop ends the chain (see apply_filters())
+            Rect region = spec.region;
+            if (!clip_rect(region, width, height))
+            {
+                width = 0;
+                height = 0;
+                return true;
+            }
+            new_width = region.width;
+            new_height = region.height;
+        }
+        if (!fits_bmp(new_width, new_height))
+        {
+            return false;
+        }
+        width = (int)new_width;
+        height = (int)new_height;
+    }
+    return true;
+}
+
+/**
+ * Applies a chain of filters to an image.
+ * Runs of consecutive point filters and vignettes are fused into one
+ * RowPipeline and run in place; rotations run in place when the shape allows.
+ * Point filters right after an enlarge run before it instead, on the smaller
+ * image, which gives the same result because enlarging only copies pixels.
+ * Adaptive thresholds need the histogram of the image as the chain reaches
+ * them, so they run the filters before them first and then read the image
+ * once more to count it; enlarging copies every pixel equally often, so the
+ * histogram before an enlarge gives the same thresholds as after.
+ * A crop that lies outside the image leaves it empty and ends the chain.
+ * @param image   the image; replaced by the result
+ * @param filters the filters in the order to apply them
+ * @return nothing
+ */
+void apply_filters(Image& image, const vector<FilterSpec>& filters)
+{
+    // Adds a point filter (process_2, 3, 7, 8, 9 or 10) to a pipeline; false for any other filter
+    auto add_point = [&image](RowPipeline& pipeline, const FilterSpec& spec)
+    {
+        ImageStats stats;
+        if (adaptive_filter(spec))
+        {
+            if (!pipeline.empty())
+            {
+                pipeline.run(image.view(), image.view());
+                pipeline = RowPipeline();
+            }
+            stats = image_stats(image.view());
+        }
+        return add_point_filter(pipeline, spec, stats);
+    };
+
+    RowPipeline pipeline;
+    for (size_t i = 0; i <= filters.size(); i++)
+    {
+        int process = i < filters.size() ? filters[i].process : 0;
+        if (process == 1)
+        {
+            pipeline.add_vignette(filters[i].mode);
+            continue;
+        }
+        if (process != 0 && add_point(pipeline, filters[i]))
+        {
+            continue;
+        }
+
+        // Pull the point filters that follow an enlarge in front of it
+        size_t current = i;
+        while (process == 6 && i + 1 < filters.size() && add_point(pipeline, filters[i + 1]))
+        {
+            i++;
+        }
+
+        // A geometric filter or the end of the chain: flush the fused run first
+        if (!pipeline.empty())
+        {
+            pipeline.run(image.view(), image.view());
+            pipeline = RowPipeline();
+        }
+        if (process == 4)
+        {
+            rotate_in_place(image, 1);
+        }
+        else if (process == 5)
+        {
+            rotate_in_place(image, filters[current].number);
+        }
+        else if (process == 6)
+        {
+            Image enlarged = process_6(image, filters[current].number, filters[current].y_scale);
+            swap(image, enlarged);
+            image_pool().recycle(move(enlarged));
+        }
+        else if (process == PROCESS_RESIZE || process == PROCESS_CROP)
+        {
+            Image resized = process == PROCESS_CROP ? crop_image(image, filters[i].region) :
+                            resample_image(image, filters[i].region.width, filters[i].region.height, filters[i].filter);
+            swap(image, resized);
+            image_pool().recycle(move(resized));
+
+            // Nothing is left of an image cropped outside itself
+            if (image.empty())
+            {
+                return;
+            }
+        }
+        else if (process >= PROCESS_BLUR && process <= PROCESS_EDGES)
+        {
+            const FilterSpec& spec = filters[i];
+            Image filtered = process == PROCESS_BOX_BLUR ? box_blur(image, spec.number, spec.border) :
+                             process == PROCESS_BLUR ? gaussian_blur(image, spec.scaling_factor, spec.border) :
+                             process == PROCESS_SHARPEN ? sharpen(image, spec.scaling_factor, spec.border) :
+                             detect_edges(image, spec.border);
+            swap(image, filtered);
+            image_pool().recycle(move(filtered));
+        }
+    }
+}
+
+/**
+ * Builds an output filename from a pattern.
+ * {name} is the input file name without directory or extension, {dir} its
+ * directory (. if none) and {index} its position in the batch.
+ * @param pattern  the output pattern
+ * @param filename the input filename
+ * @param index    the position of the input in the batch
+ * @return the output filename
+ */
+string output_filename(const string& pattern, const string& filename, int index)
+{
+    size_t slash = filename.find_last_of('/');
+    string dir = slash == string::npos ? "." : filename.substr(0, slash);
+    string name = slash == string::npos ? filename : filename.substr(slash + 1);
+    size_t dot = name.find_last_of('.');
+    if (dot != string::npos && dot > 0)
+    {
+        name = name.substr(0, dot);
+    }
+
+    string result;
+    for (size_t i = 0; i < pattern.size(); i++)
+    {
+        if (pattern.compare(i, 6, "{name}") == 0)
+        {
+            result += name;
+            i += 5;
+        }
+        else if (pattern.compare(i, 5, "{dir}") == 0)
+        {
+            result += dir;
+            i += 4;
+        }
+        else if (pattern.compare(i, 7, "{index}") == 0)
+        {
+            result += to_string(index);
+            i += 6;
+        }
+        else
+        {
+            result += pattern[i];
+        }
+    }
+    return result;
+}
+
+/**
+ * Adds the files matching a path or wildcard pattern to a list.
+ * Patterns the shell already expanded pass through unchanged; quoted ones are
+ * expanded here. A pattern that matches nothing is kept as it is, so the
+ * missing file is reported when it fails to load.
+ * @param pattern the path or pattern
+ * @param files   the list to add to
+ * @return nothing
+ */
+void expand_input(const string& pattern, vector<string>& files)
+{
+#if defined(__unix__) || defined(__APPLE__)
+    glob_t matches;
+    if (pattern.find_first_of("*?[") != string::npos && glob(pattern.c_str(), 0, nullptr, &matches) == 0)
+    {
+        for (size_t i = 0; i < matches.gl_pathc; i++)
+        {
+            files.push_back(matches.gl_pathv[i]);
+        }
+        globfree(&matches);
+        return;
+    }
+#endif
+    files.push_back(pattern);
+}
+
+/**
+ * Adds the files listed in a manifest, one path or pattern per line.
+ * Blank lines and lines starting with # are skipped.
+ * @param manifest the manifest filename
+ * @param files    the list to add to
+ * @return true if the manifest could be read
+ */
+bool read_manifest(const string& manifest, vector<string>& files)
+{
+    fstream stream;
+    stream.open(manifest, ios::in);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+
+    string line;
+    while (getline(stream, line))
+    {
+        // Trim surrounding whitespace, including the \r of Windows line endings
+        size_t first = line.find_first_not_of(" \t\r");
+        size_t last = line.find_last_not_of(" \t\r");
+        if (first == string::npos || line[first] == '#')
+        {
+            continue;
+        }
+        expand_input(line.substr(first, last - first + 1), files);
+    }
+    return true;
+}
+
+// Options of a batch run, parsed from the command line
+struct BatchOptions
+{
+    vector<string> inputs;
+    vector<FilterSpec> filters;
+    string output_pattern;
+    int jobs;               // Images being filtered at once
+    int io_threads;         // Threads starting reads, and the thread I/O backend's workers
+    bool mapped;            // Filter row-only chains between memory-mapped files
+    bool streamed;          // Filter row-only chains a chunk of rows at a time with stream_bmp()
+    IoBackend io_backend;
+    size_t io_budget;       // Bytes of inputs read ahead, and separately of outputs waiting to be written
+};
+
+/**
+ * Processes every input of a batch through a three-stage pipeline.
+ * Reader threads start asynchronous reads of the inputs (see AsyncFileIo),
+ * filter threads decode each file from memory and apply the chain (each
+ * filter also splits its rows across the shared pool), and the encoded
+ * results are handed back for asynchronous writing. Disk reads of the next
+ * files and writes of the previous ones overlap the filtering of the
+ * current one. Inputs read ahead and outputs not yet written each hold at
+ * most options.io_budget bytes; readers wait when the filters fall behind
+ * and filters wait when the disk does.
+ * When the whole chain fuses into one RowPipeline, 24-bit inputs are
+ * instead mapped into memory by the readers and filtered by the filter
+ * threads straight into a mapped output file, with no decoded copy in
+ * between; the encoder threads then only release the mapping. Such chains
+ * run through stream_bmp() instead, holding a few rows at a time, for every
+ * input with options.streamed and otherwise for inputs that are not mapped
+ * and would not fit in the read-ahead budget. Chains that end in an enlarge
+ * and point filters (see upscaled_tail()) never build the enlarged image:
+ * the filter thread writes it through an UpscaledView a chunk at a time.
+ * A crop at the start of a chain reads only the scan lines of its region.
+ * @param options the batch options
+ * @return the number of files that failed
+ */
+int run_batch(const BatchOptions& options)
+{
+    struct Job
+    {
+        int index;
+        Image image;                    // Set for an input decoded from the image cache
+        vector<unsigned char> contents; // Otherwise the file as read, decoded by the filter thread
+        size_t reserved;                // Bytes of the read-ahead budget this job holds
+        unique_ptr<MappedFile> input;   // Set instead of image for a mapped input
+        ConstImageView source;          // The input's pixels, inside the mapping
+        unique_ptr<MappedFile> output;  // The mapped output, once filtered; null if it could not be created
+        bool mapped;
+        bool streamed;                  // Filtered from file to file by stream_bmp(), with nothing read here
+        bool cropped;                   // image is only the region of the leading crop
+    };
+
+    RowPipeline fused;
+    bool fusable = fuse_filters(options.filters, fused);
+
+    // A chain ending in an enlarge and point filters stops before the enlarge; the rest
+    // happens as the output is written (see UpscaledView)
+    size_t enlarge = upscaled_tail(options.filters);
+    vector<FilterSpec> before_enlarge(options.filters.begin(), options.filters.begin() + enlarge);
+    bool crop_first = options.filters[0].process == PROCESS_CROP;
+    bool mapped = options.mapped && !options.streamed && fusable;
+
+    // The read-ahead budget bounds the inputs between the readers and the filters, so
+    // the queue itself never blocks; read callbacks push into it from an I/O thread
+    BoundedQueue<Job> decoded(options.inputs.size());
+    BoundedQueue<Job> filtered(options.jobs);
+    IoBudget read_ahead(options.io_budget);
+    IoBudget write_behind(options.io_budget);
+    AsyncFileIo io(options.io_backend, options.io_threads);
+    if (options.io_backend == IO_BACKEND_URING && string(io.backend_name()) != "io_uring")
+    {
+        cerr << "io_uring is not available; using I/O threads" << endl;
+    }
+    atomic<int> next_input(0);
+
+    // Inputs listed more than once are decoded once and copied out of the cache
+    map<string, int> occurrences;
+    for (size_t i = 0; i < options.inputs.size(); i++)
+    {
+        occurrences[options.inputs[i]]++;
+    }
+    atomic<int> failures(0);
+    mutex report_mutex;
+
+    // Prints one line per file without interleaving
+    auto report = [&](int index, const string& message)
+    {
+        lock_guard<mutex> lock(report_mutex);
+        (message.empty() ? cout : cerr) << options.inputs[index] << ": "
+            << (message.empty() ? "saved as " + output_filename(options.output_pattern, options.inputs[index], index)
+                                : message) << endl;
+    };
+
+    vector<thread> readers;
+    for (int i = 0; i < options.io_threads; i++)
+    {
+        readers.push_back(thread([&]
+        {
+            for (int index = next_input++; index < (int)options.inputs.size(); index = next_input++)
+            {
+                TraceScope scope("batch_read", "decode");
+                const string& path = options.inputs[index];
+                FileKey key;
+                size_t size = file_key(path, key) ? (size_t)key.size : 0;
+
+                // Mapped and streamed inputs are written while they are read, so not over themselves
+                bool single = occurrences.at(path) == 1 &&
+                              !same_file(path, output_filename(options.output_pattern, path, index));
+                bool streamed = options.streamed && fusable && single;
+
+                Job job;
+                job.index = index;
+                job.reserved = streamed ? 0 : size;
+                job.mapped = false;
+                job.streamed = false;
+                job.cropped = false;
+                read_ahead.acquire(job.reserved);
+                if (mapped && single)
+                {
+                    job.input.reset(new MappedFile());
+                    job.mapped = job.input->open(path) && map_bmp(*job.input, job.source);
+                    if (job.mapped)
+                    {
+                        decoded.push(move(job));
+                        continue;
+                    }
+                    job.input.reset();
+                }
+
+                // Rather than reading a file bigger than the whole budget, filter it a chunk at a time
+                if (streamed || (fusable && single && size > options.io_budget))
+                {
+                    read_ahead.release(job.reserved);
+                    job.reserved = 0;
+                    job.streamed = true;
+                    decoded.push(move(job));
+                    continue;
+                }
+
+                // A leading crop reads only the scan lines it keeps. An empty result is either an
+                // unreadable file or a region outside the image; the full read below tells which.
+                if (crop_first)
+                {
+                    job.image = read_bmp_region(path, options.filters[0].region);
+                    if (!job.image.empty())
+                    {
+                        job.cropped = true;
+                        decoded.push(move(job));
+                        continue;
+                    }
+                }
+                if (occurrences.at(path) > 1)
+                {
+                    job.image = copy_image(*image_cache().load(path));
+                    decoded.push(move(job));
+                    continue;
+                }
+
+                // The contents come back on an I/O thread; the filter threads decode them
+                io.read(path, [&, index, size](vector<unsigned char>& contents, int error)
+                {
+                    Job read_job;
+                    read_job.index = index;
+                    read_job.reserved = size;
+                    read_job.mapped = false;
+                    read_job.streamed = false;
+                    read_job.cropped = false;
+                    if (!error)
+                    {
+                        read_job.contents = move(contents);
+                    }
+                    decoded.push(move(read_job));
+                });
+            }
+        }));
+    }
+
+    vector<thread> filterers;
+    for (int i = 0; i < options.jobs; i++)
+    {
+        filterers.push_back(thread([&]
+        {
+            Job job;
+            while (decoded.pop(job))
+            {
+                // A job too large for memory fails alone instead of ending the batch
+                try
+                {
+                    TraceScope scope("batch_filter", "filter");
+                    if (job.streamed)
+                    {
+                        string out_filename = output_filename(options.output_pattern, options.inputs[job.index], job.index);
+                        if (stream_bmp(options.inputs[job.index], out_filename, fused))
+                        {
+                            report(job.index, "");
+                        }
+                        else
+                        {
+                            report(job.index, "not a readable BMP image, or could not write " + out_filename);
+                            failures++;
+                        }
+                        continue;
+                    }
+                    if (job.mapped)
+                    {
+                        ImageView view;
+                        job.output.reset(new MappedFile());
+                        string out_filename = output_filename(options.output_pattern, options.inputs[job.index], job.index);
+                        if (create_bmp(*job.output, out_filename, job.source.width, job.source.height, view))
+                        {
+                            fused.run(job.source, view);
+                        }
+                        else
+                        {
+                            job.output.reset();
+                        }
+                        job.input.reset();
+                        read_ahead.release(job.reserved);
+                        job.reserved = 0;
+                        filtered.push(move(job));
+                        continue;
+                    }
+
+                    if (job.image.empty())
+                    {
+                        TraceScope decode_scope("decode_bmp", "decode");
+                        job.image = job.contents.empty() ? Image() : decode_bmp(&job.contents[0], job.contents.size());
+                        decode_scope.set_pixels((unsigned long long)job.image.width * job.image.height);
+                        io.recycle(move(job.contents));
+                    }
+                    read_ahead.release(job.reserved);
+                    job.reserved = 0;
+                    if (job.image.empty())
+                    {
+                        report(job.index, "not a readable BMP image");
+                        failures++;
+                        continue;
+                    }
+                    // Inputs read as the region of a leading crop skip it
+                    size_t first = job.cropped ? 1 : 0;
+                    int width = job.image.width;
+                    int height = job.image.height;
+                    if (!chain_output_size(width, height, vector<FilterSpec>(options.filters.begin() + first,
+                                                                             options.filters.end())))
+                    {
+                        image_pool().recycle(move(job.image));
+                        report(job.index, "the result would be too large for a BMP file");
+                        failures++;
+                        continue;
+                    }
+                    if (enlarge < options.filters.size())
+                    {
+                        // Written from here, a chunk of rows at a time, since the file can be far larger
+                        // than the budget for outputs waiting to be written
+                        apply_filters(job.image, vector<FilterSpec>(before_enlarge.begin() + first, before_enlarge.end()));
+                        if (job.image.empty())
+                        {
+                            report(job.index, "the crop region lies outside the image");
+                            failures++;
+                            continue;
+                        }
+                        UpscaledView view(job.image.view(), options.filters[enlarge].number,
+                                          options.filters[enlarge].y_scale);
+                        ImageStats none;
+                        for (size_t i = enlarge + 1; i < options.filters.size(); i++)
+                        {
+                            add_point_filter(view, options.filters[i], none);
+                        }
+                        string out_filename = output_filename(options.output_pattern, options.inputs[job.index], job.index);
+                        bool saved = write_bmp(out_filename, view);
+                        image_pool().recycle(move(job.image));
+                        if (saved)
+                        {
+                            report(job.index, "");
+                        }
+                        else
+                        {
+                            report(job.index, "could not write " + out_filename);
+                            failures++;
+                        }
+                        continue;
+                    }
+                    apply_filters(job.image, vector<FilterSpec>(options.filters.begin() + first, options.filters.end()));
+                    if (job.image.empty())
+                    {
+                        report(job.index, "the crop region lies outside the image");
+                        failures++;
+                        continue;
+                    }
+
+                    vector<unsigned char> encoded;
+                    {
+                        TraceScope encode_scope("batch_encode", "encode", (unsigned long long)job.image.width * job.image.height);
+                        encoded = io.buffer(bmp_file_size(job.image.width, job.image.height));
+                        encode_bmp(job.image.view(), &encoded[0]);
+                        image_pool().recycle(move(job.image));
+                    }
+                    size_t size = encoded.size();
+                    string out_filename = output_filename(options.output_pattern, options.inputs[job.index], job.index);
+                    int index = job.index;
+                    write_behind.acquire(size);
+                    io.write(out_filename, move(encoded), [&, index, size, out_filename](int error)
+                    {
+                        write_behind.release(size);
+                        if (error)
+                        {
+                            report(index, "could not write " + out_filename);
+                            failures++;
+                        }
+                        else
+                        {
+                            report(index, "");
+                        }
+                    });
+
+                }
+                catch (const bad_alloc&)
+                {
+                    read_ahead.release(job.reserved);
+                    job.reserved = 0;
+                    report(job.index, "not enough memory");
+                    failures++;
+                }
+            }
+        }));
+    }
+
+    vector<thread> encoders;
+    for (int i = 0; i < options.io_threads && mapped; i++)
+    {
+        encoders.push_back(thread([&]
+        {
+            Job job;
+            while (filtered.pop(job))
+            {
+                TraceScope scope("batch_encode", "encode");
+                bool saved = job.output != nullptr;
+                job.output.reset();
+                if (saved)
+                {
+                    report(job.index, "");
+                }
+                else
+                {
+                    report(job.index, "could not write " + output_filename(options.output_pattern, options.inputs[job.index], job.index));
+                    failures++;
+                }
+            }
+        }));
+    }
+
+    // Close each queue once everything feeding it has finished; the reads
+    // started by the readers finish on their own, so wait for those too
+    for (size_t i = 0; i < readers.size(); i++)
+    {
+        readers[i].join();
+    }
+    io.drain();
+    decoded.close();
+    for (size_t i = 0; i < filterers.size(); i++)
+    {
+        filterers[i].join();
+    }
+    filtered.close();
+    for (size_t i = 0; i < encoders.size(); i++)
+    {
+        encoders[i].join();
+    }
+    io.drain();
+    return failures;
+}
+
+// Prints the command-line usage of batch mode
+void print_batch_usage(const char* program)
+{
+    cout << "Usage: " << program << " [options] input.bmp... \n";
+    cout << "       " << program << "              (no arguments: interactive menu) \n";
+    cout << endl;
+    cout << "Options: \n";
+    cout << "  -f, --filter NAME[:VALUE...]  Add a filter to the chain (repeatable): \n";
+    cout << "                                vignette, clarendon:FACTOR, grayscale, rotate90, \n";
+    cout << "                                rotate:TURNS, enlarge:X[:Y], high-contrast, \n";
+    cout << "                                lighten:FACTOR, darken:FACTOR, dominance, \n";
+    cout << "                                resize:W:H[:box|bilinear|bicubic|lanczos], crop:X:Y:W:H, \n";
+    cout << "                                blur:SIGMA, box-blur:RADIUS, sharpen:AMOUNT, edges \n";
+    cout << "                                clarendon:FACTOR:otsu, clarendon:FACTOR:DARK%:BRIGHT%, \n";
+    cout << "                                high-contrast:otsu and high-contrast:PERCENT choose \n";
+    cout << "                                their thresholds from each image's histogram \n";
+    cout << "                                Append :clamp, :reflect, :wrap or :zero to the last \n";
+    cout << "                                four to choose how they treat the image border \n";
+    cout << "                                Append :fixed to vignette, clarendon, lighten or \n";
+    cout << "                                darken for integer arithmetic (within one level) \n";
+    cout << "  -o, --output PATTERN          Output filename; {dir}, {name} and {index} are \n";
+    cout << "                                replaced per input (default {dir}/{name}_out.bmp) \n";
+    cout << "  -m, --manifest FILE           Read input paths or patterns from FILE, one per line \n";
+    cout << "  -j, --jobs N                  Images filtered at once (default 2) \n";
+    cout << "      --io-threads N            Threads starting reads, and I/O workers when \n";
+    cout << "                                io_uring is not used (default 2) \n";
+    cout << "      --io BACKEND              uring or threads; by default io_uring where the \n";
+    cout << "                                kernel allows it and threads otherwise \n";
+    cout << "      --io-mb MB                Megabytes of inputs read ahead, and of outputs \n";
+    cout << "                                waiting to be written (default 256 each) \n";
+    cout << "  -t, --threads N               Threads per filter (default: one per core) \n";
+    cout << "      --pool-cap MB             Megabytes of image buffers kept for reuse (default 512) \n";
+    cout << "      --pool-stats              Print image pool counters when the batch ends \n";
+    cout << "      --cache-mb MB             Megabytes of decoded inputs kept for inputs listed \n";
+    cout << "                                more than once (default 256) \n";
+    cout << "      --no-mmap                 Decode and encode every image instead of filtering \n";
+    cout << "                                point-filter chains between memory-mapped files \n";
+    cout << "      --stream                  Filter chains of point filters and vignettes a few \n";
+    cout << "                                rows at a time, so inputs larger than memory work; \n";
+    cout << "                                done anyway for unmapped inputs over --io-mb \n";
+    cout << "      --trace FILE              Time every decode, filter and encode; write a Chrome \n";
+    cout << "                                trace (chrome://tracing) to FILE and a summary table \n";
+    cout << "                                to stderr \n";
+    cout << "  -h, --help                    Show this help \n";
+    cout << endl;
+    cout << "Other modes: \n";
+    cout << "  " << program << " --benchmark [options] \n";
+    cout << "                                Time the BMP I/O and every filter on synthetic images \n";
+    cout << "      --sizes MP[,MP...]        Image sizes in megapixels (default 1,4,16,100) \n";
+    cout << "      --runs N                  Runs per measurement (default 5) \n";
+    cout << "      --json FILE               Write the results as JSON to FILE instead of after \n";
+    cout << "                                the table \n";
+    cout << "      --skip-legacy-io          Skip read_image() and write_image(), which take \n";
+    cout << "                                minutes at 100 MP \n";
+    cout << "      --threads N               Threads per filter (default: one per core) \n";
+    cout << "      --trace FILE              As for batch mode \n";
+    cout << "  " << program << " --self-test \n";
+    cout << "                                Check that every filter gives the same bytes at each \n";
+    cout << "                                instruction set and thread count, and that the fast \n";
+    cout << "                                paths match the filters they replace; exits with 1 \n";
+    cout << "                                if any check fails \n";
+}
+
+/**
+ * Parses the command line and runs a batch
+ * @param argc the argument count
+ * @param argv the arguments
+ * @return the process exit status
+ */
+int batch_main(int argc, char* argv[])
+{
+    BatchOptions options;
+    options.output_pattern = "{dir}/{name}_out.bmp";
+    options.jobs = 2;
+    options.io_threads = 2;
+    options.mapped = true;
+    options.streamed = false;
+    options.io_backend = IO_BACKEND_AUTO;
+    options.io_budget = (size_t)256 << 20;
+    bool pool_stats = false;
+    string trace_filename;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (arg == "-h" || arg == "--help")
+        {
+            print_batch_usage(argv[0]);
+            return 0;
+        }
+        else if ((arg == "-f" || arg == "--filter") && has_value)
+        {
+            FilterSpec spec;
+            if (!parse_filter_spec(argv[++i], spec))
+            {
+                cerr << "Invalid filter: " << argv[i] << endl;
+                return 2;
+            }
+            options.filters.push_back(spec);
+        }
+        else if ((arg == "-o" || arg == "--output") && has_value)
+        {
+            options.output_pattern = argv[++i];
+        }
+        else if ((arg == "-m" || arg == "--manifest") && has_value)
+        {
+            if (!read_manifest(argv[++i], options.inputs))
+            {
+                cerr << "Could not read manifest: " << argv[i] << endl;
+                return 2;
+            }
+        }
+        else if ((arg == "-j" || arg == "--jobs" || arg == "--io-threads" || arg == "-t" || arg == "--threads") &&
+                 has_value)
+        {
+            char* end = nullptr;
+            long value = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || value < 1)
+            {
+                cerr << "Expected a positive number after " << arg << endl;
+                return 2;
+            }
+            if (arg == "-j" || arg == "--jobs")
+            {
+                options.jobs = value;
+            }
+            else if (arg == "--io-threads")
+            {
+                options.io_threads = value;
+            }
+            else
+            {
+                set_thread_count(value);
+            }
+        }
+        else if (arg == "--pool-cap" && has_value)
+        {
+            char* end = nullptr;
+            double megabytes = strtod(argv[++i], &end);
+            if (*end != '\0' || megabytes < 0)
+            {
+                cerr << "Expected a size in megabytes after " << arg << endl;
+                return 2;
+            }
+            image_pool().set_capacity((size_t)(megabytes * (1 << 20)));
+        }
+        else if (arg == "--io" && has_value)
+        {
+            string backend = argv[++i];
+            if (backend != "uring" && backend != "threads")
+            {
+                cerr << "Expected uring or threads after " << arg << endl;
+                return 2;
+            }
+            options.io_backend = backend == "uring" ? IO_BACKEND_URING : IO_BACKEND_THREADS;
+        }
+        else if (arg == "--io-mb" && has_value)
+        {
+            char* end = nullptr;
+            double megabytes = strtod(argv[++i], &end);
+            if (*end != '\0' || megabytes < 0)
+            {
+                cerr << "Expected a size in megabytes after " << arg << endl;
+                return 2;
+            }
+            options.io_budget = (size_t)(megabytes * (1 << 20));
+        }
+        else if (arg == "--cache-mb" && has_value)
+        {
+            char* end = nullptr;
+            double megabytes = strtod(argv[++i], &end);
+            if (*end != '\0' || megabytes < 0)
+            {
+                cerr << "Expected a size in megabytes after " << arg << endl;
+                return 2;
+            }
+            image_cache().set_budget((size_t)(megabytes * (1 << 20)));
+        }
+        else if (arg == "--pool-stats")
+        {
+            pool_stats = true;
+        }
+        else if (arg == "--no-mmap")
+        {
+            options.mapped = false;
+        }
+        else if (arg == "--stream")
+        {
+            options.streamed = true;
+        }
+        else if (arg == "--trace" && has_value)
+        {
+            trace_filename = argv[++i];
+        }
+        else if (!arg.empty() && arg[0] == '-')
+        {
+            cerr << "Unknown option or missing value: " << arg << endl;
+            print_batch_usage(argv[0]);
+            return 2;
+        }
+        else
+        {
+            expand_input(arg, options.inputs);
+        }
+    }
+
+    if (options.inputs.empty() || options.filters.empty())
+    {
+        cerr << "Batch mode needs at least one input and one --filter" << endl;
+        print_batch_usage(argv[0]);
+        return 2;
+    }
 
-    
-    // Loop over each pixel in the original image
-    for (int row = 0; row < num_rows; row++)
+    if (!trace_filename.empty())
     {
-        
-        for (int col = 0; col < num_columns; col++)
+        tracer().start();
+    }
+    int failures = run_batch(options);
+    if (!trace_filename.empty())
+    {
+        tracer().stop();
+        if (!write_trace(trace_filename))
         {
-            // Assign the pixel from (row, col) in the original image to (col, num_rows - 1 - row) in the new image
-            // This achieves a 90-degree clockwise rotation
-            new_image[col][num_rows - 1 - row] = image[row][col];
+            cerr << "Could not write " << trace_filename << endl;
         }
     }
-    
-    // Return the rotated image
-    return new_image;
+    cout << options.inputs.size() - failures << " of " << options.inputs.size() << " images processed" << endl;
+    if (pool_stats)
+    {
+        ImagePoolStats stats = image_pool().stats();
+        cout << "Image pool: " << stats.hits << " hits, " << stats.misses << " misses, "
+             << stats.evictions << " evictions, " << stats.buffers_retained << " buffers ("
+             << stats.bytes_retained << " bytes) retained" << endl;
+    }
+    return failures == 0 ? 0 : 1;
 }
 
 
 //*****************************************
-//     PROCESS 5
+//     BENCHMARK
 //*****************************************
 
-// Function to rotate an image by 90-degree increments based on the input number
-vector<vector<Pixel>> process_5(const vector<vector<Pixel>>& image, int number)
+/**
+ * Creates a deterministic test image: a diagonal color gradient with noise,
+ * so the branching filters see bright, dark and mid-range pixels
+ * @param width  the width in pixels
+ * @param height the height in pixels
+ * @return the image
+ */
+Image synthetic_image(int width, int height)
 {
-    // Calculate the rotation angle as a multiple of 90 degrees
-    int angle = number * 90;
-
-    // Check if the angle is not a multiple of 90 (invalid input)    
-    if (angle % 90 != 0)
+    Image image(width, height);
+    parallel_rows(height, width, [&](int first_row, int last_row)
     {
-        // Inform the user of invalid input
-        cout << "angle must be a multiple of 90 degrees." << endl;
+        for (int row = first_row; row < last_row; row++)
+        {
+            unsigned int seed = 2654435761u * (row + 1);
+            unsigned char* out = image.row(row);
+            for (int col = 0; col < width; col++)
+            {
+                seed = seed * 1103515245 + 12345;
+                int noise = (seed >> 16) % 64 - 32;
+                int base = (int)(255.0 * (row + col) / (width + height));
+                out[3 * col + 0] = (unsigned char)max(0, min(255, base + noise));
+                out[3 * col + 1] = (unsigned char)max(0, min(255, 255 - base + noise));
+                out[3 * col + 2] = (unsigned char)(base * 3 + (seed >> 24));
+            }
+        }
+    });
+    return image;
+}
 
-        // Return the original image unmodified
-        return image; // Return unmodified image on error
-    }
+// Timings of one operation at one image size
+struct BenchmarkResult
+{
+    string operation;
+    int width;
+    int height;
+    vector<double> seconds;            // One entry per run
+    unsigned long long bytes;          // Heap bytes allocated by the last run
 
-    // If angle is a full rotation (0 or 360, 720, etc.), return image unchanged
-    else if (angle % 360 == 0)
+    double megapixels() const
     {
-        return image;
+        return (double)width * height / 1e6;
     }
 
-    // If angle is 90 degrees, rotate once
-    else if (angle % 360 == 90)
+    double mean() const
     {
-        return process_4(image);
+        double sum = 0;
+        for (size_t i = 0; i < seconds.size(); i++)
+        {
+            sum += seconds[i];
+        }
+        return sum / seconds.size();
     }
 
-    // If angle is 180 degrees, rotate twice
-    else if (angle % 360 == 180)
+    // Sample standard deviation; zero for a single run
+    double stddev() const
     {
-        return process_4(process_4(image));
+        if (seconds.size() < 2)
+        {
+            return 0;
+        }
+        double average = mean();
+        double sum = 0;
+        for (size_t i = 0; i < seconds.size(); i++)
+        {
+            sum += (seconds[i] - average) * (seconds[i] - average);
+        }
+        return sqrt(sum / (seconds.size() - 1));
     }
+};
+
+/**
+ * Times an operation over several runs, counting the heap bytes of the last one
+ * @param operation the name to report
+ * @param image     the image size to report
+ * @param runs      the number of timed runs
+ * @param body      the operation
+ * @return the timings
+ */
+BenchmarkResult time_operation(const string& operation, const Image& image, int runs, const function<void()>& body)
+{
+    BenchmarkResult result;
+    result.operation = operation;
+    result.width = image.width;
+    result.height = image.height;
+    result.bytes = 0;
 
-    // If angle is 270 degrees, rotate three times
-    else
+    for (int run = 0; run < runs; run++)
     {
-        return process_4(process_4(process_4(image)));
+        allocated_bytes = 0;
+        counting_allocations = true;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        body();
+        chrono::steady_clock::time_point stop = chrono::steady_clock::now();
+        counting_allocations = false;
+
+        result.seconds.push_back(chrono::duration<double>(stop - start).count());
+        result.bytes = allocated_bytes;
     }
+    return result;
 }
 
-
-//*****************************************
-//     PROCESS 6
-//*****************************************
-
-// Function to scale an image by repeating pixels based on x and y scaling factors
-vector<vector<Pixel>> process_6(const vector<vector<Pixel>>& image, int x_scale, int y_scale)
+// Name of the active SIMD level for reports
+const char* simd_level_name()
 {
-    
-    // Get the number of rows (height) in the original image
-    int num_rows = image.size();
-    
-    // Get the number of columns (width) in the original image
-    int num_columns = image[0].size();
-    
-    // Calculate the new height of the image after vertical scaling
-    int new_rows = y_scale * num_rows;
-    
-    // Calculate the new width of the image after horizontal scaling
-    int new_columns = x_scale * num_columns;
-
-    
-    // Create a new image with the scaled dimensions, filled with default Pixel values
-    vector<vector<Pixel>> new_image(new_rows, vector<Pixel>(new_columns));
-
-    // Loop over each pixel in the new (scaled) image
-    for (int row = 0; row < new_rows; row++)
+    switch (active_simd_level)
     {
-        for (int col = 0; col < new_columns; col++)
-        {
-            // Determine the corresponding row in the original image
-            int source_row = (row / y_scale);
-            
-            // Determine the corresponding column in the original image
-            int source_col = (col / x_scale);
-            
-            // Copy the pixel from the original image to the scaled image
-            new_image[row][col] = image[source_row][source_col];
-        }
+        case SIMD_AVX2:  return "avx2";
+        case SIMD_SSSE3: return "ssse3";
+        default:         return "scalar";
     }
-
-    // Return the scaled image
-    return new_image;
 }
 
-  
-
-//*****************************************
-//     PROCESS 7
-//*****************************************
+/**
+ * Writes benchmark results as JSON
+ * @param stream  the stream to write to
+ * @param results the results
+ * @param runs    the number of runs per operation
+ * @return nothing
+ */
+void write_benchmark_json(ostream& stream, const vector<BenchmarkResult>& results, int runs)
+{
+    stream << "{\n";
+    stream << "  \"threads\": " << thread_pool().size() << ",\n";
+    stream << "  \"simd\": \"" << simd_level_name() << "\",\n";
+    stream << "  \"runs\": " << runs << ",\n";
+    stream << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchmarkResult& result = results[i];
+        double mean = result.mean();
+        stream << "    {\"operation\": \"" << result.operation << "\""
+               << ", \"width\": " << result.width
+               << ", \"height\": " << result.height
+               << ", \"megapixels\": " << result.megapixels()
+               << ", \"mean_seconds\": " << mean
+               << ", \"min_seconds\": " << *min_element(result.seconds.begin(), result.seconds.end())
+               << ", \"max_seconds\": " << *max_element(result.seconds.begin(), result.seconds.end())
+               << ", \"stddev_seconds\": " << result.stddev()
+               << ", \"megapixels_per_second\": " << result.megapixels() / mean
+               << ", \"allocated_bytes_per_pixel\": " << (double)result.bytes / (result.megapixels() * 1e6)
+               << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    stream << "  ]\n";
+    stream << "}\n";
+}
 
-// Function to apply a black-and-white threshold filter to an image
-vector<vector<Pixel>> process_7(const vector<vector<Pixel>>& image) 
+/**
+ * Parses the command line and benchmarks the BMP I/O and every process_N.
+ * Options: --sizes MP[,MP...] (default 1,4,16,100), --runs N (default 5),
+ * --json FILE (default: print JSON after the table), --skip-legacy-io
+ * (read_image() and write_image() take minutes at 100 MP), --threads N and
+ * --trace FILE (see write_trace()).
+ * @param argc the argument count
+ * @param argv the arguments, starting with --benchmark
+ * @return the process exit status
+ */
+int benchmark_main(int argc, char* argv[])
 {
-    // Get the number of rows (height) in the original image
-    int num_rows = image.size();
-    
-    // Get the number of columns (width) in the original image
-    int num_columns = image[0].size();
-    
-    // Create a new image of the same dimensions to store the output
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel>(num_columns));
+    vector<double> sizes;
+    int runs = 5;
+    string json_filename;
+    bool legacy_io = true;
+    string trace_filename;
 
-    // Loop through each row of the image
-    for (int row = 0; row < num_rows; row++)
+    for (int i = 2; i < argc; i++)
     {
-        // Loop through each column of the image
-        for (int col = 0; col < num_columns; col++)
+        string arg = argv[i];
+        if (arg == "--sizes" && i + 1 < argc)
         {
-            
-            // Get the red, green, and blue values of the current pixel
-            int red_value = image[row][col].red;
-            int green_value = image[row][col].green;
-            int blue_value = image[row][col].blue;
-
-            
-            // Calculate the average of the color values to get a grayscale value
-            int gray_value = (red_value + green_value + blue_value) / 3;
-
-            
-            int new_red;
-            int new_green;
-            int new_blue;
-
-            // If the grayscale value is 128 or more, set the pixel to white
-            if (gray_value >= 255 / 2)
-            {
-                new_red = 255;
-                new_green = 255;
-                new_blue = 255;
-            }
-            
-            // Otherwise, set the pixel to black
-            else
+            string list = argv[++i];
+            for (size_t begin = 0; begin <= list.size(); )
             {
-                new_red = 0;
-                new_green = 0;
-                new_blue = 0;
+                size_t end = min(list.find(',', begin), list.size());
+                double size = atof(list.substr(begin, end - begin).c_str());
+                if (size <= 0)
+                {
+                    cerr << "Invalid size list: " << list << endl;
+                    return 2;
+                }
+                sizes.push_back(size);
+                begin = end + 1;
             }
-
-            // Create a new Pixel object with the updated color values
-            Pixel new_pixel;
-            new_pixel.red = new_red;
-            new_pixel.green = new_green;
-            new_pixel.blue = new_blue;
-
-            // Assign the new pixel to the corresponding position in the output image
-            new_image[row][col] = new_pixel;
         }
+        else if (arg == "--runs" && i + 1 < argc)
+        {
+            runs = max(atoi(argv[++i]), 1);
+        }
+        else if (arg == "--json" && i + 1 < argc)
+        {
+            json_filename = argv[++i];
+        }
+        else if (arg == "--threads" && i + 1 < argc)
+        {
+            set_thread_count(atoi(argv[++i]));
+        }
+        else if (arg == "--skip-legacy-io")
+        {
+            legacy_io = false;
+        }
+        else if (arg == "--trace" && i + 1 < argc)
+        {
+            trace_filename = argv[++i];
+        }
+        else
+        {
+            cerr << "Usage: " << argv[0] << " --benchmark [--sizes MP,...] [--runs N] [--json FILE]"
+                 << " [--skip-legacy-io] [--threads N] [--trace FILE]" << endl;
+            return 2;
+        }
+    }
+    if (sizes.empty())
+    {
+        sizes.push_back(1);
+        sizes.push_back(4);
+        sizes.push_back(16);
+        sizes.push_back(100);
     }
 
-    // Return the processed black-and-white image
-    return new_image;
-}
+    const string temp_filename = "benchmark_tmp.bmp";
+    vector<BenchmarkResult> results;
+    if (!trace_filename.empty())
+    {
+        tracer().start();
+    }
+    for (size_t s = 0; s < sizes.size(); s++)
+    {
+        // 4:3 images of about the requested number of megapixels
+        int width = max(1, (int)lround(sqrt(sizes[s] * 1e6 * 4 / 3)));
+        int height = max(1, (int)lround(sizes[s] * 1e6 / width));
+        Image image = synthetic_image(width, height);
+        cerr << "Benchmarking " << width << "x" << height << "..." << endl;
 
+        results.push_back(time_operation("write_bmp", image, runs, [&] { write_bmp(temp_filename, image); }));
+        results.push_back(time_operation("read_bmp", image, runs, [&] { read_bmp(temp_filename); }));
+        if (legacy_io)
+        {
+            // The legacy functions cannot carry probes of their own, so they are traced from here
+            vector<vector<Pixel>> pixels = to_pixels(image);
+            unsigned long long count = (unsigned long long)width * height;
+            results.push_back(time_operation("write_image", image, runs, [&]
+            {
+                TraceScope scope("write_image", "encode", count);
+                write_image(temp_filename, pixels);
+                trace_bytes_written(bmp_file_size(width, height));
+            }));
+            results.push_back(time_operation("read_image", image, runs, [&]
+            {
+                TraceScope scope("read_image", "decode", count);
+                read_image(temp_filename);
+                trace_bytes_read(bmp_file_size(width, height));
+            }));
+        }
+        remove(temp_filename.c_str());
 
-//*****************************************
-//     PROCESS 8
-//*****************************************
+        results.push_back(time_operation("process_1", image, runs, [&] { process_1(image); }));
+        results.push_back(time_operation("process_2", image, runs, [&] { process_2(image, 0.5); }));
+        results.push_back(time_operation("process_3", image, runs, [&] { process_3(image); }));
+        results.push_back(time_operation("process_4", image, runs, [&] { process_4(image); }));
+        results.push_back(time_operation("process_5", image, runs, [&] { process_5(image, 2); }));
+        results.push_back(time_operation("process_6", image, runs, [&] { process_6(image, 2, 2); }));
+        results.push_back(time_operation("process_7", image, runs, [&] { process_7(image); }));
+        results.push_back(time_operation("process_8", image, runs, [&] { process_8(image, 0.5); }));
+        results.push_back(time_operation("process_9", image, runs, [&] { process_9(image, 0.5); }));
+        results.push_back(time_operation("process_10", image, runs, [&] { process_10(image); }));
 
-// Function to brighten an image using a given scaling factor
-vector<vector<Pixel>> process_8(const vector<vector<Pixel>>& image, double scaling_factor) 
-{
-    
-    
-    // Get the number of rows (height) in the original image
-    int num_rows = image.size();
-    
-    // Get the number of columns (width) in the original image
-    int num_columns = image[0].size();     
+        // Fixed-point variants of the scaling filters
+        results.push_back(time_operation("process_1_fixed", image, runs, [&] { process_1(image, ARITHMETIC_FIXED_POINT); }));
+        results.push_back(time_operation("process_2_fixed", image, runs, [&] { process_2(image, 0.5, ARITHMETIC_FIXED_POINT); }));
+        results.push_back(time_operation("process_8_fixed", image, runs, [&] { process_8(image, 0.5, ARITHMETIC_FIXED_POINT); }));
+        results.push_back(time_operation("process_9_fixed", image, runs, [&] { process_9(image, 0.5, ARITHMETIC_FIXED_POINT); }));
 
-    // Initialize a new image with the same dimensions as the original
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel>(num_columns)); 
+        // Compiled presets for the settings above (see FILTER_PRESETS)
+        results.push_back(time_operation("process_2_preset", image, runs, [&] { run_preset(2, image, 0.5); }));
+        results.push_back(time_operation("process_7_preset", image, runs, [&] { run_preset(7, image); }));
+        results.push_back(time_operation("process_8_preset", image, runs, [&] { run_preset(8, image, 0.5); }));
+        results.push_back(time_operation("process_9_preset", image, runs, [&] { run_preset(9, image, 0.5); }));
 
-    
-    // Loop through each row in the image
-    for (int row = 0; row < num_rows; row++) 
-    {
-        // Loop through each column in the image
-        for (int col = 0; col < num_columns; col++) 
+        // A chain of channel-mixing filters on packed pixels and on planes
+        PointPipeline chain;
+        chain.add(POINT_GRAYSCALE).add(POINT_HIGH_CONTRAST).add(POINT_COLOR_DOMINANCE);
+        PlanarImage planar = to_planar(image.view());
+        results.push_back(time_operation("point_chain", image, runs, [&] { chain.run(image); }));
+        results.push_back(time_operation("point_chain_planar", image, runs, [&] { chain.run(planar); }));
+        results.push_back(time_operation("to_planar", image, runs, [&] { to_planar(image.view()); }));
+        results.push_back(time_operation("to_packed", image, runs, [&] { to_packed(planar); }));
+
+        // Incremental rendering of a three-stage chain: from scratch, after a change to the
+        // last stage, with nothing changed, and the preview alone
+        shared_ptr<const Image> shared_image(&image, [](const Image*) {});
+        vector<RenderStage> render_stages;
+        render_stages.push_back(point_stage(POINT_CLARENDON, 0.3));
+        render_stages.push_back(point_stage(POINT_GRAYSCALE));
+        render_stages.push_back(point_stage(POINT_LIGHTEN, 0.3));
+        IncrementalRenderer renderer;
+        renderer.set_source(shared_image);
+        results.push_back(time_operation("render_full", image, runs, [&]
         {
-            
-            // Extract the red, green, and blue color components from the current pixel
-            int red_value = image[row][col].red;
-            int green_value = image[row][col].green;
-            int blue_value = image[row][col].blue;
+            renderer.set_stages(vector<RenderStage>());
+            renderer.set_stages(render_stages);
+            renderer.render();
+        }));
+        results.push_back(time_operation("render_last_stage", image, runs, [&]
+        {
+            render_stages.back().scaling_factor = render_stages.back().scaling_factor == 0.3 ? 0.4 : 0.3;
+            renderer.set_stages(render_stages);
+            renderer.render();
+        }));
+        results.push_back(time_operation("render_unchanged", image, runs, [&] { renderer.render(); }));
+        results.push_back(time_operation("render_preview", image, runs, [&]
+        {
+            render_stages.back().scaling_factor = render_stages.back().scaling_factor == 0.3 ? 0.4 : 0.3;
+            renderer.set_stages(render_stages);
+            renderer.preview();
+        }));
 
-            
-            // Brighten each color channel using the formula: 255 - (255 - original) * factor
-            int new_red = 255 - (255 - red_value) * scaling_factor;
-            int new_green = 255 - (255 - green_value) * scaling_factor;
-            int new_blue = 255 - (255 - blue_value) * scaling_factor;
+        // Histograms and the filters whose thresholds come from them
+        results.push_back(time_operation("image_stats", image, runs, [&] { image_stats(image); }));
+        results.push_back(time_operation("process_2_otsu", image, runs, [&] { process_2_adaptive(image, 0.5, THRESHOLD_OTSU); }));
+        results.push_back(time_operation("process_7_otsu", image, runs, [&] { process_7_adaptive(image, THRESHOLD_OTSU); }));
 
-            // Create a new Pixel object and assign the updated color values
-            Pixel new_pixel;
-            new_pixel.red = new_red;
-            new_pixel.green = new_green;
-            new_pixel.blue = new_blue;
+        // Neighborhood filters
+        results.push_back(time_operation("gaussian_blur", image, runs, [&] { gaussian_blur(image, 2.0); }));
+        results.push_back(time_operation("box_blur", image, runs, [&] { box_blur(image, 8); }));
+        results.push_back(time_operation("sharpen", image, runs, [&] { sharpen(image, 1.0); }));
+        results.push_back(time_operation("detect_edges", image, runs, [&] { detect_edges(image); }));
+    }
 
-            // Store the new pixel in the corresponding position of the output image
-            new_image[row][col] = new_pixel;
+    if (!trace_filename.empty())
+    {
+        tracer().stop();
+        cerr << endl;
+        if (!write_trace(trace_filename))
+        {
+            cerr << "Could not write " << trace_filename << endl;
         }
     }
 
-    // Return the final brightened image
-    return new_image;
+    // Human-readable table on stderr keeps stdout clean for the JSON
+    cerr << endl << left << setw(16) << "operation" << right << setw(10) << "MP" << setw(12) << "MP/s"
+         << setw(12) << "mean ms" << setw(12) << "stddev ms" << setw(12) << "bytes/px" << endl;
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchmarkResult& result = results[i];
+        cerr << left << setw(16) << result.operation << right << fixed << setprecision(2)
+             << setw(10) << result.megapixels()
+             << setw(12) << result.megapixels() / result.mean()
+             << setw(12) << result.mean() * 1000
+             << setw(12) << result.stddev() * 1000
+             << setw(12) << (double)result.bytes / (result.megapixels() * 1e6) << endl;
+        cerr.unsetf(ios::fixed);
+    }
+
+    if (json_filename.empty())
+    {
+        write_benchmark_json(cout, results, runs);
+        return 0;
+    }
+    fstream stream;
+    stream.open(json_filename, ios::out);
+    if (!stream.is_open())
+    {
+        cerr << "Could not write " << json_filename << endl;
+        return 1;
+    }
+    write_benchmark_json(stream, results, runs);
+    return 0;
 }
 
 
 //*****************************************
-//     PROCESS 9
+//     SELF-TEST
 //*****************************************
 
-// Function to adjust the brightness or darkness of an image by scaling each pixel's color values
-vector<vector<Pixel>> process_9(const vector<vector<Pixel>>& image, double scaling_factor)
+// A filter checked by the self-test, and the function whose result it must reproduce
+struct SelfTestCase
 {
-    // Get the number of rows (height) of the original image
-    int num_rows = image.size();
-    
-    // Get the number of columns (width) of the original image
-    int num_columns = image[0].size();
+    string name;
+    function<Image(const Image&)> run;
+    function<Image(const Image&)> expected;
+};
 
-    
-    // Create a new image with the same dimensions as the original image
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel>(num_columns));
+// Adds a case whose expected result is its own result at the reference settings
+void add_case(vector<SelfTestCase>& cases, const string& name, const function<Image(const Image&)>& run)
+{
+    SelfTestCase test_case;
+    test_case.name = name;
+    test_case.run = run;
+    test_case.expected = run;
+    cases.push_back(test_case);
+}
+
+// Adds a case that must reproduce another function, such as a preset standing in for process_N
+void add_case(vector<SelfTestCase>& cases, const string& name, const function<Image(const Image&)>& run,
+              const function<Image(const Image&)>& expected)
+{
+    SelfTestCase test_case;
+    test_case.name = name;
+    test_case.run = run;
+    test_case.expected = expected;
+    cases.push_back(test_case);
+}
+
+/**
+ * The filters whose output must not depend on the instruction set or the
+ * thread count: every process_N in both arithmetic modes, and the presets,
+ * pipelines, planar layout, upscaled views and incremental renderer that
+ * must match the filters they replace
+ * @return the cases
+ */
+vector<SelfTestCase> self_test_cases()
+{
+    vector<SelfTestCase> cases;
+    const ArithmeticMode modes[] = { ARITHMETIC_EXACT, ARITHMETIC_FIXED_POINT };
+    const double factors[] = { 0.3, 0.5 };
+    for (int m = 0; m < 2; m++)
+    {
+        ArithmeticMode mode = modes[m];
+        string suffix = mode == ARITHMETIC_FIXED_POINT ? " fixed" : "";
+        add_case(cases, "process_1" + suffix, [=](const Image& image) { return process_1(image, mode); });
+        for (int f = 0; f < 2; f++)
+        {
+            double factor = factors[f];
+            string name = "(" + to_string(factor).substr(0, 3) + ")" + suffix;
+            add_case(cases, "process_2" + name, [=](const Image& image) { return process_2(image, factor, mode); });
+            add_case(cases, "process_8" + name, [=](const Image& image) { return process_8(image, factor, mode); });
+            add_case(cases, "process_9" + name, [=](const Image& image) { return process_9(image, factor, mode); });
+        }
+    }
+    add_case(cases, "process_3", [](const Image& image) { return process_3(image); });
+    add_case(cases, "process_4", [](const Image& image) { return process_4(image); });
+    add_case(cases, "process_5(3)", [](const Image& image) { return process_5(image, 3); });
+    add_case(cases, "process_6(2, 3)", [](const Image& image) { return process_6(image, 2, 3); });
+    add_case(cases, "process_10", [](const Image& image) { return process_10(image); });
+    const int thresholds[] = { -1, 0, 1, HIGH_CONTRAST_THRESHOLD, 255, 256 };
+    for (int t = 0; t < 6; t++)
+    {
+        int threshold = thresholds[t];
+        function<Image(const Image&)> high_contrast = [=](const Image& image) { return process_7(image, threshold); };
+        add_case(cases, "process_7(" + to_string(threshold) + ")", high_contrast);
+        add_case(cases, "process_7(" + to_string(threshold) + ") on planes", [=](const Image& image)
+        {
+            PointPipeline pipeline;
+            pipeline.add(POINT_HIGH_CONTRAST).set_thresholds(threshold);
+            PlanarImage planar = to_planar(image.view());
+            pipeline.run(planar);
+            return to_packed(planar);
+        }, high_contrast);
+    }
 
-    // Loop through each row of the original image
-    for (int row = 0; row < num_rows; row++) 
+    // Presets match process_N in either arithmetic mode
+    for (size_t i = 0; i < sizeof(FILTER_PRESETS) / sizeof(FILTER_PRESETS[0]); i++)
     {
-        // Loop through each column of the current row
-        for (int col = 0; col < num_columns; col++) 
+        const FilterPreset& preset = FILTER_PRESETS[i];
+        double factor = preset.factor / 256.0;
+        int process = preset.process;
+        function<Image(const Image&)> run = [=](const Image& image) { return run_preset(process, image, factor); };
+        for (int m = 0; m < 2; m++)
         {
-            // Retrieve the red, green, and blue values from the current pixel
-            int red_value = image[row][col].red;
-            int green_value = image[row][col].green;
-            int blue_value = image[row][col].blue;
+            ArithmeticMode mode = modes[m];
+            add_case(cases, string("preset ") + preset.name + (m ? " vs fixed" : ""), run,
+                     [=](const Image& image)
+                     {
+                         switch (process)
+                         {
+                             case 2:  return process_2(image, factor, mode);
+                             case 8:  return process_8(image, factor, mode);
+                             case 9:  return process_9(image, factor, mode);
+                             default: return process_7(image);
+                         }
+                     });
+        }
+    }
 
-            // Multiply each color value by the scaling factor
-            int new_red = red_value * scaling_factor;
-            int new_green = green_value * scaling_factor;
-            int new_blue = blue_value * scaling_factor;
+    // Pipelines, packed and planar, match the filters one after another
+    function<Image(const Image&)> chain = [](const Image& image)
+    {
+        return process_9(process_10(process_7(process_3(process_8(process_2(image, 0.3), 0.5)))), 0.3);
+    };
+    function<PointPipeline()> chain_pipeline = []()
+    {
+        PointPipeline pipeline;
+        pipeline.add(POINT_CLARENDON, 0.3).add(POINT_LIGHTEN, 0.5).add(POINT_GRAYSCALE)
+                .add(POINT_HIGH_CONTRAST).add(POINT_COLOR_DOMINANCE).add(POINT_DARKEN, 0.3);
+        return pipeline;
+    };
+    add_case(cases, "point pipeline", [=](const Image& image) { return chain_pipeline().run(image); }, chain);
+    add_case(cases, "point pipeline on planes", [=](const Image& image)
+    {
+        PlanarImage planar = to_planar(image.view());
+        chain_pipeline().run(planar);
+        return to_packed(planar);
+    }, chain);
+    add_case(cases, "planar round trip", [](const Image& image) { return to_packed(to_planar(image.view())); },
+             [](const Image& image) { return copy_image(image); });
 
-            // Clamp the red value between 0 and 255 to prevent overflow or underflow
-            if (new_red > 255) new_red = 255;
-            if (new_red < 0) new_red = 0;
+    // Upscaled views match process_6 followed by their point operations, built whole or written
+    // in chunks; at the largest size these scales leave a partial last chunk
+    const int scales[][2] = { { 3, 5 }, { 7, 3 } };
+    for (int k = 0; k < 2; k++)
+    {
+        int x_scale = scales[k][0];
+        int y_scale = scales[k][1];
+        string name = "(" + to_string(x_scale) + ", " + to_string(y_scale) + ")";
+        function<Image(const Image&)> enlarged = [=](const Image& image)
+        {
+            return process_9(process_2(process_6(image, x_scale, y_scale), 0.3), 0.5);
+        };
+        add_case(cases, "upscaled view " + name, [=](const Image& image)
+        {
+            UpscaledView view(image.view(), x_scale, y_scale);
+            view.add(POINT_CLARENDON, 0.3).add(POINT_DARKEN, 0.5);
+            return view.materialize();
+        }, enlarged);
+        add_case(cases, "upscaled view " + name + " written", [=](const Image& image)
+        {
+            const string temp_filename = "self_test_tmp.bmp";
+            UpscaledView view(image.view(), x_scale, y_scale);
+            view.add(POINT_CLARENDON, 0.3).add(POINT_DARKEN, 0.5);
+            Image written = write_bmp(temp_filename, view) ? read_bmp(temp_filename) : Image();
+            remove(temp_filename.c_str());
+            return written;
+        }, enlarged);
+    }
 
-            // Clamp the green value between 0 and 255
-            if (new_green > 255) new_green = 255;
-            if (new_green < 0) new_green = 0;
-            
-            // Clamp the blue value between 0 and 255
-            if (new_blue > 255) new_blue = 255;
-            if (new_blue < 0) new_blue = 0;
-
-            // Create a new pixel and assign the adjusted color values
-            Pixel new_pixel;
-            new_pixel.red = new_red;
-            new_pixel.green = new_green;
-            new_pixel.blue = new_blue;
-            
-            // Place the new pixel in the same position in the output image
-            new_image[row][col] = new_pixel;
+    // The incremental renderer, after a partial refine, a change to the last stage and an edit
+    // to part of the source, matches the stages run over the edited image
+    auto edit = [](Image& image)
+    {
+        Rect region = { image.width / 3, image.height / 3, max(image.width / 2, 1), max(image.height / 2, 1) };
+        clip_rect(region, image.width, image.height);
+        for (int row = region.y; row < region.y + region.height; row++)
+        {
+            unsigned char* pixels = image.row(row) + BYTES_PER_PIXEL * region.x;
+            for (int i = 0; i < BYTES_PER_PIXEL * region.width; i++)
+            {
+                pixels[i] = 255 - pixels[i];
+            }
         }
-    }
+        return region;
+    };
+    add_case(cases, "incremental renderer", [=](const Image& image)
+    {
+        shared_ptr<Image> source(new Image(copy_image(image)));
+        IncrementalRenderer renderer(8, 3);
+        renderer.set_source(source);
+        vector<RenderStage> stages;
+        stages.push_back(vignette_stage());
+        stages.push_back(point_stage(POINT_CLARENDON, 0.3));
+        stages.push_back(point_stage(POINT_DARKEN, 0.5));
+        renderer.set_stages(stages);
+        renderer.preview();
+        renderer.refine(2);
+        stages.back() = point_stage(POINT_LIGHTEN, 0.3);
+        renderer.set_stages(stages);
+        renderer.invalidate(edit(*source));
+        renderer.preview();
+        renderer.refine(1);
+        return copy_image(renderer.render());
+    }, [=](const Image& image)
+    {
+        Image edited = copy_image(image);
+        edit(edited);
+        return process_8(process_2(process_1(edited), 0.3), 0.3);
+    });
 
-    // Return the new image with brightness/darkness adjusted
-    return new_image;
+    // Neighbourhood filters and resampling
+    add_case(cases, "gaussian_blur", [](const Image& image) { return gaussian_blur(image, 1.5); });
+    add_case(cases, "box_blur", [](const Image& image) { return box_blur(image, 3); });
+    add_case(cases, "sharpen", [](const Image& image) { return sharpen(image, 1.0); });
+    add_case(cases, "detect_edges", [](const Image& image) { return detect_edges(image); });
+    add_case(cases, "resample bicubic", [](const Image& image)
+    {
+        return resample_image(image, image.width * 3 / 2 + 1, image.height / 2 + 1, RESAMPLE_BICUBIC);
+    });
+    return cases;
 }
 
+// true if both images have the same size and pixels
+bool same_pixels(const Image& a, const Image& b)
+{
+    if (a.width != b.width || a.height != b.height)
+    {
+        return false;
+    }
+    for (int row = 0; row < a.height; row++)
+    {
+        if (memcmp(a.row(row), b.row(row), (size_t)BYTES_PER_PIXEL * a.width) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
 
-//*****************************************
-//     PROCESS 10
-//*****************************************
+// The largest difference between matching channels of two images of the same size
+int max_difference(const Image& a, const Image& b)
+{
+    int largest = 0;
+    for (int row = 0; row < a.height; row++)
+    {
+        for (int i = 0; i < BYTES_PER_PIXEL * a.width; i++)
+        {
+            largest = max(largest, abs(a.row(row)[i] - b.row(row)[i]));
+        }
+    }
+    return largest;
+}
 
-// Function that transforms the image into a high-contrast, color-dominance-based version
-vector<vector<Pixel>> process_10(const vector<vector<Pixel>>& image) 
+/**
+ * Checks the guarantees the fast paths make: every filter gives the same
+ * bytes at every SIMD level and thread count as the scalar kernels on one
+ * thread, presets, pipelines and planes match the filters they replace, the
+ * fixed-point filters stay within one level of the exact ones, and the
+ * legacy vector<vector<Pixel>> signatures match the image ones. Widths are
+ * odd so the vector kernels always leave a remainder for the scalar tail.
+ * @param argc the argument count
+ * @param argv the arguments
+ * @return 0 if every check passed, 1 otherwise
+ */
+int self_test_main(int argc, char* argv[])
 {
-    // Get the number of rows (height) of the original image
-    int num_rows = image.size();
-    
-    // Get the number of columns (width) of the original image
-    int num_columns = image[0].size();
+    if (argc > 2)
+    {
+        cerr << "Usage: " << argv[0] << " --self-test" << endl;
+        return 2;
+    }
 
-    // Create a new image with the same dimensions as the original
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel>(num_columns));
+    const int SIZES[][2] = { { 1, 1 }, { 7, 5 }, { 33, 17 }, { 257, 31 }, { 1031, 257 } };
+    const SimdLevel LEVELS[] = { SIMD_SCALAR, SIMD_SSSE3, SIMD_AVX2 };
+    const int THREAD_COUNTS[] = { 1, 2, 3, 8 };
 
-    // Loop through each row of the image
-    for (int row = 0; row < num_rows; row++) 
+    vector<SelfTestCase> cases = self_test_cases();
+    int checks = 0;
+    int failures = 0;
+    auto check = [&](bool passed, const string& what)
     {
-        // Loop through each column in the current row
-        for (int col = 0; col < num_columns; col++) 
+        checks++;
+        if (!passed)
         {
-            // Get the red, green, and blue values of the current pixel
-            int red_value = image[row][col].red;
-            int green_value = image[row][col].green;
-            int blue_value = image[row][col].blue;
+            failures++;
+            cerr << "FAILED: " << what << endl;
+        }
+    };
 
-            // Initialize max_color with red and find the highest color value among R, G, B
-            int max_color = red_value;
-            if (green_value > max_color) {
-                max_color = green_value;
-            }
-            if (blue_value > max_color) {
-                max_color = blue_value;
-            }
+    for (size_t s = 0; s < sizeof(SIZES) / sizeof(SIZES[0]); s++)
+    {
+        Image image = synthetic_image(SIZES[s][0], SIZES[s][1]);
+        string size = to_string(image.width) + "x" + to_string(image.height);
+        cerr << "Checking " << size << "..." << endl;
 
-            // Variables to hold the new RGB values
-            int new_red;
-            int new_green;
-            int new_blue;
+        // Reference results: scalar kernels on one thread
+        set_simd_level(SIMD_SCALAR);
+        set_thread_count(1);
+        vector<Image> expected;
+        for (size_t i = 0; i < cases.size(); i++)
+        {
+            expected.push_back(cases[i].expected(image));
+        }
 
-            
-            // Apply color transformation based on brightness and color dominance
+        for (size_t l = 0; l < sizeof(LEVELS) / sizeof(LEVELS[0]) && LEVELS[l] <= detect_simd_level(); l++)
+        {
+            set_simd_level(LEVELS[l]);
+            for (size_t t = 0; t < sizeof(THREAD_COUNTS) / sizeof(THREAD_COUNTS[0]); t++)
+            {
+                set_thread_count(THREAD_COUNTS[t]);
+                string settings = " " + size + " " + simd_level_name() + " " + to_string(THREAD_COUNTS[t]) + " threads";
+                for (size_t i = 0; i < cases.size(); i++)
+                {
+                    check(same_pixels(cases[i].run(image), expected[i]), cases[i].name + settings);
+                }
 
-            // If the pixel is very bright, turn it white
-            if (red_value + green_value + blue_value >= 550) {
-                new_red = 255;
-                new_green = 255;
-                new_blue = 255;
-            }
-            
-            // If the pixel is very dark, turn it black
-            else if (red_value + green_value + blue_value <= 150) {
-                new_red = 0;
-                new_green = 0;
-                new_blue = 0;
-            }
-            
-            // If red is the dominant color, turn it pure red
-            else if (max_color == red_value) {
-                new_red = 255;
-                new_green = 0;
-                new_blue = 0;
-            }
-            
-            // If green is the dominant color, turn it pure green
-            else if (max_color == green_value) {
-                new_red = 0;
-                new_green = 255;
-                new_blue = 0;
+                // Fixed point stays within one level of exact
+                check(max_difference(process_1(image, ARITHMETIC_FIXED_POINT), process_1(image)) <= 1,
+                      "process_1 fixed-point error" + settings);
+                check(max_difference(process_2(image, 0.3, ARITHMETIC_FIXED_POINT), process_2(image, 0.3)) <= 1,
+                      "process_2 fixed-point error" + settings);
+                check(max_difference(process_8(image, 0.3, ARITHMETIC_FIXED_POINT), process_8(image, 0.3)) <= 1,
+                      "process_8 fixed-point error" + settings);
+                check(max_difference(process_9(image, 0.3, ARITHMETIC_FIXED_POINT), process_9(image, 0.3)) <= 1,
+                      "process_9 fixed-point error" + settings);
             }
-            
-            // Otherwise, turn it pure blue
-            else {
-                new_red = 0;
-                new_green = 0;
-                new_blue = 255;
-            }
-
-            // Create a new pixel with the transformed color values
-            Pixel new_pixel;
-            new_pixel.red = new_red;
-            new_pixel.green = new_green;
-            new_pixel.blue = new_blue;
-            
-            // Place the new pixel into the corresponding location in the new image
-            new_image[row][col] = new_pixel;
         }
+        set_simd_level(detect_simd_level());
+        set_thread_count(0);
+
+        // The legacy signatures
+        vector<vector<Pixel>> pixels = to_pixels(image);
+        check(same_pixels(to_image(process_1(pixels)), process_1(image)), "legacy process_1 " + size);
+        check(same_pixels(to_image(process_2(pixels, 0.3)), process_2(image, 0.3)), "legacy process_2 " + size);
+        check(same_pixels(to_image(process_3(pixels)), process_3(image)), "legacy process_3 " + size);
+        check(same_pixels(to_image(process_4(pixels)), process_4(image)), "legacy process_4 " + size);
+        check(same_pixels(to_image(process_5(pixels, 3)), process_5(image, 3)), "legacy process_5 " + size);
+        check(same_pixels(to_image(process_6(pixels, 2, 3)), process_6(image, 2, 3)), "legacy process_6 " + size);
+        check(same_pixels(to_image(process_7(pixels)), process_7(image)), "legacy process_7 " + size);
+        check(same_pixels(to_image(process_8(pixels, 0.3)), process_8(image, 0.3)), "legacy process_8 " + size);
+        check(same_pixels(to_image(process_9(pixels, 0.3)), process_9(image, 0.3)), "legacy process_9 " + size);
+        check(same_pixels(to_image(process_10(pixels)), process_10(image)), "legacy process_10 " + size);
     }
 
-    // Return the transformed image
-    return new_image;
+    // Batch filter names with a preset reach it through add_point_filter()
+    for (size_t i = 0; i < sizeof(FILTER_PRESETS) / sizeof(FILTER_PRESETS[0]); i++)
+    {
+        FilterSpec spec;
+        PointPipeline pipeline;
+        ImageStats none;
+        check(parse_filter_spec(FILTER_PRESETS[i].name, spec) && add_point_filter(pipeline, spec, none) &&
+              pipeline.stages().back().preset == FILTER_PRESETS[i].row,
+              string("preset dispatch ") + FILTER_PRESETS[i].name);
+    }
+
+    cerr << checks - failures << " of " << checks << " checks passed" << endl;
+    return failures == 0 ? 0 : 1;
 }
 
 
-int main()
+int main(int argc, char* argv[])
 {
+    if (argc > 1 && string(argv[1]) == "--benchmark")
+    {
+        return benchmark_main(argc, argv);
+    }
+    if (argc > 1 && string(argv[1]) == "--self-test")
+    {
+        return self_test_main(argc, argv);
+    }
+
+    // Any other command-line arguments select the non-interactive batch mode
+    if (argc > 1)
+    {
+        return batch_main(argc, argv);
+    }
+
     // Welcome message
     cout << endl;
     cout << endl;
     cout << "Welcome to my CSPB 1300 Image Processing Application" << endl;
     cout << endl;
     
-    // Prompt user for input filename
-    cout << "Please enter input BMP filename: ";
-    
-    
     // Variable to store filename
     string filename;
-    
-    // Read filename from user input
-    cin >> filename;                                         
+    shared_ptr<const Image> image;
+
+    // Prompt until the file can be read, so no filter ever runs on an empty image
+    while (true)
+    {
+        // Prompt user for input filename
+        cout << "Please enter input BMP filename: ";
+
+        // Read filename from user input; stop if the input has ended
+        if (!(cin >> filename))
+        {
+            cout << endl;
+            return 1;
+        }
+
+        // Read the BMP image into a packed image, through the cache so it is decoded once
+        image = image_cache().load(filename);
+        if (!image->empty())
+        {
+            break;
+        }
+        cout << filename << " could not be read as a BMP image. \n";
+    }
 
     // Confirm filename is saved
     cout << "BMP filename saved.\n";
     cout << endl;
     cout << endl;
 
-    // Read the BMP image and store it in a 2D vector of Pixel objects
-    vector<vector<Pixel>> image = read_image(filename);
+    // The point filters and the vignette render through here, so running a
+    // filter again with the same settings reuses the result
+    IncrementalRenderer renderer;
+    renderer.set_source(image);
     
     // Variable to store user menu selection
     string selection; 
@@ -885,8 +9976,21 @@ int main()
         // Option 0: Load a new image file
         else if (selection == "0")
         {
+            string new_filename;
             cout << "Please enter your new image filename: ";
-            cin >> filename;
+            cin >> new_filename;
+
+            // Load the new image, or reuse it if it was decoded before and has not changed since
+            shared_ptr<const Image> new_image = image_cache().load(new_filename);
+            if (new_image->empty())
+            {
+                cout << new_filename << " could not be read as a BMP image; keeping " << filename << ".";
+                cout << endl;
+                continue;
+            }
+            filename = new_filename;
+            image = new_image;
+            renderer.set_source(image);
             cout << "Your BMP filename has been saved.";
             cout << endl;
             continue;
@@ -903,8 +10007,8 @@ int main()
             cin >> out_filename;
             cout << endl;
             
-            vector<vector<Pixel>> process1 = process_1(image);
-            write_image(out_filename, process1);
+            renderer.set_stages(vector<RenderStage>(1, vignette_stage()));
+            write_bmp(out_filename, renderer.render());
             
             cout << endl;
             cout << "The Vignette filter has been successfully applied to your image and saved as " << out_filename << "!\n";
@@ -942,8 +10046,9 @@ int main()
             cin >> out_filename;
             cout << endl;
             
-            vector<vector<Pixel>> process2 = process_2(image, scaling_factor);
-            write_image(out_filename, process2);
+            // Production settings run their compiled kernels (see PointPipeline)
+            renderer.set_stages(vector<RenderStage>(1, point_stage(POINT_CLARENDON, scaling_factor)));
+            write_bmp(out_filename, renderer.render());
             
             cout << endl;
             cout << "The Clarendon filter has been successfully applied to your image and has been saved as " << out_filename << "! \n";
@@ -961,8 +10066,8 @@ int main()
             cin >> out_filename;
             cout << endl;
             
-            vector<vector<Pixel>> process3 = process_3(image);
-            write_image(out_filename, process3);
+            renderer.set_stages(vector<RenderStage>(1, point_stage(POINT_GRAYSCALE)));
+            write_bmp(out_filename, renderer.render());
             
             cout << endl;
             cout << "The Grayscale filter has been successfully applied to your image and has been saved as " << out_filename << "! \n";
@@ -980,8 +10085,9 @@ int main()
             cin >> out_filename;
             cout << endl;
             
-            vector<vector<Pixel>> process4 = process_4(image); 
-            write_image(out_filename, process4);
+            Image process4 = process_4(*image);
+            write_bmp(out_filename, process4);
+            image_pool().recycle(move(process4));
             
             cout << endl;
             cout << "The 90 Degree Rotation Clockwise filter has been successfully applied to your image and has been saved as " << out_filename << "! \n";
@@ -1028,8 +10134,9 @@ int main()
             cin >> out_filename; 
             cout << endl;
             
-            vector<vector<Pixel>> process5 = process_5(image, number);
-            write_image(out_filename, process5);
+            Image process5 = process_5(*image, number);
+            write_bmp(out_filename, process5);
+            image_pool().recycle(move(process5));
             cout << endl;
             cout << "The Multiple 90 Degree Rotations filter has successfully been applied to your image and has been saved as " << out_filename << "! \n";
             cout << endl;
@@ -1104,8 +10211,9 @@ int main()
             cin >> out_filename;
             cout<< endl;
             
-            vector<vector<Pixel>> process6 = process_6(image, x_scale, y_scale);
-            write_image(out_filename, process6);
+            Image process6 = process_6(*image, x_scale, y_scale);
+            write_bmp(out_filename, process6);
+            image_pool().recycle(move(process6));
             
             cout << "The Enlarged filter has been successfully applied to your image and has been saved as " << out_filename << "! \n";
             cout << endl;
@@ -1122,8 +10230,8 @@ int main()
             cin >> out_filename;
             cout << endl;
             
-            vector<vector<Pixel>> process7 = process_7(image);
-            write_image(out_filename, process7);
+            renderer.set_stages(vector<RenderStage>(1, point_stage(POINT_HIGH_CONTRAST)));
+            write_bmp(out_filename, renderer.render());
             
             cout << "The High Contrast filter has been successfully applied to your image and has been saved as " << out_filename << "! \n";
             cout << endl;
@@ -1162,8 +10270,8 @@ int main()
             cin >> out_filename;             
             cout << endl;
             
-            vector<vector<Pixel>> process8 = process_8(image, scaling_factor);
-            write_image(out_filename, process8);
+            renderer.set_stages(vector<RenderStage>(1, point_stage(POINT_LIGHTEN, scaling_factor)));
+            write_bmp(out_filename, renderer.render());
             
             cout << "The Lighten filter has been successfully applied to your image and has been saved as " << out_filename << "! \n";
             cout << endl;
@@ -1209,8 +10317,8 @@ int main()
             cin >> out_filename; 
             cout << endl;
             
-            vector<vector<Pixel>> process9 = process_9(image, scaling_factor);
-            write_image(out_filename, process9);
+            renderer.set_stages(vector<RenderStage>(1, point_stage(POINT_DARKEN, scaling_factor)));
+            write_bmp(out_filename, renderer.render());
             
             cout << endl;
             cout << "The Darken filter has been successfully applied to your image and has been saved as " << out_filename << "! \n";
@@ -1228,8 +10336,8 @@ int main()
             cin >> out_filename;
             cout <<endl;
             
-            vector<vector<Pixel>> process10 = process_10(image); 
-            write_image(out_filename, process10);
+            renderer.set_stages(vector<RenderStage>(1, point_stage(POINT_COLOR_DOMINANCE)));
+            write_bmp(out_filename, renderer.render());
             
             cout << endl;
             cout << "The Black, White, Red, Green, Blue filter has been successfully applied to your image and has been saved as " << out_filename << "! \n";